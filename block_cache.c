@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_cache.h"
+
+#define INDEX_MAGIC 0x46505849 // "FPXI"
+#define INDEX_VERSION 1
+// Magic, version, size, ETag length and ETag
+#define INDEX_HEADER_SIZE (4 + 1 + 4 + 1 + JOURNAL_MAX_ETAG)
+#define INDEX_SUFFIX ".idx"
+#define TMP_SUFFIX ".tmp"
+
+static const uint8_t no_hash[IMAGE_HASH_SIZE];
+
+static bool sha256(const uint8_t *data, size_t len, uint8_t *digest) {
+  image_hash_t hash;
+  if (!image_hash_init(&hash)) {
+    return false;
+  }
+  if (!image_hash_update(&hash, data, len)) {
+    image_hash_free(&hash);
+    return false;
+  }
+  return image_hash_final(&hash, digest);
+}
+
+static void hex_name(const uint8_t *digest, char *name) {
+  for (size_t i = 0; i < IMAGE_HASH_SIZE; i++) {
+    sprintf(name + 2 * i, "%02x", digest[i]);
+  }
+}
+
+static void unit_file(const block_cache_t *cache, const uint8_t *digest,
+                      char *path, size_t path_len) {
+  char name[2 * IMAGE_HASH_SIZE + 1];
+  hex_name(digest, name);
+  snprintf(path, path_len, "%s/%s", cache->dir, name);
+}
+
+static size_t units_for(uint32_t size) {
+  return (size + BLOCK_CACHE_UNIT_SIZE - 1) / BLOCK_CACHE_UNIT_SIZE;
+}
+
+static bool alloc_hashes(block_cache_t *cache, uint32_t size) {
+  size_t count = units_for(size);
+  if (count == 0 || count > BLOCK_CACHE_MAX_UNITS) {
+    printf("Can't cache an image of %u bytes\n", size);
+    return false;
+  }
+  free(cache->hashes);
+  cache->hashes = calloc(count, IMAGE_HASH_SIZE);
+  if (!cache->hashes) {
+    printf("Could not allocate block cache index\n");
+    cache->unit_count = 0;
+    return false;
+  }
+  cache->unit_count = count;
+  cache->size = size;
+  return true;
+}
+
+static bool load_index(block_cache_t *cache) {
+  FILE *fp = fopen(cache->index_file, "r+b");
+  if (!fp) {
+    return false;
+  }
+  uint32_t magic = 0;
+  uint8_t version = 0;
+  uint32_t size = 0;
+  uint8_t etag_len = 0;
+  bool ok = fread(&magic, sizeof(magic), 1, fp) == 1 &&
+            magic == INDEX_MAGIC &&
+            fread(&version, sizeof(version), 1, fp) == 1 &&
+            version == INDEX_VERSION &&
+            fread(&size, sizeof(size), 1, fp) == 1 &&
+            fread(&etag_len, sizeof(etag_len), 1, fp) == 1 &&
+            etag_len <= JOURNAL_MAX_ETAG &&
+            fread(cache->etag, sizeof(cache->etag), 1, fp) == 1 &&
+            alloc_hashes(cache, size) &&
+            fread(cache->hashes, IMAGE_HASH_SIZE, cache->unit_count, fp) ==
+                cache->unit_count;
+  if (!ok) {
+    printf("Ignoring invalid cache index %s\n", cache->index_file);
+    fclose(fp);
+    free(cache->hashes);
+    cache->hashes = NULL;
+    cache->unit_count = 0;
+    cache->size = 0;
+    return false;
+  }
+  cache->etag_len = etag_len;
+  cache->index = fp;
+  return true;
+}
+
+bool block_cache_open(block_cache_t *cache, const char *dir, const char *key) {
+  memset(cache, 0, sizeof(*cache));
+  // Unit and index paths are sized for a directory that fits here
+  if (snprintf(cache->dir, sizeof(cache->dir), "%s", dir) >=
+      (int)sizeof(cache->dir)) {
+    printf("**** Cache directory path is too long: %s\n", dir);
+    return false;
+  }
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    printf("**** Could not create cache directory %s: %s\n", dir,
+           strerror(errno));
+    return false;
+  }
+  uint8_t digest[IMAGE_HASH_SIZE];
+  if (!sha256((const uint8_t *)key, strlen(key), digest)) {
+    return false;
+  }
+  char name[2 * IMAGE_HASH_SIZE + 1];
+  hex_name(digest, name);
+  snprintf(cache->index_file, sizeof(cache->index_file), "%s/%s%s", dir, name,
+           INDEX_SUFFIX);
+  load_index(cache);
+  return true;
+}
+
+bool block_cache_same_image(const block_cache_t *cache, uint32_t size,
+                            const uint8_t *etag, size_t etag_len) {
+  return cache->index && cache->size == size && cache->etag_len == etag_len &&
+         memcmp(cache->etag, etag, etag_len) == 0;
+}
+
+bool block_cache_reset(block_cache_t *cache, uint32_t size,
+                       const uint8_t *etag, size_t etag_len) {
+  if (cache->index) {
+    fclose(cache->index);
+    cache->index = NULL;
+  }
+  if (etag_len > JOURNAL_MAX_ETAG) {
+    etag_len = JOURNAL_MAX_ETAG;
+  }
+  memset(cache->etag, 0, sizeof(cache->etag));
+  memcpy(cache->etag, etag, etag_len);
+  cache->etag_len = etag_len;
+  if (!alloc_hashes(cache, size)) {
+    cache->size = 0;
+    return false;
+  }
+
+  FILE *fp = fopen(cache->index_file, "w+b");
+  if (!fp) {
+    printf("**** Could not create cache index %s: %s\n", cache->index_file,
+           strerror(errno));
+    return false;
+  }
+  uint32_t magic = INDEX_MAGIC;
+  uint8_t version = INDEX_VERSION;
+  uint8_t len = etag_len;
+  bool ok = fwrite(&magic, sizeof(magic), 1, fp) == 1 &&
+            fwrite(&version, sizeof(version), 1, fp) == 1 &&
+            fwrite(&size, sizeof(size), 1, fp) == 1 &&
+            fwrite(&len, sizeof(len), 1, fp) == 1 &&
+            fwrite(cache->etag, sizeof(cache->etag), 1, fp) == 1 &&
+            fwrite(cache->hashes, IMAGE_HASH_SIZE, cache->unit_count, fp) ==
+                cache->unit_count &&
+            fflush(fp) == 0;
+  if (!ok) {
+    printf("**** Error writing cache index %s\n", cache->index_file);
+    fclose(fp);
+    unlink(cache->index_file);
+    return false;
+  }
+  cache->index = fp;
+  return true;
+}
+
+bool block_cache_has(const block_cache_t *cache, size_t unit) {
+  return unit < cache->unit_count &&
+         memcmp(cache->hashes[unit], no_hash, IMAGE_HASH_SIZE) != 0;
+}
+
+size_t block_cache_first_missing(const block_cache_t *cache) {
+  size_t unit = 0;
+  while (unit < cache->unit_count && block_cache_has(cache, unit)) {
+    unit++;
+  }
+  return unit;
+}
+
+// Update the unit's entry in the index file
+static bool write_entry(block_cache_t *cache, size_t unit) {
+  long pos = INDEX_HEADER_SIZE + (long)unit * IMAGE_HASH_SIZE;
+  if (!cache->index || fseek(cache->index, pos, SEEK_SET) != 0 ||
+      fwrite(cache->hashes[unit], IMAGE_HASH_SIZE, 1, cache->index) != 1 ||
+      fflush(cache->index) != 0) {
+    printf("**** Error writing cache index %s\n", cache->index_file);
+    return false;
+  }
+  return true;
+}
+
+// Units are written to a temporary file and renamed so a unit file is
+// either complete or missing
+static bool write_unit(const char *path, const uint8_t *data, size_t len) {
+  char tmp[BLOCK_CACHE_MAX_FILE];
+  if (snprintf(tmp, sizeof(tmp), "%s%s", path, TMP_SUFFIX) >=
+      (int)sizeof(tmp)) {
+    printf("**** Cache path is too long: %s\n", path);
+    return false;
+  }
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) {
+    printf("**** Could not write %s: %s\n", tmp, strerror(errno));
+    return false;
+  }
+  bool ok = fwrite(data, 1, len, fp) == len;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp, path) != 0) {
+    printf("**** Could not write %s\n", path);
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+bool block_cache_put(block_cache_t *cache, size_t unit, const uint8_t *data,
+                     size_t len) {
+  if (unit >= cache->unit_count || len > BLOCK_CACHE_UNIT_SIZE) {
+    return false;
+  }
+  uint8_t digest[IMAGE_HASH_SIZE];
+  if (!sha256(data, len, digest)) {
+    return false;
+  }
+  char path[BLOCK_CACHE_MAX_FILE];
+  unit_file(cache, digest, path, sizeof(path));
+  // A unit with the same content may already be stored for another image
+  if (access(path, F_OK) != 0 && !write_unit(path, data, len)) {
+    return false;
+  }
+  memcpy(cache->hashes[unit], digest, IMAGE_HASH_SIZE);
+  return write_entry(cache, unit);
+}
+
+// Forget a unit that can't be read back
+static void drop_unit(block_cache_t *cache, size_t unit) {
+  memset(cache->hashes[unit], 0, IMAGE_HASH_SIZE);
+  write_entry(cache, unit);
+}
+
+bool block_cache_get(block_cache_t *cache, size_t unit, uint8_t *buf,
+                     size_t *len) {
+  if (!block_cache_has(cache, unit)) {
+    return false;
+  }
+  char path[BLOCK_CACHE_MAX_FILE];
+  unit_file(cache, cache->hashes[unit], path, sizeof(path));
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    printf("Cached unit %s is missing\n", path);
+    drop_unit(cache, unit);
+    return false;
+  }
+  *len = fread(buf, 1, BLOCK_CACHE_UNIT_SIZE, fp);
+  bool ok = !ferror(fp);
+  fclose(fp);
+
+  uint8_t digest[IMAGE_HASH_SIZE];
+  if (!ok || !sha256(buf, *len, digest) ||
+      memcmp(digest, cache->hashes[unit], IMAGE_HASH_SIZE) != 0) {
+    printf("Cached unit %s is corrupt\n", path);
+    drop_unit(cache, unit);
+    return false;
+  }
+  return true;
+}
+
+void block_cache_close(block_cache_t *cache) {
+  if (cache->index) {
+    fclose(cache->index);
+    cache->index = NULL;
+  }
+  free(cache->hashes);
+  cache->hashes = NULL;
+  cache->unit_count = 0;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image_hash.h"
+#include "journal.h"
+
+/**
+ * Images are cached in units of this size. Every Block2 block size up to 1024
+ * bytes falls inside a single unit.
+ */
+#define BLOCK_CACHE_UNIT_SIZE 1024
+
+/**
+ * Largest image that can be cached (64 MiB, the same as the journal).
+ */
+#define BLOCK_CACHE_MAX_UNITS JOURNAL_MAX_BLOCKS
+
+#define BLOCK_CACHE_MAX_PATH 256
+
+/**
+ * Room for a file in the cache directory named by a hash, plus a suffix of up
+ * to seven characters.
+ */
+#define BLOCK_CACHE_MAX_FILE (BLOCK_CACHE_MAX_PATH + 1 + 2 * IMAGE_HASH_SIZE + 8)
+
+/**
+ * An image in the on-disk block cache. The units are stored in files named by
+ * the SHA-256 of their content so units that are the same in several images
+ * (or versions of an image) are only stored once. Each image has an index
+ * with its size, ETag and the hash of every unit, written as the units
+ * arrive.
+ */
+typedef struct {
+  char dir[BLOCK_CACHE_MAX_PATH];
+  char index_file[BLOCK_CACHE_MAX_FILE];
+  FILE *index;
+  uint32_t size; // Zero until the image size is known
+  uint8_t etag[JOURNAL_MAX_ETAG];
+  size_t etag_len;
+  size_t unit_count;
+  uint8_t (*hashes)[IMAGE_HASH_SIZE]; // All zeros for a missing unit
+} block_cache_t;
+
+/**
+ * Open the cache for an image. The key identifies the image (the URI it is
+ * fetched from). The index is loaded if the image has been cached before.
+ */
+bool block_cache_open(block_cache_t *cache, const char *dir, const char *key);
+
+/**
+ * Returns true if the index is for an image with this size and ETag.
+ */
+bool block_cache_same_image(const block_cache_t *cache, uint32_t size,
+                            const uint8_t *etag, size_t etag_len);
+
+/**
+ * Start a new index for the image. Units stay on disk and are reused if they
+ * show up in the new image.
+ */
+bool block_cache_reset(block_cache_t *cache, uint32_t size,
+                       const uint8_t *etag, size_t etag_len);
+
+/**
+ * Returns true if the unit is in the cache.
+ */
+bool block_cache_has(const block_cache_t *cache, size_t unit);
+
+/**
+ * The first unit that isn't in the cache. This is the unit count if the whole
+ * image is cached.
+ */
+size_t block_cache_first_missing(const block_cache_t *cache);
+
+/**
+ * Store a unit. Only the last unit of the image can be shorter than
+ * BLOCK_CACHE_UNIT_SIZE.
+ */
+bool block_cache_put(block_cache_t *cache, size_t unit, const uint8_t *data,
+                     size_t len);
+
+/**
+ * Read a unit into a buffer of BLOCK_CACHE_UNIT_SIZE bytes. A unit that is
+ * missing on disk or doesn't match its hash is dropped from the index and
+ * false is returned.
+ */
+bool block_cache_get(block_cache_t *cache, size_t unit, uint8_t *buf,
+                     size_t *len);
+
+/**
+ * Close the index and release the cache.
+ */
+void block_cache_close(block_cache_t *cache);
@@ -1,10 +1,14 @@
 #include <coap2/coap.h>
+#include <openssl/ssl.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "coap.h"
+#include "coap_util.h"
 #include "download.h"
 #include "handlers.h"
 #include "resolve.h"
+#include "session_cache.h"
 
 #define LOG_LEVEL LOG_NOTICE
 #define KEEPALIVE_SECONDS 10
@@ -12,42 +16,111 @@
 
 #define SERVER_ADDR "data.lab5e.com"
 #define SERVER_PORT 5684
+#define REPORT_PATH "u"
 
-static coap_pdu_t *report_request;
-static upgrade_cb_t upgrade_handler;
+// Happy eyeballs (RFC 8305). The other address family is tried when the
+// preferred one hasn't connected after this delay.
+#define CONNECTION_ATTEMPT_DELAY_MS 250
+#define CONNECT_TIMEOUT_SECONDS 15
+
+// Notifications older than this are always accepted (RFC 7641 section 3.4)
+#define OBSERVE_FRESHNESS_SECONDS 128
 
 // This is the message handler that will process responses from the server.
 static void message_handler(coap_context_t *ctx, coap_session_t *session,
                             coap_pdu_t *sent, coap_pdu_t *received,
                             const coap_tid_t id);
 
-bool coap_connect(coap_state_t *state, const char *server_addr, const int port,
-                  const char *cert_file, const char *key_file) {
-  // Resolve server's address
-  coap_address_init(&state->server);
-  if (!resolve_address(server_addr, &state->server.addr.sa)) {
-    printf("Error resolving server address %s\n", server_addr);
-    return false;
-  }
-  state->server.addr.sin.sin_port = htons(port);
+// NACK handler that routes NACKs for block requests to the download
+static void session_nack_handler(coap_context_t *ctx, coap_session_t *session,
+                                 coap_pdu_t *sent, coap_nack_reason_t reason,
+                                 const coap_tid_t id);
 
-  // Resolve local interface address
+static bool connect_session(coap_state_t *state, const char *server_addr,
+                            const int port, coap_proto_t proto,
+                            const char *cert_file, const char *key_file);
 
-  coap_address_init(&state->local);
-  if (!resolve_address("0.0.0.0", &state->local.addr.sa)) {
-    printf("Error resolving loopback address\n");
-    return false;
-  }
+static void apply_rtt(coap_state_t *state);
+
+static coap_session_t *new_session(coap_state_t *state,
+                                   const struct sockaddr_storage *addr,
+                                   coap_address_t *server);
 
+static coap_session_t *race_sessions(coap_state_t *state,
+                                     const resolve_result_t *addrs);
+
+// This is called by libcoap when the TLS connection is set up but before the
+// handshake starts.
+static int resume_tls_session(void *tls_session, coap_dtls_pki_t *setup_data);
+
+bool coap_connect(coap_state_t *state, const char *server_addr, const int port,
+                  coap_proto_t proto, const char *cert_file,
+                  const char *key_file) {
   // Create a context for the session we'll run
   state->ctx = coap_new_context(NULL);
   if (!state->ctx) {
     printf("Could not create CoAP context\n");
     return false;
   }
+  state->owns_ctx = true;
   coap_context_set_keepalive(state->ctx, KEEPALIVE_SECONDS);
+  return connect_session(state, server_addr, port, proto, cert_file,
+                         key_file);
+}
+
+bool coap_connect_context(coap_state_t *state, coap_context_t *ctx,
+                          const char *server_addr, const int port,
+                          coap_proto_t proto, const char *cert_file,
+                          const char *key_file) {
+  state->ctx = ctx;
+  state->owns_ctx = false;
+  return connect_session(state, server_addr, port, proto, cert_file,
+                         key_file);
+}
+
+static bool connect_session(coap_state_t *state, const char *server_addr,
+                            const int port, coap_proto_t proto,
+                            const char *cert_file, const char *key_file) {
+  if (proto != COAP_PROTO_DTLS && proto != COAP_PROTO_TLS) {
+    printf("Unsupported transport %d\n", proto);
+    return false;
+  }
+  if (proto == COAP_PROTO_TLS && !coap_tcp_is_supported()) {
+    printf("CoAP over TCP isn't supported by the CoAP library\n");
+    return false;
+  }
+
+  // Keep the server and credentials around for reconnects
+  if (state->host != server_addr) {
+    strncpy(state->host, server_addr, sizeof(state->host) - 1);
+  }
+  state->port = port;
+  state->proto = proto;
+  state->cert_file = cert_file;
+  state->key_file = key_file;
+  state->failed = false;
+  state->report_tid = COAP_INVALID_TID;
+  // Registrations don't survive the session
+  state->observing = false;
+  // Neither do round trip estimates
+  rtt_init(&state->rtt);
+
+  // Resolve server's address
+  resolve_result_t addrs;
+  metrics_span_t dns_span;
+  metrics_start(&dns_span);
+  if (!resolve_host(server_addr, port, &addrs)) {
+    metrics_end(&dns_span, METRICS_DNS, false, 0);
+    printf("Error resolving server address %s\n", server_addr);
+    return false;
+  }
+  metrics_end(&dns_span, METRICS_DNS, true, 0);
+
+  // The TLS setup callback only gets the context. This points to the state
+  // being connected until the session is set up.
+  coap_set_app_data(state->ctx, state);
 
-  // Create the DTLS session
+  // Create the DTLS session. The same setup is used for TLS.
   memset(&state->dtls, 0, sizeof(state->dtls));
   state->dtls.version = COAP_DTLS_PKI_SETUP_VERSION;
 
@@ -70,6 +143,17 @@ bool coap_connect(coap_state_t *state, const char *server_addr, const int port,
   state->dtls.validate_sni_call_back = NULL; // SNI callback
   state->dtls.sni_call_back_arg = NULL;      // SNI callback
 
+  // Resume the cached session (if any) from an earlier run. This skips the
+  // certificate exchange and validation when the server accepts it.
+  state->session_cache[0] = 0;
+  state->resuming = false;
+  if (state->session_cache_dir) {
+    snprintf(state->session_cache, sizeof(state->session_cache),
+             "%s/%s_%d.%s", state->session_cache_dir, server_addr, port,
+             proto == COAP_PROTO_TLS ? "tls" : "dtls");
+    state->dtls.additional_tls_setup_call_back = resume_tls_session;
+  }
+
   // Set up public key and certificates. Libcoap reads this directly from the
   // file in this version of the library
   state->dtls.pki_key.key_type = COAP_PKI_KEY_PEM;
@@ -77,99 +161,388 @@ bool coap_connect(coap_state_t *state, const char *server_addr, const int port,
   state->dtls.pki_key.key.pem.private_key = key_file;
   state->dtls.pki_key.key.pem.ca_file = cert_file;
 
-  state->session = coap_new_client_session_pki(
-      state->ctx, &state->local, &state->server, COAP_PROTO_DTLS, &state->dtls);
+  // Sessions on a shared context are created without waiting for the
+  // handshake. They use the address family that connected last time. The
+  // connect span of those sessions is ended by the event handler.
+  metrics_start(&state->connect_span);
+  state->session = state->owns_ctx ? race_sessions(state, &addrs)
+                                   : new_session(state, &addrs.addrs[0],
+                                                 &state->server);
 
   if (!state->session) {
+    metrics_end(&state->connect_span, METRICS_CONNECT, false, 0);
     printf("Could not create CoAP session object\n");
     return false;
   }
+  coap_session_set_app_data(state->session, state);
+  apply_rtt(state);
 
   return true;
 }
 
+// Create a session to the address. The local address is the wildcard address
+// of the same family.
+static coap_session_t *new_session(coap_state_t *state,
+                                   const struct sockaddr_storage *addr,
+                                   coap_address_t *server) {
+  coap_address_init(server);
+  server->size = resolve_address_len((const struct sockaddr *)addr);
+  memcpy(&server->addr, addr, server->size);
+
+  coap_address_init(&state->local);
+  if (!resolve_address(addr->ss_family == AF_INET6 ? "::" : "0.0.0.0",
+                       &state->local.addr.sa)) {
+    printf("Error resolving local address\n");
+    return NULL;
+  }
+  state->local.size = resolve_address_len(&state->local.addr.sa);
+  return coap_new_client_session_pki(state->ctx, &state->local, server,
+                                     state->proto, &state->dtls);
+}
+
+static bool session_failed(coap_session_t *session) {
+  return !session || session->state == COAP_SESSION_STATE_NONE;
+}
+
+// Connect to the first address and, if it hasn't connected within the
+// connection attempt delay or has failed, to the first address of the other
+// family. The first session to finish the handshake is kept and the family
+// is remembered for the next connection.
+static coap_session_t *race_sessions(coap_state_t *state,
+                                     const resolve_result_t *addrs) {
+  const struct sockaddr_storage *other = NULL;
+  for (size_t i = 1; i < addrs->count && !other; i++) {
+    if (addrs->addrs[i].ss_family != addrs->addrs[0].ss_family) {
+      other = &addrs->addrs[i];
+    }
+  }
+  if (!other) {
+    return new_session(state, &addrs->addrs[0], &state->server);
+  }
+
+  coap_address_t servers[2];
+  coap_session_t *sessions[2] = {
+      new_session(state, &addrs->addrs[0], &servers[0]), NULL};
+  bool started = false;
+  int winner = -1;
+  coap_tick_t start;
+  coap_ticks(&start);
+  while (winner < 0) {
+    coap_tick_t now;
+    coap_ticks(&now);
+    coap_tick_t elapsed_ms = (now - start) * 1000 / COAP_TICKS_PER_SECOND;
+    if (elapsed_ms >= CONNECT_TIMEOUT_SECONDS * 1000) {
+      break;
+    }
+    if (!started && (session_failed(sessions[0]) ||
+                     elapsed_ms >= CONNECTION_ATTEMPT_DELAY_MS)) {
+      sessions[1] = new_session(state, other, &servers[1]);
+      started = true;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (sessions[i] &&
+          sessions[i]->state == COAP_SESSION_STATE_ESTABLISHED) {
+        winner = i;
+        break;
+      }
+    }
+    if (started && session_failed(sessions[0]) &&
+        session_failed(sessions[1])) {
+      break;
+    }
+    if (winner < 0) {
+      coap_run_once(state->ctx, started ? 100 : CONNECTION_ATTEMPT_DELAY_MS);
+    }
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (sessions[i] && i != winner) {
+      coap_session_release(sessions[i]);
+    }
+  }
+  if (winner < 0) {
+    printf("Could not connect to %s:%d\n", state->host, state->port);
+    return NULL;
+  }
+  state->server = servers[winner];
+  metrics_end(&state->connect_span, METRICS_CONNECT, true, 0);
+  resolve_prefer(state->host, &state->server.addr.sa);
+  return sessions[winner];
+}
+
+// Use the estimated timeout for libcoap's retransmissions on the session
+static void apply_rtt(coap_state_t *state) {
+  uint32_t rto = state->rtt.rto_ms;
+  coap_fixed_point_t timeout = {rto / 1000, rto % 1000};
+  coap_session_set_ack_timeout(state->session, timeout);
+  coap_session_set_max_retransmit(state->session,
+                                  rtt_max_retransmit(&state->rtt));
+}
+
+// libcoap doesn't tell us if a confirmable request was retransmitted. The
+// first retransmission is at the earliest after one timeout and the timeout
+// doubles after that so this is the most retransmissions there can have been.
+static int possible_retransmits(const coap_state_t *state, uint32_t rtt_ms) {
+  int n = 0;
+  uint64_t next = state->rtt.rto_ms;
+  while (rtt_ms >= next && n <= RTT_MAX_WEAK_RETRANSMITS) {
+    n++;
+    next += (uint64_t)state->rtt.rto_ms << n;
+  }
+  return n;
+}
+
+void coap_update_rtt(coap_state_t *state, coap_tick_t sent, int retransmits,
+                     bool confirmable) {
+  coap_tick_t now;
+  coap_ticks(&now);
+  uint32_t rtt_ms = (now - sent) * 1000 / COAP_TICKS_PER_SECOND;
+  if (confirmable && !COAP_PROTO_RELIABLE(state->session->proto)) {
+    retransmits += possible_retransmits(state, rtt_ms);
+  }
+  rtt_update(&state->rtt, rtt_ms, retransmits);
+  apply_rtt(state);
+}
+
 bool coap_init(coap_state_t *state, const char *cert_file,
-               const char *key_file) {
+               const char *key_file, const char *session_cache_dir) {
   memset(state, 0, sizeof(*state));
+  state->session_cache_dir = session_cache_dir;
 
   // Initialize the CoAP library
   coap_startup();
   coap_dtls_set_log_level(LOG_LEVEL);
   coap_set_log_level(LOG_LEVEL);
 
-  if (!coap_connect(state, SERVER_ADDR, SERVER_PORT, cert_file, key_file)) {
+  if (!coap_connect(state, SERVER_ADDR, SERVER_PORT, COAP_PROTO_DTLS,
+                    cert_file, key_file)) {
     return false;
   }
+  coap_register_handlers(state);
+  return true;
+}
+
+void coap_register_handlers(coap_state_t *state) {
   // Register a message handler to process responses from the server.
   coap_register_response_handler(state->ctx, message_handler);
-  coap_register_nack_handler(state->ctx, nack_handler);
+  coap_register_nack_handler(state->ctx, session_nack_handler);
+
+  // The event handler flags sessions where the DTLS connection is closed or
+  // fails so they can be reconnected.
+  coap_register_event_handler(state->ctx, event_handler);
+}
 
-  // Enable this handler to get events for DTLS. This can be useful for
-  // debugging if you are having issues connecting.
-  //
-  //  coap_register_event_handler(state->ctx, event_handler);
+bool coap_reconnect(coap_state_t *state) {
+  coap_context_t *shared_ctx = state->owns_ctx ? NULL : state->ctx;
+  coap_disconnect(state);
+  bool connected =
+      shared_ctx ? coap_connect_context(state, shared_ctx, state->host,
+                                        state->port, state->proto,
+                                        state->cert_file, state->key_file)
+                 : coap_connect(state, state->host, state->port, state->proto,
+                                state->cert_file, state->key_file);
+  if (!connected) {
+    coap_disconnect(state);
+    state->failed = true;
+    return false;
+  }
+  coap_register_handlers(state);
   return true;
 }
 
-bool coap_send_report(coap_state_t *state, fota_report_t *report) {
+coap_state_t *coap_get_session(coap_state_t *state, const char *host,
+                               const int port, coap_proto_t proto,
+                               const char *cert_file, const char *key_file) {
+  if (state && state->session && state->port == port &&
+      state->proto == proto && strcmp(state->host, host) == 0) {
+    return state;
+  }
+  coap_state_t *session = malloc(sizeof(coap_state_t));
+  if (!session) {
+    return NULL;
+  }
+  memset(session, 0, sizeof(*session));
+  if (state) {
+    session->session_cache_dir = state->session_cache_dir;
+  }
+  if (!coap_connect(session, host, port, proto, cert_file, key_file)) {
+    coap_disconnect(session);
+    free(session);
+    return NULL;
+  }
+  coap_register_handlers(session);
+  return session;
+}
+
+coap_state_t *coap_add_session(coap_state_t *state, const char *host,
+                               const int port, coap_proto_t proto,
+                               const char *cert_file, const char *key_file) {
+  coap_state_t *session = malloc(sizeof(coap_state_t));
+  if (!session) {
+    return NULL;
+  }
+  memset(session, 0, sizeof(*session));
+  session->session_cache_dir = state->session_cache_dir;
+  if (!coap_connect_context(session, state->ctx, host, port, proto, cert_file,
+                            key_file)) {
+    coap_disconnect(session);
+    free(session);
+    return NULL;
+  }
+  return session;
+}
+
+void coap_release_session(coap_state_t *state, coap_state_t *session) {
+  if (session == state) {
+    return;
+  }
+  coap_disconnect(session);
+  free(session);
+}
+
+// Send the report with the method. The request carries the Observe option if
+// observe is set.
+static bool send_report_request(coap_state_t *state, fota_report_t *report,
+                                uint8_t code, bool observe) {
+  uint8_t report_buf[512];
+  size_t report_len = 0;
+
+  if (!fota_encode_report(report, report_buf, sizeof(report_buf),
+                          &report_len)) {
+    printf("Error enoding report\n");
+    return false;
+  }
+
   // Create a new request (aka PDU) that we'll send
-  report_request = coap_new_pdu(state->session);
+  coap_pdu_t *report_request = coap_new_pdu(state->session);
   if (!report_request) {
     printf("Could not create CoAP request\n");
+    if (report->telemetry) {
+      telemetry_requeue(report->telemetry);
+    }
     return false;
   }
 
   report_request->type = COAP_MESSAGE_CON;
   report_request->tid = coap_new_message_id(state->session);
-  report_request->code = COAP_REQUEST_POST;
+  report_request->code = code;
 
   coap_optlist_t *optlist = NULL;
-  coap_insert_optlist(&optlist, coap_new_optlist(COAP_OPTION_URI_PATH, 1,
-                                                 (const uint8_t *)"u"));
+  if (observe) {
+    // Register (0) with the same token every time
+    coap_add_token(report_request, sizeof(state->observe_token),
+                   state->observe_token);
+    uint8_t buf[4];
+    coap_insert_optlist(
+        &optlist,
+        coap_new_optlist(COAP_OPTION_OBSERVE,
+                         coap_encode_var_safe(buf, sizeof(buf), 0), buf));
+  }
+  coap_insert_optlist(&optlist,
+                      coap_new_optlist(COAP_OPTION_URI_PATH,
+                                       strlen(REPORT_PATH),
+                                       (const uint8_t *)REPORT_PATH));
 
   coap_add_optlist_pdu(report_request, &optlist);
 
   coap_delete_optlist(optlist);
 
-  uint8_t report_buf[512];
-  size_t report_len = 0;
-
-  if (!fota_encode_report(report, report_buf, &report_len)) {
-    printf("Error enoding report\n");
-    return false;
-  }
-
   // Add the payload to the PDU
   coap_add_data(report_request, report_len, report_buf);
 
-  // Send it
-  coap_tid_t tid = coap_send(state->session, report_request);
-  if (tid == COAP_INVALID_TID) {
+  // Send it. libcoap owns the request from here on so only the transaction ID
+  // is kept to match the response.
+  state->report_telemetry = report->telemetry;
+  coap_ticks(&state->report_sent);
+  metrics_start(&state->report_span);
+  state->report_span.bytes = report_len;
+  state->report_tid = coap_send(state->session, report_request);
+  if (state->report_tid == COAP_INVALID_TID) {
     printf("*** Error sending request\n");
+    if (report->telemetry) {
+      telemetry_requeue(report->telemetry);
+    }
+    state->report_telemetry = NULL;
     return false;
   }
 
   return true;
 }
 
-void coap_set_upgrade_handler(upgrade_cb_t handler) {
-  upgrade_handler = handler;
+bool coap_send_report(coap_state_t *state, fota_report_t *report) {
+  return send_report_request(state, report, COAP_REQUEST_POST, false);
+}
+
+bool coap_observe_updates(coap_state_t *state, fota_report_t *report) {
+  if (!state->observing) {
+    random_token(state->observe_token, sizeof(state->observe_token));
+    state->observe_time = 0;
+  }
+  if (!send_report_request(state, report, COAP_REQUEST_FETCH, true)) {
+    return false;
+  }
+  state->observing = true;
+  return true;
+}
+
+void coap_set_upgrade_handler(coap_state_t *state, upgrade_cb_t handler,
+                              void *user_data) {
+  state->upgrade_handler = handler;
+  state->user_data = user_data;
+}
+
+void coap_set_report_done_handler(coap_state_t *state,
+                                  report_done_cb_t handler) {
+  state->report_done_handler = handler;
 }
 
 void coap_wait_for_exchange(coap_state_t *state) {
-  while (!coap_can_exit(state->ctx)) {
+  while (!coap_can_exit(state->ctx) && !state->failed) {
     coap_run_once(state->ctx, 1000);
   }
 }
 
+void coap_disconnect(coap_state_t *state) {
+  if (state->session) {
+    if (state->session_cache[0] &&
+        session_cache_store(state->session_cache, state->session->tls)) {
+      printf("Stored DTLS session for %s:%d\n", state->host, state->port);
+    }
+    coap_session_release(state->session);
+    state->session = NULL;
+  }
+  if (state->ctx && state->owns_ctx) {
+    coap_free_context(state->ctx);
+  }
+  state->ctx = NULL;
+}
+
 void coap_shutdown(coap_state_t *state) {
-  coap_session_release(state->session);
-  coap_free_context(state->ctx);
+  coap_disconnect(state);
   coap_cleanup();
 }
 
+static int resume_tls_session(void *tls_session, coap_dtls_pki_t *setup_data) {
+  // libcoap stores the CoAP session as application data in the SSL object.
+  // DTLS handshakes start before coap_connect has set the state on the
+  // session. Those fall back to the state of the context.
+  coap_session_t *session = SSL_get_app_data((SSL *)tls_session);
+  coap_state_t *state = session ? coap_session_get_app_data(session) : NULL;
+  if (!state && session) {
+    state = coap_get_app_data(session->context);
+  }
+  if (state && state->session_cache[0] &&
+      session_cache_restore(state->session_cache, tls_session)) {
+    printf("Resuming DTLS session for %s:%d\n", state->host, state->port);
+    state->resuming = true;
+  }
+  // Always continue with the handshake. A full handshake is done if the
+  // session can't be resumed.
+  return 1;
+}
+
 // Handle FOTA response from server
-static void handle_report_callback(coap_pdu_t *received) {
+static void handle_report_callback(coap_state_t *state, coap_pdu_t *received) {
 
   size_t len = 0;
   uint8_t *data = NULL;
@@ -189,11 +562,82 @@ static void handle_report_callback(coap_pdu_t *received) {
     // Error decoding response
     return;
   }
-  if (!upgrade_handler) {
+  if (!state->upgrade_handler) {
     // no respnse handler set
     return;
   }
-  upgrade_handler(&resp);
+  state->upgrade_handler(state->user_data, &resp);
+}
+
+// The report exchange has ended with a response or a NACK
+static void report_done(coap_state_t *state, bool ok) {
+  state->report_tid = COAP_INVALID_TID;
+  // The telemetry in a failed report goes out with the next one
+  if (!ok && state->report_telemetry) {
+    telemetry_requeue(state->report_telemetry);
+  }
+  state->report_telemetry = NULL;
+  if (state->report_done_handler) {
+    state->report_done_handler(state->user_data, ok);
+  }
+}
+
+// Returns true if the message has the token of the observe registration
+static bool is_notification(coap_state_t *state, coap_pdu_t *received) {
+  return state->observing &&
+         received->token_length == sizeof(state->observe_token) &&
+         memcmp(received->token, state->observe_token,
+                sizeof(state->observe_token)) == 0;
+}
+
+// Check the order of notifications (RFC 7641 section 3.4). Returns false if
+// the notification is older than the last one. A response without the Observe
+// option ends the observation.
+static bool fresh_notification(coap_state_t *state, coap_pdu_t *received) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option =
+      coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter);
+  if (!option) {
+    printf("Server isn't sending update notifications\n");
+    state->observing = false;
+    return true;
+  }
+  uint32_t seq =
+      coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option));
+  uint32_t last = state->observe_seq;
+  coap_tick_t now;
+  coap_ticks(&now);
+  bool fresh = state->observe_time == 0 ||
+               (last < seq && seq - last < (1 << 23)) ||
+               (last > seq && last - seq > (1 << 23)) ||
+               now > state->observe_time +
+                         OBSERVE_FRESHNESS_SECONDS * COAP_TICKS_PER_SECOND;
+  if (fresh) {
+    state->observe_seq = seq;
+    state->observe_time = now;
+  }
+  return fresh;
+}
+
+// Record the report exchange. The number of retransmissions is estimated the
+// same way as for the RTT.
+static void end_report_span(coap_state_t *state, coap_pdu_t *received) {
+  if (state->report_span.start_us == 0) {
+    return;
+  }
+  size_t len = 0;
+  uint8_t *data = NULL;
+  if (coap_get_data(received, &len, &data)) {
+    state->report_span.bytes += len;
+  }
+  if (!COAP_PROTO_RELIABLE(state->session->proto)) {
+    coap_tick_t now;
+    coap_ticks(&now);
+    state->report_span.retransmits = possible_retransmits(
+        state, (now - state->report_sent) * 1000 / COAP_TICKS_PER_SECOND);
+  }
+  metrics_end(&state->report_span, METRICS_REPORT,
+              COAP_RESPONSE_CLASS(received->code) == 2, received->code);
 }
 
 /**
@@ -202,18 +646,68 @@ static void handle_report_callback(coap_pdu_t *received) {
 static void message_handler(coap_context_t *ctx, coap_session_t *session,
                             coap_pdu_t *sent, coap_pdu_t *received,
                             const coap_tid_t id) {
+  coap_state_t *state = coap_session_get_app_data(session);
+  if (!state) {
+    return;
+  }
+  bool is_report = state->report_tid != COAP_INVALID_TID &&
+                   id == state->report_tid;
+  bool is_update = is_notification(state, received);
+  if (is_report) {
+    end_report_span(state, received);
+    coap_update_rtt(state, state->report_sent, 0, true);
+  }
+  if (!is_report && !is_update && state->download) {
+    coap_download_handle_response(state->download, received);
+    return;
+  }
 
   switch (COAP_RESPONSE_CLASS(received->code)) {
   case 2:
-    if (report_request && id == report_request->tid) {
-      handle_report_callback(received);
+    if (is_report) {
+      state->report_acked = true;
+      // The server has the telemetry that was sent with the report
+      if (state->report_telemetry) {
+        telemetry_flush(state->report_telemetry);
+      }
+      if (is_update) {
+        fresh_notification(state, received);
+      }
+      handle_report_callback(state, received);
+      report_done(state, true);
+    } else if (is_update && fresh_notification(state, received)) {
+      printf("Got update notification\n");
+      handle_report_callback(state, received);
     }
 
     break;
   default:
-    // Any other code is an error
+    // Any other code is an error. An error also ends an observation.
+    if (is_update) {
+      state->observing = false;
+    }
     printf("Got response code %d from server. Don't know how to handle it\n",
            received->code);
+    if (is_report) {
+      report_done(state, false);
+    }
     break;
   }
 }
+
+static void session_nack_handler(coap_context_t *ctx, coap_session_t *session,
+                                 coap_pdu_t *sent, coap_nack_reason_t reason,
+                                 const coap_tid_t id) {
+  coap_state_t *state = coap_session_get_app_data(session);
+  if (state && state->report_tid != COAP_INVALID_TID &&
+      id == state->report_tid) {
+    state->report_span.retransmits = coap_session_get_max_retransmit(session);
+    metrics_end(&state->report_span, METRICS_REPORT, false, 0);
+    report_done(state, false);
+  }
+  if (state && state->download &&
+      coap_download_handle_nack(state->download, reason, id)) {
+    return;
+  }
+  nack_handler(ctx, session, sent, reason, id);
+}
@@ -2,7 +2,27 @@
 #include <coap2/coap.h>
 #include <stdbool.h>
 
+#include "metrics.h"
 #include "reporting.h"
+#include "rtt.h"
+#include "telemetry.h"
+
+#define COAP_MAX_HOST 64
+#define COAP_OBSERVE_TOKEN_SIZE 8
+
+/**
+ * Callback for upgrade handler.
+ */
+typedef void (*upgrade_cb_t)(void *user_data, fota_response_t *resp);
+
+/**
+ * Callback for the end of a report exchange. Ok is true if the server
+ * accepted the report. It is called after the upgrade handler.
+ */
+typedef void (*report_done_cb_t)(void *user_data, bool ok);
+
+struct download_s;
+struct download_config_s;
 
 typedef struct {
   coap_address_t server;
@@ -10,35 +30,156 @@ typedef struct {
   coap_context_t *ctx;
   coap_dtls_pki_t dtls;
   coap_session_t *session;
+  char host[COAP_MAX_HOST];
+  int port;
+  coap_proto_t proto; // COAP_PROTO_DTLS or COAP_PROTO_TLS
+  const char *cert_file;
+  const char *key_file;
+  const char *session_cache_dir; // NULL when sessions aren't cached
+  char session_cache[128];
+  bool resuming; // The handshake offered the cached session
+  bool owns_ctx; // The context is freed when the state is disconnected
+  bool failed;   // Set when the session has failed and must be reconnected
+  coap_tid_t report_tid;
+  coap_tick_t report_sent;
+  metrics_span_t connect_span; // Ended when the handshake is done
+  metrics_span_t report_span;
+  bool report_acked; // The server has responded to a report on the state
+  telemetry_t *report_telemetry; // Telemetry sent with the report in flight
+  bool observing; // Notifications with the observe token are updates
+  uint8_t observe_token[COAP_OBSERVE_TOKEN_SIZE];
+  uint32_t observe_seq;
+  coap_tick_t observe_time; // When the last notification arrived
+  upgrade_cb_t upgrade_handler;
+  report_done_cb_t report_done_handler;
+  void *user_data;
+  coap_tick_t io_deadline; // Next timer for an external event loop
+  struct download_s *download; // Download running on the session (if any)
+  // Settings for downloads started from the state, NULL for the defaults
+  const struct download_config_s *download_config;
+  // Round trip estimate from the report and block exchanges on the session.
+  // This sets libcoap's retransmission timeout for the session.
+  rtt_estimator_t rtt;
 } coap_state_t;
 
 /**
- * Callback for upgrade handler.
+ * Initialise the CoAP library and connect to the report server. DTLS sessions
+ * are cached between runs in the session cache directory; connections to a
+ * server with a cached session resume it instead of doing a full handshake.
+ * Set the directory to NULL to disable the cache. Sessions set up from the
+ * state use the same directory.
  */
-typedef void (*upgrade_cb_t)(fota_response_t *resp);
+bool coap_init(coap_state_t *state, const char *cert_file, const char *keyfile,
+               const char *session_cache_dir);
 
 /**
- * Initialise the CoAP library
+ * Connect to a server. The transport is either COAP_PROTO_DTLS (CoAP over UDP)
+ * or COAP_PROTO_TLS (CoAP over TCP, RFC 8323). TCP gives larger messages and
+ * BERT blocks for bulk transfers.
  */
-bool coap_init(coap_state_t *state, const char *cert_file, const char *keyfile);
-
 bool coap_connect(coap_state_t *state, const char *server_addr, const int port,
-                  const char *cert_file, const char *key_file);
+                  coap_proto_t proto, const char *cert_file,
+                  const char *key_file);
 
+/**
+ * Connect using an existing CoAP context. Several states can share a context
+ * and run on the same I/O loop. The context isn't freed when the state is
+ * disconnected.
+ */
+bool coap_connect_context(coap_state_t *state, coap_context_t *ctx,
+                          const char *server_addr, const int port,
+                          coap_proto_t proto, const char *cert_file,
+                          const char *key_file);
+
+/**
+ * Close the session and connect to the same server again. The report handlers
+ * are registered on the new session.
+ */
+bool coap_reconnect(coap_state_t *state);
+
+/**
+ * Close the session and free the context. The DTLS session is stored in the
+ * session cache before the connection is closed.
+ */
+void coap_disconnect(coap_state_t *state);
+
+/**
+ * Disconnect and shut down the CoAP library
+ */
 void coap_shutdown(coap_state_t *state);
 
+/**
+ * Get a session to a host and port. The session in the state is reused if it
+ * is connected to the same host and port with the same transport. If not, a
+ * new state is allocated and connected. Release the returned state with
+ * coap_release_session.
+ */
+coap_state_t *coap_get_session(coap_state_t *state, const char *host,
+                               const int port, coap_proto_t proto,
+                               const char *cert_file, const char *key_file);
+
+/**
+ * Connect a new session to a host on the context of the state. The session
+ * runs on the state's I/O loop and uses the handlers registered there.
+ * Release it with coap_release_session.
+ */
+coap_state_t *coap_add_session(coap_state_t *state, const char *host,
+                               const int port, coap_proto_t proto,
+                               const char *cert_file, const char *key_file);
+
+/**
+ * Release a state returned by coap_get_session or coap_add_session. Nothing
+ * happens if the session was shared with the report.
+ */
+void coap_release_session(coap_state_t *state, coap_state_t *session);
+
+/**
+ * Register the response, NACK and event handlers on the state's context.
+ * Responses are routed to the report or download on the session they arrive
+ * on.
+ */
+void coap_register_handlers(coap_state_t *state);
+
 /**
  * Send a version report to the Span backend
  */
 bool coap_send_report(coap_state_t *state, fota_report_t *report);
 
 /**
- * Set handler callback for upgrades
+ * Register for update notifications (RFC 7641). The report is sent as the
+ * payload of a FETCH request with the Observe option on the report resource.
+ * The response and every later notification from the server is passed to the
+ * upgrade handler like the response to a report. Call this again to refresh
+ * the registration; the same token is reused so the server replaces the
+ * registration.
+ */
+bool coap_observe_updates(coap_state_t *state, fota_report_t *report);
+
+/**
+ * Add a round trip sample for an exchange that was first sent at the time.
+ * Retransmits is the number of times the request was sent again by the
+ * caller. For confirmable requests the retransmissions done by libcoap are
+ * estimated from the time the response took. The new timeout and retransmit
+ * limit are used for the following exchanges on the session.
+ */
+void coap_update_rtt(coap_state_t *state, coap_tick_t sent, int retransmits,
+                     bool confirmable);
+
+/**
+ * Set handler callback for upgrades. The user data is passed to the handler.
+ */
+void coap_set_upgrade_handler(coap_state_t *state, upgrade_cb_t handler,
+                              void *user_data);
+
+/**
+ * Set the callback for the end of report exchanges. It gets the user data
+ * set with coap_set_upgrade_handler.
  */
-void coap_set_upgrade_handler(upgrade_cb_t handler);
+void coap_set_report_done_handler(coap_state_t *state,
+                                  report_done_cb_t handler);
 
 /**
  * Wait until CoAP exchange is completed. This will return when all exchanges
- * are completed.
+ * are completed or the session fails.
  */
 void coap_wait_for_exchange(coap_state_t *state);
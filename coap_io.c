@@ -0,0 +1,89 @@
+#include <stdio.h>
+
+#include "coap_io.h"
+#include "download.h"
+
+// libcoap sockets collected for a single turn. Client contexts have one
+// socket per session.
+#define MAX_SOCKETS 8
+// Download timeouts are checked at least this often
+#define MAX_DEADLINE_MS 1000
+
+int coap_io_fd(const coap_state_t *state) {
+  return state->session ? state->session->sock.fd : -1;
+}
+
+bool coap_io_wants_write(const coap_state_t *state) {
+  return state->session &&
+         (state->session->sock.flags &
+          (COAP_SOCKET_WANT_WRITE | COAP_SOCKET_WANT_CONNECT));
+}
+
+coap_tick_t coap_io_deadline(const coap_state_t *state) {
+  return state->io_deadline;
+}
+
+int coap_io_timeout_ms(const coap_state_t *state) {
+  if (state->io_deadline == 0) {
+    return -1;
+  }
+  coap_tick_t now;
+  coap_ticks(&now);
+  if (state->io_deadline <= now) {
+    return 0;
+  }
+  return (state->io_deadline - now) * 1000 / COAP_TICKS_PER_SECOND + 1;
+}
+
+void coap_io_advance(coap_state_t *state) {
+  state->io_deadline = 0;
+  if (!state->ctx) {
+    return;
+  }
+  // This is the first half of coap_run_once. It sends queued messages, runs
+  // retransmissions and sets the flags for the sockets to watch.
+  coap_socket_t *sockets[MAX_SOCKETS];
+  unsigned int num_sockets = 0;
+  coap_tick_t now;
+  coap_ticks(&now);
+  unsigned int timeout_ms =
+      coap_write(state->ctx, sockets, MAX_SOCKETS, &num_sockets, now);
+
+  if (state->download) {
+    // The done callback can free the download
+    unsigned int download_ms = coap_download_poll(state->download);
+    if (state->download && (timeout_ms == 0 || download_ms < timeout_ms)) {
+      timeout_ms = download_ms;
+    }
+  }
+  if (state->download && timeout_ms > MAX_DEADLINE_MS) {
+    timeout_ms = MAX_DEADLINE_MS;
+  }
+  if (timeout_ms > 0) {
+    state->io_deadline = now + (coap_tick_t)timeout_ms *
+                                   COAP_TICKS_PER_SECOND / 1000;
+  }
+}
+
+void coap_io_process(coap_state_t *state, bool readable, bool writable) {
+  coap_session_t *session = state->session;
+  if (!state->ctx || !session) {
+    return;
+  }
+  // The second half of coap_run_once. libcoap reads the sockets flagged as
+  // ready.
+  coap_socket_t *sock = &session->sock;
+  if (readable && (sock->flags & COAP_SOCKET_WANT_READ)) {
+    sock->flags |= COAP_SOCKET_CAN_READ;
+  }
+  if (writable && (sock->flags & COAP_SOCKET_WANT_WRITE)) {
+    sock->flags |= COAP_SOCKET_CAN_WRITE;
+  }
+  if (writable && (sock->flags & COAP_SOCKET_WANT_CONNECT)) {
+    sock->flags |= COAP_SOCKET_CAN_CONNECT;
+  }
+  coap_tick_t now;
+  coap_ticks(&now);
+  coap_read(state->ctx, now);
+  coap_io_advance(state);
+}
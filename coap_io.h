@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <coap2/coap.h>
+
+#include "coap.h"
+
+/**
+ * Non-blocking I/O for running the report and download on a state from an
+ * external event loop (select, poll or epoll) instead of coap_run_once.
+ * Watch the session's socket and call coap_io_process when it is ready and
+ * coap_io_advance when the deadline has passed. Both calls set a new
+ * deadline and the socket can change when the state reconnects, so query
+ * them again after each call. Completion is reported through the upgrade,
+ * report done and download done callbacks.
+ *
+ * Connect with coap_connect_context on a context owned by the application;
+ * coap_connect races address families and blocks until one of them
+ * connects.
+ */
+
+/**
+ * The socket of the state's session, or -1 if there's no session.
+ */
+int coap_io_fd(const coap_state_t *state);
+
+/**
+ * Returns true if the socket should be watched for writing as well as
+ * reading. This is the case while a TCP connection is set up or a send is
+ * blocked.
+ */
+bool coap_io_wants_write(const coap_state_t *state);
+
+/**
+ * When coap_io_advance must be called next, or 0 if no timer is running.
+ */
+coap_tick_t coap_io_deadline(const coap_state_t *state);
+
+/**
+ * Milliseconds until the deadline or -1 if there's none. This can be used as
+ * the timeout for poll or epoll_wait.
+ */
+int coap_io_timeout_ms(const coap_state_t *state);
+
+/**
+ * Send pending messages, retransmit unacknowledged messages and check the
+ * download running on the state for lost blocks. Call this after starting a
+ * report or download and whenever the deadline has passed.
+ */
+void coap_io_advance(coap_state_t *state);
+
+/**
+ * Handle readiness of the socket reported by the event loop. Messages that
+ * have arrived are passed to the handlers and the timers are advanced.
+ */
+void coap_io_process(coap_state_t *state, bool readable, bool writable);
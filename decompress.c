@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "decompress.h"
+
+bool decompress_init(decompress_t *dc, decompress_cb_t callback,
+                     void *user_data) {
+  memset(dc, 0, sizeof(*dc));
+  dc->callback = callback;
+  dc->user_data = user_data;
+  // Streams with a window larger than DECOMPRESS_WINDOW_BITS are rejected by
+  // inflate when the header is read.
+  if (inflateInit2(&dc->stream, DECOMPRESS_WINDOW_BITS) != Z_OK) {
+    printf("Could not initialise decompressor\n");
+    return false;
+  }
+  dc->active = true;
+  return true;
+}
+
+bool decompress_write(decompress_t *dc, const uint8_t *buf, size_t len) {
+  if (!dc->active) {
+    return false;
+  }
+  if (dc->done) {
+    printf("Data after the end of the compressed stream\n");
+    return false;
+  }
+  dc->stream.next_in = (Bytef *)buf;
+  dc->stream.avail_in = len;
+  // Run until the input is used and there's no more output pending
+  do {
+    dc->stream.next_out = dc->out;
+    dc->stream.avail_out = sizeof(dc->out);
+    int ret = inflate(&dc->stream, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      printf("Error decompressing image: %s\n",
+             dc->stream.msg ? dc->stream.msg : "unknown error");
+      return false;
+    }
+    size_t produced = sizeof(dc->out) - dc->stream.avail_out;
+    if (produced > 0 && !dc->callback(dc->user_data, dc->out, produced)) {
+      return false;
+    }
+    if (ret == Z_STREAM_END) {
+      dc->done = true;
+      if (dc->stream.avail_in > 0) {
+        printf("Data after the end of the compressed stream\n");
+        return false;
+      }
+      return true;
+    }
+    if (ret == Z_BUF_ERROR) {
+      // No progress possible until more input arrives
+      return true;
+    }
+  } while (dc->stream.avail_in > 0 || dc->stream.avail_out == 0);
+  return true;
+}
+
+bool decompress_is_complete(const decompress_t *dc) { return dc->done; }
+
+void decompress_end(decompress_t *dc) {
+  if (dc->active) {
+    inflateEnd(&dc->stream);
+  }
+  dc->active = false;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/**
+ * Largest compression window accepted (4 KiB). Images must be compressed with
+ * a window of this size or smaller, ie zlib's windowBits set to 12 or less.
+ * This keeps the memory used by the decompressor fixed at about 12 KiB
+ * regardless of the image size.
+ */
+#define DECOMPRESS_WINDOW_BITS 12
+
+/**
+ * Decompressed data is passed on in chunks of up to this size.
+ */
+#define DECOMPRESS_BUFFER_SIZE 4096
+
+/**
+ * Callback for decompressed data. The data is passed on in order. Return false
+ * to abort.
+ */
+typedef bool (*decompress_cb_t)(void *user_data, const uint8_t *buf,
+                                size_t len);
+
+/**
+ * Streaming decompressor for zlib streams. Compressed data can be fed in
+ * pieces of any size as it arrives.
+ */
+typedef struct {
+  z_stream stream;
+  bool active;
+  bool done;
+  decompress_cb_t callback;
+  void *user_data;
+  uint8_t out[DECOMPRESS_BUFFER_SIZE];
+} decompress_t;
+
+/**
+ * Start decompressing a new stream.
+ */
+bool decompress_init(decompress_t *dc, decompress_cb_t callback,
+                     void *user_data);
+
+/**
+ * Decompress the next part of the stream.
+ */
+bool decompress_write(decompress_t *dc, const uint8_t *buf, size_t len);
+
+/**
+ * Returns true when the end of the stream has been reached.
+ */
+bool decompress_is_complete(const decompress_t *dc);
+
+/**
+ * Release the decompressor.
+ */
+void decompress_end(decompress_t *dc);
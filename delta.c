@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "delta.h"
+
+#define DELTA_MAGIC "FDLT"
+#define DELTA_VERSION 1
+#define HEADER_SIZE (4 + 1 + 4 + 4 + IMAGE_HASH_SIZE)
+
+#define OP_COPY 1
+#define OP_ADD 2
+#define OP_INSERT 3
+
+enum {
+  STATE_HEADER,
+  STATE_OP,
+  STATE_ARGS,
+  STATE_DATA,
+  STATE_DONE,
+  STATE_FAILED,
+};
+
+static uint32_t read_uint32(const uint8_t *buf) {
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+         ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static bool read_old(delta_patch_t *patch, uint32_t offset, uint8_t *buf,
+                     size_t len) {
+  if (offset > patch->old_size || len > patch->old_size - offset) {
+    printf("Patch reads beyond the end of the old image\n");
+    return false;
+  }
+  while (len > 0) {
+    ssize_t n = pread(patch->old_fd, buf, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      printf("Error reading old image: %s\n",
+             n < 0 ? strerror(errno) : "short read");
+      return false;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static bool write_new(delta_patch_t *patch, const uint8_t *buf, size_t len) {
+  if (len > patch->new_size - patch->new_offset) {
+    printf("Patch writes beyond the end of the new image\n");
+    return false;
+  }
+  if (!patch->write_cb(patch->user_data, patch->new_offset, buf, len,
+                       patch->new_size)) {
+    return false;
+  }
+  patch->new_offset += len;
+  return true;
+}
+
+bool delta_init(delta_patch_t *patch, const char *old_image,
+                const uint8_t *old_hash, delta_write_cb_t write_cb,
+                void *user_data) {
+  memset(patch, 0, sizeof(*patch));
+  patch->old_fd = open(old_image, O_RDONLY);
+  if (patch->old_fd < 0) {
+    printf("Could not open old image %s: %s\n", old_image, strerror(errno));
+    return false;
+  }
+  off_t size = lseek(patch->old_fd, 0, SEEK_END);
+  if (size < 0 || size > UINT32_MAX) {
+    printf("Could not get size of old image %s\n", old_image);
+    delta_close(patch);
+    return false;
+  }
+  patch->old_size = size;
+  patch->old_hash = old_hash;
+  patch->write_cb = write_cb;
+  patch->user_data = user_data;
+  patch->state = STATE_HEADER;
+  patch->pending_need = HEADER_SIZE;
+  return true;
+}
+
+static bool parse_header(delta_patch_t *patch) {
+  const uint8_t *hdr = patch->pending;
+  if (memcmp(hdr, DELTA_MAGIC, 4) != 0 || hdr[4] != DELTA_VERSION) {
+    printf("Not a patch or unsupported patch version\n");
+    return false;
+  }
+  uint32_t old_size = read_uint32(hdr + 5);
+  if (old_size != patch->old_size ||
+      (patch->old_hash &&
+       memcmp(hdr + 13, patch->old_hash, IMAGE_HASH_SIZE) != 0)) {
+    printf("Patch is for a different image\n");
+    return false;
+  }
+  patch->new_size = read_uint32(hdr + 9);
+  return true;
+}
+
+// Copy commands have no data in the patch and are done right away
+static bool copy_old(delta_patch_t *patch) {
+  while (patch->remaining > 0) {
+    size_t n = patch->remaining < sizeof(patch->buf) ? patch->remaining
+                                                     : sizeof(patch->buf);
+    if (!read_old(patch, patch->old_offset, patch->buf, n) ||
+        !write_new(patch, patch->buf, n)) {
+      return false;
+    }
+    patch->old_offset += n;
+    patch->remaining -= n;
+  }
+  return true;
+}
+
+// Apply data for an add or insert command
+static bool apply_data(delta_patch_t *patch, const uint8_t *buf, size_t len) {
+  if (patch->op == OP_INSERT) {
+    return write_new(patch, buf, len);
+  }
+  while (len > 0) {
+    size_t n = len < sizeof(patch->buf) ? len : sizeof(patch->buf);
+    if (!read_old(patch, patch->old_offset, patch->buf, n)) {
+      return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+      patch->buf[i] += buf[i];
+    }
+    if (!write_new(patch, patch->buf, n)) {
+      return false;
+    }
+    patch->old_offset += n;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Called when the pending bytes for the current state are complete
+static bool next_state(delta_patch_t *patch) {
+  switch (patch->state) {
+  case STATE_HEADER:
+    if (!parse_header(patch)) {
+      return false;
+    }
+    patch->state = patch->new_size > 0 ? STATE_OP : STATE_DONE;
+    patch->pending_need = 1;
+    return true;
+  case STATE_OP:
+    patch->op = patch->pending[0];
+    if (patch->op != OP_COPY && patch->op != OP_ADD &&
+        patch->op != OP_INSERT) {
+      printf("Unknown patch command %u\n", patch->op);
+      return false;
+    }
+    patch->state = STATE_ARGS;
+    patch->pending_need = patch->op == OP_INSERT ? 4 : 8;
+    return true;
+  case STATE_ARGS:
+    if (patch->op == OP_INSERT) {
+      patch->remaining = read_uint32(patch->pending);
+    } else {
+      patch->old_offset = read_uint32(patch->pending);
+      patch->remaining = read_uint32(patch->pending + 4);
+    }
+    if (patch->op == OP_COPY && !copy_old(patch)) {
+      return false;
+    }
+    patch->state = patch->remaining > 0 ? STATE_DATA : STATE_OP;
+    break;
+  default:
+    return false;
+  }
+  if (patch->state == STATE_OP && patch->new_offset == patch->new_size) {
+    patch->state = STATE_DONE;
+  }
+  patch->pending_need = 1;
+  return true;
+}
+
+bool delta_apply(delta_patch_t *patch, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    switch (patch->state) {
+    case STATE_DATA: {
+      size_t n = len < patch->remaining ? len : patch->remaining;
+      if (!apply_data(patch, buf, n)) {
+        patch->state = STATE_FAILED;
+        return false;
+      }
+      buf += n;
+      len -= n;
+      patch->remaining -= n;
+      if (patch->remaining == 0) {
+        patch->state =
+            patch->new_offset == patch->new_size ? STATE_DONE : STATE_OP;
+        patch->pending_need = 1;
+      }
+      break;
+    }
+    case STATE_HEADER:
+    case STATE_OP:
+    case STATE_ARGS: {
+      size_t n = patch->pending_need - patch->pending_len;
+      if (n > len) {
+        n = len;
+      }
+      memcpy(patch->pending + patch->pending_len, buf, n);
+      patch->pending_len += n;
+      buf += n;
+      len -= n;
+      if (patch->pending_len == patch->pending_need) {
+        patch->pending_len = 0;
+        if (!next_state(patch)) {
+          patch->state = STATE_FAILED;
+          return false;
+        }
+      }
+      break;
+    }
+    case STATE_DONE:
+      printf("Data after the end of the patch\n");
+      patch->state = STATE_FAILED;
+      return false;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+bool delta_is_complete(const delta_patch_t *patch) {
+  return patch->state == STATE_DONE;
+}
+
+void delta_close(delta_patch_t *patch) {
+  if (patch->old_fd >= 0) {
+    close(patch->old_fd);
+  }
+  patch->old_fd = -1;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_hash.h"
+
+/**
+ * Old image data is read in chunks of this size while the patch is applied.
+ */
+#define DELTA_BUFFER_SIZE 4096
+
+/**
+ * Callback for the new image. The image is produced in order from offset 0.
+ * The size is the size of the new image. Return false to abort.
+ */
+typedef bool (*delta_write_cb_t)(void *user_data, uint32_t offset,
+                                 const uint8_t *buf, size_t len,
+                                 uint32_t size);
+
+/**
+ * A patch that is applied as it is downloaded. The patch starts with a header
+ * followed by a list of commands that build the new image from the old one:
+ *
+ *   header: "FDLT", version (1 byte), old size (4), new size (4),
+ *           SHA-256 of the old image (32)
+ *   copy:   0x01, old offset (4), length (4)
+ *           Copy bytes from the old image.
+ *   add:    0x02, old offset (4), length (4), length bytes
+ *           Add each byte (mod 256) to the old image bytes. This is the
+ *           bsdiff "diff" block which is mostly zeros for code that moved.
+ *   insert: 0x03, length (4), length bytes
+ *           Bytes that are new in this image.
+ *
+ * Integers are big endian. Only the command being applied is held in memory;
+ * the old image is read from disk as needed.
+ */
+typedef struct {
+  int old_fd;
+  uint32_t old_size;
+  const uint8_t *old_hash;
+  delta_write_cb_t write_cb;
+  void *user_data;
+
+  int state;
+  uint8_t pending[48]; // Header or command being parsed
+  size_t pending_len;
+  size_t pending_need;
+  uint8_t op;
+  uint32_t old_offset;
+  uint32_t remaining;
+  uint32_t new_size;
+  uint32_t new_offset;
+  uint8_t buf[DELTA_BUFFER_SIZE];
+} delta_patch_t;
+
+/**
+ * Prepare to patch the old image. The hash is the SHA-256 of the old image and
+ * the patch is rejected if it was made for a different image. Set it to NULL
+ * to skip the check.
+ */
+bool delta_init(delta_patch_t *patch, const char *old_image,
+                const uint8_t *old_hash, delta_write_cb_t write_cb,
+                void *user_data);
+
+/**
+ * Apply the next part of the patch. Parts can be split anywhere.
+ */
+bool delta_apply(delta_patch_t *patch, const uint8_t *buf, size_t len);
+
+/**
+ * Returns true when the complete new image has been written.
+ */
+bool delta_is_complete(const delta_patch_t *patch);
+
+/**
+ * Close the old image.
+ */
+void delta_close(delta_patch_t *patch);
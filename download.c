@@ -1,58 +1,421 @@
 #include <coap2/coap.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "coap_util.h"
 #include "download.h"
 #include "handlers.h"
+#include "request_template.h"
 
-static coap_state_t state;
-static coap_pdu_t *download;
-static coap_optlist_t *optlist;
-static download_cb_t download_handler;
+// Largest block we can buffer while waiting for earlier blocks. Blocks over
+// UDP are at most 1024 bytes (SZX 6) but BERT blocks over TCP are larger.
+#define MAX_BLOCK_SIZE DOWNLOAD_MAX_BERT_SIZE
+#define MAX_SZX 6
+// SZX 7 asks for BERT blocks (RFC 8323). The block number is in units of
+// 1024 bytes and the payload can be any multiple of 1024 bytes.
+#define BERT_SZX 7
+#define BERT_UNIT 1024
+// Room for the CoAP header, token and options when fitting blocks in a PDU
+#define PDU_OVERHEAD 64
+// The block size is increased after this many blocks without loss
+#define SZX_PROBE_BLOCKS 32
+// The block size is reduced when this many blocks are lost within
+// SZX_LOSS_WINDOW blocks
+#define SZX_LOSS_LIMIT 2
+#define SZX_LOSS_WINDOW 16
+// Number of times a single block is requested before the download is aborted
+#define MAX_BLOCK_RETRIES 4
+#define TOKEN_SIZE REQUEST_TEMPLATE_TOKEN_SIZE
+// How often to ask the ready callback again while the consumer is behind
+#define HELD_POLL_MS 10
+// The journal is written after this many blocks
+#define JOURNAL_SYNC_BLOCKS 64
 
-static void message_handler(coap_context_t *ctx, coap_session_t *session,
-                            coap_pdu_t *sent, coap_pdu_t *received,
-                            const coap_tid_t id);
+// A block request that is either in flight or received and waiting for the
+// blocks in front of it to arrive.
+typedef struct {
+  bool in_use;
+  bool received;
+  uint32_t offset; // Offset of the block in the image
+  uint32_t size;   // Number of bytes requested
+  unsigned int szx;
+  bool more;
+  uint8_t token[TOKEN_SIZE];
+  coap_tid_t tid;
+  coap_tick_t sent; // First transmission of the request
+  metrics_span_t span;
+  coap_tick_t deadline;
+  int retries;
+  size_t len;
+  uint8_t data[MAX_BLOCK_SIZE]; // Keep last. It isn't cleared for new blocks.
+} block_slot_t;
 
-bool coap_download_firmware(const char *hostname, const int port,
-                            const char *path, download_cb_t callback,
-                            const char *cert_file, const char *key_file) {
-  if (!coap_connect(&state, (const char *)hostname, port, cert_file,
-                    key_file)) {
+// The state of a windowed transfer
+struct download_s {
+  coap_state_t *conn;
+  request_template_t request;
+  char path[JOURNAL_MAX_PATH];
+  download_options_t options;
+
+  unsigned int window;
+  unsigned int successes;
+  bool identified;
+  bool resuming;
+  unsigned int unsynced;
+  unsigned int journal_units; // Journal blocks marked as completed
+  bool reliable;              // CoAP over TCP. No loss and no timeouts.
+  size_t bert_size;           // Payload we expect in each BERT block
+
+  // The block size used for new requests. It moves between DOWNLOAD_MIN_SZX
+  // and max_szx depending on loss.
+  unsigned int szx;
+  unsigned int max_szx;
+  unsigned int good_blocks;
+  unsigned int loss_window_blocks;
+  unsigned int recent_losses;
+  bool probing;
+
+  uint32_t total_size; // Zero when the server hasn't sent a Size2 option
+  uint8_t etag[JOURNAL_MAX_ETAG];
+  size_t etag_len;
+  uint32_t next_request;
+  uint32_t next_deliver; // Received in order up to here
+  uint32_t delivered;    // Passed to the callback up to here
+  bool more;
+
+  // With a manifest the blocks are collected in manifest sized units and
+  // passed on when the unit is verified.
+  uint8_t *unit_buf;
+  uint32_t unit_start;
+  size_t unit_len;
+  int unit_retries;
+
+  bool done;
+  bool failed;
+  bool ended; // The done callback has been called
+  bool held;  // No requests are sent until hold_until
+  coap_tick_t hold_until;
+  block_slot_t slots[DOWNLOAD_MAX_WINDOW];
+};
+
+// Used by states without a download configuration
+static const download_config_t default_config = {
+    .window = 1,
+    .proto = COAP_PROTO_DTLS,
+    .block_size = DOWNLOAD_DEFAULT_BLOCK_SIZE,
+};
+
+static unsigned int session_max_szx(coap_session_t *session);
+static void enable_bert(download_t *dl);
+static void new_request(download_t *dl, block_slot_t *slot);
+static bool send_block_request(download_t *dl, block_slot_t *slot);
+static void fill_window(download_t *dl);
+static void save_journal(download_t *dl);
+
+static const download_config_t *state_config(const coap_state_t *state) {
+  return state->download_config ? state->download_config : &default_config;
+}
+
+void coap_download_config_init(download_config_t *config) {
+  *config = default_config;
+}
+
+void coap_set_download_config(coap_state_t *state,
+                              const download_config_t *config) {
+  state->download_config = config;
+}
+
+void coap_set_download_window(download_config_t *config, unsigned int window) {
+  if (window < 1) {
+    window = 1;
+  }
+  if (window > DOWNLOAD_MAX_WINDOW) {
+    window = DOWNLOAD_MAX_WINDOW;
+  }
+  config->window = window;
+}
+
+void coap_set_download_transport(download_config_t *config,
+                                 coap_proto_t proto) {
+  config->proto = proto;
+}
+
+void coap_set_download_block_size(download_config_t *config,
+                                  size_t block_size) {
+  config->block_size = block_size;
+}
+
+void coap_set_download_manifest(download_config_t *config,
+                                const block_manifest_t *manifest) {
+  config->manifest = manifest;
+}
+
+void coap_set_download_stats(download_config_t *config,
+                             download_stats_t *stats) {
+  config->stats = stats;
+}
+
+void coap_set_download_journal(download_config_t *config,
+                               download_journal_t *journal,
+                               download_sync_cb_t sync_cb) {
+  config->journal = journal;
+  config->sync_callback = sync_cb;
+}
+
+// Run a download on a session to the host. Started is set when the first
+// block has been delivered.
+static bool download_over(coap_state_t *state, const char *hostname,
+                          const int port, coap_proto_t proto, const char *path,
+                          const download_options_t *options,
+                          const char *cert_file, const char *key_file,
+                          bool *started) {
+  // Reuse the report session if the image is on the same server
+  coap_state_t *conn =
+      coap_get_session(state, hostname, port, proto, cert_file, key_file);
+  if (!conn) {
     printf("Error connecting to CoAP server\n");
     return false;
   }
-  download_handler = callback;
-
-  coap_register_response_handler(state.ctx, message_handler);
-  coap_register_nack_handler(state.ctx, nack_handler);
-  coap_register_event_handler(state.ctx, event_handler);
+  if (conn == state) {
+    printf("Reusing session to %s:%d for download\n", hostname, port);
+  }
 
-  // Create a new request (aka PDU) that we'll send
-  download = coap_new_pdu(state.session);
-  if (!download) {
-    printf("Could not create CoAP request\n");
+  download_t *dl = coap_download_start(conn, path, options);
+  if (!dl) {
+    coap_release_session(state, conn);
     return false;
   }
-  download->type = COAP_MESSAGE_CON;
-  download->tid = coap_new_message_id(state.session);
-  download->code = COAP_REQUEST_GET;
-  new_token(download);
 
-  set_path_options(path, &optlist);
+  printf("Request sent\n");
+  while (!coap_download_is_done(dl) && !coap_download_has_failed(dl)) {
+    coap_run_once(conn->ctx, coap_download_poll(dl));
+  }
+  bool done = coap_download_is_done(dl);
+  *started = dl->identified;
+  coap_download_free(dl);
+  coap_release_session(state, conn);
+  return done;
+}
+
+void coap_set_download_proxy(download_config_t *config, const char *host,
+                             int port) {
+  config->proxy_host = host;
+  config->proxy_port = port;
+}
 
-  coap_add_optlist_pdu(download, &optlist);
+void coap_set_download_flow_control(download_config_t *config,
+                                    download_ready_cb_t ready_cb) {
+  config->ready_callback = ready_cb;
+}
 
-  // Send it
-  coap_tid_t tid = coap_send(state.session, download);
-  if (tid == COAP_INVALID_TID) {
-    printf("*** Error sending request\n");
-    return false;
+void coap_set_download_pacer(download_config_t *config, pacer_t *pacer) {
+  config->pacer = pacer;
+}
+
+void coap_download_default_options(const coap_state_t *state,
+                                   download_options_t *options,
+                                   download_cb_t callback, void *user_data) {
+  const download_config_t *config = state_config(state);
+  *options = (download_options_t){
+      .window = config->window,
+      .block_size = config->block_size,
+      .journal = config->journal,
+      .manifest = config->manifest,
+      .stats = config->stats,
+      .callback = callback,
+      .sync_callback = config->sync_callback,
+      .ready_callback = config->ready_callback,
+      .pacer = config->pacer,
+      .user_data = user_data,
+  };
+}
+
+coap_proto_t coap_download_transport(const coap_state_t *state) {
+  return state_config(state)->proto;
+}
+
+bool coap_download_firmware(coap_state_t *state, const char *hostname,
+                            const int port, const char *path,
+                            download_cb_t callback, void *user_data,
+                            const char *cert_file, const char *key_file) {
+  const download_config_t *config = state_config(state);
+  download_options_t options;
+  coap_download_default_options(state, &options, callback, user_data);
+  bool started = false;
+  if (config->proxy_host) {
+    // The proxy only listens for DTLS. It fetches the image over DTLS too.
+    char uri[COAP_MAX_HOST + JOURNAL_MAX_PATH + 24];
+    bool ipv6 = strchr(hostname, ':') != NULL;
+    snprintf(uri, sizeof(uri), "coaps://%s%s%s:%d%s%s", ipv6 ? "[" : "",
+             hostname, ipv6 ? "]" : "", port, path[0] == '/' ? "" : "/",
+             path);
+    options.proxy_uri = uri;
+    if (download_over(state, config->proxy_host, config->proxy_port,
+                      COAP_PROTO_DTLS, path, &options, cert_file, key_file,
+                      &started)) {
+      return true;
+    }
+    if (started) {
+      return false;
+    }
+    printf("Download through proxy %s:%d failed, downloading directly\n",
+           config->proxy_host, config->proxy_port);
+    options.proxy_uri = NULL;
+  }
+  if (download_over(state, hostname, port, config->proto, path, &options,
+                    cert_file, key_file, &started)) {
+    return true;
+  }
+  // Not every server accepts CoAP over TCP. Use DTLS if nothing came through.
+  if (config->proto != COAP_PROTO_DTLS && !started) {
+    printf("Download over TLS failed, retrying with DTLS\n");
+    return download_over(state, hostname, port, COAP_PROTO_DTLS, path,
+                         &options, cert_file, key_file, &started);
+  }
+  return false;
+}
+
+download_t *coap_download_start(coap_state_t *state, const char *path,
+                                const download_options_t *options) {
+  if (state->download) {
+    printf("A download is already running on the session\n");
+    return NULL;
+  }
+  download_t *dl = malloc(sizeof(download_t));
+  if (!dl) {
+    printf("Could not allocate download\n");
+    return NULL;
+  }
+  memset(dl, 0, sizeof(*dl));
+  dl->conn = state;
+  dl->options = *options;
+  if (dl->options.window < 1) {
+    dl->options.window = 1;
+  }
+  if (dl->options.window > DOWNLOAD_MAX_WINDOW) {
+    dl->options.window = DOWNLOAD_MAX_WINDOW;
+  }
+  if (dl->options.block_size == 0) {
+    dl->options.block_size = DOWNLOAD_DEFAULT_BLOCK_SIZE;
+  }
+  if (dl->options.offset > 0 || dl->options.length > 0) {
+    // A range is part of a larger download that keeps its own journal
+    dl->options.journal = NULL;
+  }
+  dl->window = 1;
+  dl->reliable = COAP_PROTO_RELIABLE(state->session->proto);
+  strncpy(dl->path, path, sizeof(dl->path) - 1);
+  if (!request_template_init(&dl->request, path, dl->options.proxy_uri)) {
+    free(dl);
+    return NULL;
   }
 
-  printf("Request sent\n");
-  coap_wait_for_exchange(&state);
-  return true;
+  // Start with the preferred block size, limited by what fits in a PDU on
+  // the session.
+  dl->max_szx = session_max_szx(state->session);
+  dl->szx = DOWNLOAD_MIN_SZX;
+  while (dl->szx < dl->max_szx &&
+         (size_t)(1 << (dl->szx + 5)) <= dl->options.block_size) {
+    dl->szx++;
+  }
+
+  // Continue from the first missing block if there's a journal for this
+  // image. The response to the first request tells us if the image on the
+  // server is still the same.
+  download_journal_t *journal = dl->options.journal;
+  if (journal && journal_load(journal) && strcmp(journal->path, path) == 0) {
+    dl->resuming = true;
+    dl->journal_units = journal_first_missing(journal);
+    dl->next_request = dl->journal_units * (1 << (journal->szx + 4));
+    dl->next_deliver = dl->next_request;
+    printf("Resuming download of %s from offset %u\n", path,
+           dl->next_request);
+  }
+
+  if (dl->options.offset > 0) {
+    dl->next_request = dl->options.offset;
+    dl->next_deliver = dl->next_request;
+  }
+
+  const block_manifest_t *manifest = dl->options.manifest;
+  if (manifest) {
+    dl->unit_buf = malloc(manifest->block_size);
+    if (!dl->unit_buf) {
+      printf("Could not allocate block buffer\n");
+      coap_download_free(dl);
+      return NULL;
+    }
+    // Verification starts at a manifest block
+    dl->next_request -= dl->next_request % manifest->block_size;
+    dl->next_deliver = dl->next_request;
+    dl->unit_start = dl->next_request;
+  }
+  dl->delivered = dl->next_deliver;
+
+  // Responses on the session are handed to the download from here on
+  state->download = dl;
+
+  // The first request goes out alone. The response tells us the block size
+  // the server accepts and (hopefully) the image size so the rest of the
+  // window can be filled.
+  new_request(dl, &dl->slots[0]);
+  if (!send_block_request(dl, &dl->slots[0])) {
+    dl->failed = true;
+    coap_download_free(dl);
+    return NULL;
+  }
+  return dl;
+}
+
+bool coap_download_is_held(const download_t *dl) { return dl->held; }
+
+bool coap_download_is_done(const download_t *dl) { return dl->done; }
+
+uint32_t coap_download_size(const download_t *dl) { return dl->total_size; }
+
+size_t coap_download_etag(const download_t *dl, uint8_t *etag,
+                          size_t max_len) {
+  size_t len = dl->etag_len < max_len ? dl->etag_len : max_len;
+  memcpy(etag, dl->etag, len);
+  return len;
+}
+
+bool coap_download_has_more(const download_t *dl) { return dl->more; }
+
+bool coap_download_has_failed(const download_t *dl) {
+  return dl->failed || dl->conn->failed;
+}
+
+void coap_download_free(download_t *dl) {
+  download_journal_t *journal = dl->options.journal;
+  if (journal) {
+    if (dl->done) {
+      journal_remove(journal);
+    } else {
+      // Keep what we have for the next attempt
+      save_journal(dl);
+    }
+  }
+  if (dl->conn->download == dl) {
+    dl->conn->download = NULL;
+  }
+  free(dl->unit_buf);
+  free(dl);
+}
+
+static size_t read_etag(coap_pdu_t *received, uint8_t *etag, size_t max_len) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option = coap_check_option(received, COAP_OPTION_ETAG, &opt_iter);
+  if (option == NULL) {
+    return 0;
+  }
+  size_t len = coap_opt_length(option);
+  if (len > max_len) {
+    len = max_len;
+  }
+  memcpy(etag, coap_opt_value(option), len);
+  return len;
 }
 
 static uint32_t read_file_sizes(coap_pdu_t *received) {
@@ -67,85 +430,691 @@ static uint32_t read_file_sizes(coap_pdu_t *received) {
   return 0;
 }
 
-// Handle image download messages
-void handle_download_message(coap_pdu_t *received) {
-  coap_opt_iterator_t opt_iter;
-  coap_opt_t *block_opt =
-      coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
+static size_t szx_size(unsigned int szx) { return 1 << (szx + 4); }
+
+// The unit of the block number for a block size
+static size_t block_unit(unsigned int szx) {
+  return szx == BERT_SZX ? BERT_UNIT : szx_size(szx);
+}
+
+// The largest block size where a response fits in a PDU on the session
+static unsigned int session_max_szx(coap_session_t *session) {
+  size_t max_pdu = coap_session_max_pdu_size(session);
+  unsigned int szx = MAX_SZX;
+  while (szx > DOWNLOAD_MIN_SZX && szx_size(szx) + PDU_OVERHEAD > max_pdu) {
+    szx--;
+  }
+  return szx;
+}
+
+// The largest block size up to the current size that starts at the offset.
+// Blocks must start at a multiple of their size so a larger block size can
+// only be used from an aligned offset.
+static unsigned int aligned_szx(const download_t *dl, uint32_t offset) {
+  unsigned int szx = dl->szx;
+  while (szx > 0 && offset % block_unit(szx) != 0) {
+    szx--;
+  }
+  return szx;
+}
 
-  if (block_opt) {
-    uint16_t block_type = opt_iter.type;
-    unsigned int block_num = coap_opt_block_num(block_opt);
+// Windows larger than one use non-confirmable requests. Loss is detected by
+// the pipeline itself rather than libcoap's retransmission timer.
+static bool confirmable_requests(const download_t *dl) {
+  return dl->options.window == 1;
+}
+
+static unsigned int slots_in_use(const download_t *dl) {
+  unsigned int n = 0;
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    if (dl->slots[i].in_use) {
+      n++;
+    }
+  }
+  return n;
+}
+
+static block_slot_t *find_free_slot(download_t *dl) {
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    if (!dl->slots[i].in_use) {
+      return &dl->slots[i];
+    }
+  }
+  return NULL;
+}
+
+static block_slot_t *find_slot_by_token(download_t *dl, const uint8_t *token,
+                                        size_t len) {
+  if (len != TOKEN_SIZE) {
+    return NULL;
+  }
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    block_slot_t *slot = &dl->slots[i];
+    if (slot->in_use && !slot->received &&
+        memcmp(slot->token, token, TOKEN_SIZE) == 0) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+static block_slot_t *find_slot_by_tid(download_t *dl, coap_tid_t tid) {
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    block_slot_t *slot = &dl->slots[i];
+    if (slot->in_use && !slot->received && slot->tid == tid) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+static block_slot_t *find_received_block(download_t *dl, uint32_t offset) {
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    block_slot_t *slot = &dl->slots[i];
+    if (slot->in_use && slot->received && slot->offset == offset) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+// Set up the slot for the next block in the image
+static void new_request(download_t *dl, block_slot_t *slot) {
+  memset(slot, 0, offsetof(block_slot_t, data));
+  slot->in_use = true;
+  slot->offset = dl->next_request;
+  slot->szx = aligned_szx(dl, slot->offset);
+  slot->size = slot->szx == BERT_SZX ? dl->bert_size : szx_size(slot->szx);
+  dl->next_request += slot->size;
+}
+
+// Switch to BERT blocks on TCP sessions when the preferred block size and the
+// message size negotiated with the server allow blocks larger than 1024
+// bytes. The message size is only known once the session is up so this is
+// done after the first response.
+static void enable_bert(download_t *dl) {
+  size_t max_pdu = coap_session_max_pdu_size(dl->conn->session);
+  size_t size = dl->options.block_size;
+  if (size > MAX_BLOCK_SIZE) {
+    size = MAX_BLOCK_SIZE;
+  }
+  if (max_pdu < PDU_OVERHEAD + size) {
+    size = max_pdu > PDU_OVERHEAD ? max_pdu - PDU_OVERHEAD : 0;
+  }
+  size -= size % BERT_UNIT;
+  if (size <= BERT_UNIT || dl->max_szx < MAX_SZX) {
+    return;
+  }
+  dl->bert_size = size;
+  dl->szx = BERT_SZX;
+  dl->max_szx = BERT_SZX;
+  printf("Using BERT blocks of %zu bytes\n", size);
+}
+
+// Send (or resend) the request for the block in the slot. Each send gets a
+// fresh token so late responses to an earlier attempt are ignored. The PDU is
+// the only allocation per request. libcoap allocates it and coap_send takes
+// ownership, so it can't come from a pool of ours.
+static bool send_block_request(download_t *dl, block_slot_t *slot) {
+  coap_session_t *session = dl->conn->session;
+  coap_pdu_t *request = coap_pdu_init(
+      confirmable_requests(dl) ? COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+      COAP_REQUEST_GET, coap_new_message_id(session), dl->request.pdu_size);
+  if (!request) {
+    printf("Could not create CoAP request\n");
+    return false;
+  }
 
-    if (download_handler) {
-      size_t len = 0;
-      uint8_t *data = NULL;
-      if (coap_get_data(received, &len, &data) == 0) {
-        // No data - ignore
-        printf("No data in payload\n");
+  // The block number is in units of the block size in the request
+  request_template_next_token(&dl->request, slot->token);
+  request_template_apply(&dl->request, request, slot->token,
+                         slot->offset / block_unit(slot->szx), slot->szx);
+
+  // A non-confirmable block is lost when the response doesn't arrive within
+  // the retransmission timeout for the session. The timeout backs off for
+  // every retry of the same block.
+  slot->tid = request->tid;
+  slot->received = false;
+  coap_ticks(&slot->deadline);
+  if (slot->retries == 0) {
+    slot->sent = slot->deadline;
+    metrics_start(&slot->span);
+  }
+  slot->deadline += (coap_tick_t)rtt_timeout_ms(&dl->conn->rtt, slot->retries) *
+                    COAP_TICKS_PER_SECOND / 1000;
+
+  // Send the message. The request is owned by libcoap from here on.
+  if (coap_send(session, request) == COAP_INVALID_TID) {
+    printf("Error sending request for offset %u\n", slot->offset);
+    return false;
+  }
+  if (dl->options.pacer) {
+    pacer_consume(dl->options.pacer, slot->size);
+  }
+  return true;
+}
+
+// Track loss for the block size. Large blocks are split into several IP
+// fragments and the loss of any of them loses the block so the block size is
+// reduced when losses pile up. If this happens right after probing a larger
+// size that size is not tried again.
+static void update_szx_for_loss(download_t *dl) {
+  dl->good_blocks = 0;
+  if (dl->loss_window_blocks > SZX_LOSS_WINDOW) {
+    dl->loss_window_blocks = 0;
+    dl->recent_losses = 0;
+  }
+  if (++dl->recent_losses < SZX_LOSS_LIMIT || dl->szx <= DOWNLOAD_MIN_SZX) {
+    return;
+  }
+  if (dl->probing) {
+    dl->max_szx = dl->szx - 1;
+  }
+  dl->szx--;
+  dl->probing = false;
+  dl->recent_losses = 0;
+  dl->loss_window_blocks = 0;
+  printf("Reducing block size to %zu bytes\n", block_unit(dl->szx));
+}
+
+static void update_szx_for_success(download_t *dl) {
+  dl->loss_window_blocks++;
+  if (++dl->good_blocks < SZX_PROBE_BLOCKS) {
+    return;
+  }
+  dl->good_blocks = 0;
+  dl->probing = false;
+  if (dl->szx < dl->max_szx) {
+    dl->szx++;
+    dl->probing = true;
+    printf("Increasing block size to %zu bytes\n", block_unit(dl->szx));
+  }
+}
+
+// The block in the slot is lost. Request it again and shrink the window.
+static void retry_block(download_t *dl, block_slot_t *slot) {
+  if (++slot->retries > MAX_BLOCK_RETRIES) {
+    printf("Block at offset %u lost %d times. Aborting download\n",
+           slot->offset, MAX_BLOCK_RETRIES);
+    slot->span.retransmits = MAX_BLOCK_RETRIES;
+    metrics_end(&slot->span, METRICS_BLOCK, false, slot->offset);
+    dl->failed = true;
+    return;
+  }
+  dl->window = dl->window / 2;
+  if (dl->window < 1) {
+    dl->window = 1;
+  }
+  dl->successes = 0;
+  if (dl->options.stats) {
+    dl->options.stats->retries++;
+  }
+  update_szx_for_loss(dl);
+  printf("Block at offset %u lost, requesting again (window is %u)\n",
+         slot->offset, dl->window);
+  if (!send_block_request(dl, slot)) {
+    dl->failed = true;
+  }
+}
+
+// Where the download ends. This is the end of the range if one is set and
+// zero if the server hasn't sent the image size.
+static uint32_t download_end(const download_t *dl) {
+  uint32_t end = dl->total_size;
+  if (dl->options.length > 0) {
+    uint32_t range_end = dl->options.offset + dl->options.length;
+    if (end == 0 || range_end < end) {
+      end = range_end;
+    }
+  }
+  return end;
+}
+
+// Stop sending new requests for a while. coap_download_poll fills the window
+// again when the time is up.
+static void hold(download_t *dl, unsigned int ms) {
+  coap_ticks(&dl->hold_until);
+  dl->hold_until += (coap_tick_t)ms * COAP_TICKS_PER_SECOND / 1000;
+  dl->held = true;
+}
+
+// Issue requests until the window is full or every block is requested. If the
+// server didn't tell us the size of the image we can't know where it ends and
+// the next block is requested only when the previous block says there's more.
+static void fill_window(download_t *dl) {
+  uint32_t end = download_end(dl);
+  while (!dl->failed && slots_in_use(dl) < dl->window) {
+    if (end > 0) {
+      if (dl->next_request >= end) {
         return;
       }
-      if (len == 0) {
-        printf("Zero lengt buffer returned\n");
+    } else if (!dl->more || slots_in_use(dl) > 0 ||
+               dl->next_request != dl->next_deliver) {
+      return;
+    }
+    block_slot_t *slot = find_free_slot(dl);
+    if (!slot) {
+      return;
+    }
+    if (dl->options.ready_callback &&
+        !dl->options.ready_callback(dl->options.user_data)) {
+      hold(dl, HELD_POLL_MS);
+      return;
+    }
+    if (dl->options.pacer) {
+      size_t size = dl->szx == BERT_SZX ? dl->bert_size : szx_size(dl->szx);
+      unsigned int delay = pacer_delay_ms(dl->options.pacer, size);
+      if (delay > 0) {
+        hold(dl, delay);
         return;
       }
-      uint32_t max_sz = read_file_sizes(received);
+    }
+    new_request(dl, slot);
+    if (!send_block_request(dl, slot)) {
+      dl->failed = true;
+    }
+  }
+}
 
-      if (!download_handler(block_num, data, len, max_sz)) {
-        printf("Aborting download\n");
+static void save_journal(download_t *dl) {
+  download_journal_t *journal = dl->options.journal;
+  if (!journal || !journal->valid || dl->unsynced == 0) {
+    return;
+  }
+  // The blocks must be on disk before the journal says they are
+  if (dl->options.sync_callback &&
+      !dl->options.sync_callback(dl->options.user_data)) {
+    return;
+  }
+  journal_save(journal);
+  dl->unsynced = 0;
+}
+
+// The journal counts blocks of the size used when the download started.
+// Blocks are delivered in order so every journal block below the delivered
+// offset is complete.
+static void update_journal(download_t *dl) {
+  download_journal_t *journal = dl->options.journal;
+  size_t unit = szx_size(journal->szx);
+  while ((dl->journal_units + 1) * unit <= dl->delivered ||
+         (dl->done && dl->journal_units * unit < dl->delivered)) {
+    journal_mark_block(journal, dl->journal_units++);
+    dl->unsynced++;
+  }
+  if (dl->unsynced >= JOURNAL_SYNC_BLOCKS) {
+    save_journal(dl);
+  }
+}
+
+// Pass data on to the callback
+static bool pass_block(download_t *dl, uint32_t offset, size_t block_size,
+                       uint8_t *data, size_t len, bool last) {
+  if (dl->options.callback &&
+      !dl->options.callback(dl->options.user_data, offset / block_size,
+                            block_size, data, len, dl->total_size)) {
+    printf("Aborting download\n");
+    dl->failed = true;
+    return false;
+  }
+  dl->delivered = offset + len;
+  if (last) {
+    dl->done = true;
+  }
+  if (dl->options.journal) {
+    update_journal(dl);
+  }
+  return true;
+}
+
+// Start over from the first byte of the current manifest block
+static void refetch_unit(download_t *dl) {
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    dl->slots[i].in_use = false;
+  }
+  dl->next_request = dl->unit_start;
+  dl->next_deliver = dl->unit_start;
+  dl->more = true;
+  dl->unit_len = 0;
+}
+
+// Check a complete manifest block and pass it on. A corrupted block is
+// requested again.
+static bool verify_unit(download_t *dl, bool last) {
+  const block_manifest_t *manifest = dl->options.manifest;
+  uint32_t index = dl->unit_start / manifest->block_size;
+  if (!manifest_check_block(manifest, index, dl->unit_buf, dl->unit_len)) {
+    if (++dl->unit_retries > MAX_BLOCK_RETRIES) {
+      printf("Block %u failed verification %d times. Aborting download\n",
+             index, MAX_BLOCK_RETRIES);
+      dl->failed = true;
+      return false;
+    }
+    printf("Block %u failed verification, requesting again\n", index);
+    if (dl->options.stats) {
+      dl->options.stats->retries++;
+    }
+    refetch_unit(dl);
+    return false;
+  }
+  dl->unit_retries = 0;
+  if (!pass_block(dl, dl->unit_start, manifest->block_size, dl->unit_buf,
+                  dl->unit_len, last)) {
+    return false;
+  }
+  dl->unit_start += dl->unit_len;
+  dl->unit_len = 0;
+  return true;
+}
+
+// Collect data in manifest blocks. A download block can be smaller or larger
+// than a manifest block.
+static void collect_block(download_t *dl, uint8_t *data, size_t len,
+                          bool last) {
+  size_t block_size = dl->options.manifest->block_size;
+  while (len > 0 || (last && dl->unit_len > 0)) {
+    size_t n = block_size - dl->unit_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(dl->unit_buf + dl->unit_len, data, n);
+    dl->unit_len += n;
+    data += n;
+    len -= n;
+    if (dl->unit_len == block_size || (last && len == 0)) {
+      if (!verify_unit(dl, last && len == 0)) {
+        return;
       }
     }
+  }
+}
 
-    if (COAP_OPT_BLOCK_MORE(block_opt) && COAP_OPT_BLOCK_MORE(block_opt)) {
+static bool deliver_block(download_t *dl, uint32_t offset, unsigned int szx,
+                          uint8_t *data, size_t len, bool more) {
+  // The last block of a range can go past the end of the range
+  uint32_t end = download_end(dl);
+  if (end > 0 && offset + len > end) {
+    len = end - offset;
+  }
+  dl->next_deliver = offset + len;
+  dl->more = more;
+  bool last = !more || (end > 0 && dl->next_deliver >= end);
+  if (dl->options.manifest) {
+    collect_block(dl, data, len, last);
+    return !dl->failed;
+  }
+  return pass_block(dl, offset, block_unit(szx), data, len, last);
+}
 
-      // There is another block after this - generate a new request for that
-      // block
-      coap_pdu_t *next = coap_new_pdu(state.session);
-      next->type = download->type;
-      next->tid = coap_new_message_id(state.session);
-      next->code = download->code;
+// Hand blocks that were received out of order to the callback once the gap in
+// front of them is filled.
+static void deliver_buffered_blocks(download_t *dl) {
+  block_slot_t *slot;
+  while (!dl->done && !dl->failed &&
+         (slot = find_received_block(dl, dl->next_deliver)) != NULL) {
+    deliver_block(dl, slot->offset, slot->szx, slot->data, slot->len,
+                  slot->more);
+    slot->in_use = false;
+  }
+}
+
+// Start the download over from the first block
+static void restart_download(download_t *dl) {
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    dl->slots[i].in_use = false;
+  }
+  dl->resuming = false;
+  dl->next_request = 0;
+  dl->next_deliver = 0;
+  dl->delivered = 0;
+  dl->unit_start = 0;
+  dl->unit_len = 0;
+  dl->journal_units = 0;
+  dl->window = 1;
+  dl->successes = 0;
+  dl->unsynced = 0;
 
-      new_token(next);
+  block_slot_t *slot = &dl->slots[0];
+  new_request(dl, slot);
+  if (!send_block_request(dl, slot)) {
+    dl->failed = true;
+  }
+}
+
+// Pick up the image size and ETag from the first response. When resuming this
+// checks that the image is the one in the journal. Returns false if the
+// download is restarted.
+static bool identify_image(download_t *dl, coap_pdu_t *received,
+                           unsigned int szx) {
+  download_journal_t *journal = dl->options.journal;
+  uint8_t etag[JOURNAL_MAX_ETAG];
+  size_t etag_len = read_etag(received, etag, sizeof(etag));
+
+  dl->identified = true;
+  dl->total_size = read_file_sizes(received);
+  memcpy(dl->etag, etag, etag_len);
+  dl->etag_len = etag_len;
+  // The journal counts blocks of the first (non-BERT) block size
+  if (szx > MAX_SZX) {
+    szx = MAX_SZX;
+  }
+  if (dl->resuming &&
+      !journal_matches(journal, dl->path, dl->total_size, etag, etag_len)) {
+    printf("Image on server has changed, restarting download\n");
+    journal_reset(journal, dl->path, dl->total_size, szx, etag, etag_len);
+    restart_download(dl);
+    return false;
+  }
+  if (journal && !dl->resuming) {
+    journal_reset(journal, dl->path, dl->total_size, szx, etag, etag_len);
+  }
+  return true;
+}
 
-      // Add the old option list (with the path) from the old request. This
-      // stays the same for each request.
-      coap_add_optlist_pdu(next, &optlist);
+// Handle image download messages
+static void handle_download_message(download_t *dl, coap_pdu_t *received) {
+  block_slot_t *slot =
+      find_slot_by_token(dl, received->token, received->token_length);
+  if (!slot) {
+    // Response to a request we've given up on or already have
+    return;
+  }
+  coap_update_rtt(dl->conn, slot->sent, slot->retries,
+                  confirmable_requests(dl));
 
-      // Add the requested block number for the message. Increment with one
-      // since the more flag is set above.
-      uint8_t buf[4];
-      size_t buflen = coap_encode_var_safe(buf, sizeof(buf),
-                                           ((block_num + 1) << 4) |
-                                               COAP_OPT_BLOCK_SZX(block_opt));
-      coap_add_option(next, block_type, buflen, buf);
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *block_opt =
+      coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
+  if (!block_opt) {
+    printf("No Block2 option in response\n");
+    dl->failed = true;
+    return;
+  }
+  unsigned int block_num = coap_opt_block_num(block_opt);
+  unsigned int szx = COAP_OPT_BLOCK_SZX(block_opt);
+  bool more = COAP_OPT_BLOCK_MORE(block_opt);
+  uint32_t offset = block_num * block_unit(szx);
 
-      download = next;
+  size_t len = 0;
+  uint8_t *data = NULL;
+  if (coap_get_data(received, &len, &data) == 0 || len == 0) {
+    printf("No data in payload for offset %u\n", offset);
+    retry_block(dl, slot);
+    return;
+  }
 
-      // Send the message. The enqueued request will prevent the client from
-      // returning until the response is received.
-      coap_tid_t tid = coap_send(state.session, download);
-      if (tid == COAP_INVALID_TID) {
-        printf("message_handler: error sending new request\n");
+  if (dl->options.stats) {
+    dl->options.stats->bytes += len;
+  }
+  slot->span.retransmits = slot->retries;
+  slot->span.bytes = len;
+  metrics_end(&slot->span, METRICS_BLOCK, true, slot->offset);
+  if (!dl->identified) {
+    if (!identify_image(dl, received, szx)) {
+      return;
+    }
+    if (dl->reliable) {
+      enable_bert(dl);
+      dl->window = dl->options.window;
+    }
+  }
+  if (offset != slot->offset || szx > slot->szx ||
+      (szx != BERT_SZX && len > szx_size(szx))) {
+    printf("Got %zu bytes at offset %u but requested offset %u\n", len,
+           offset, slot->offset);
+    dl->failed = true;
+    return;
+  }
+  if (len > MAX_BLOCK_SIZE) {
+    // Keep what fits of a large BERT block. The rest is requested again.
+    len = MAX_BLOCK_SIZE;
+    more = true;
+  }
+  if (szx < slot->szx) {
+    // The server prefers smaller blocks. Use that size from now on.
+    printf("Server reduced block size to %zu bytes\n", szx_size(szx));
+    dl->szx = szx;
+    dl->max_szx = szx;
+    slot->szx = szx;
+  }
+  if (more && len != slot->size) {
+    // The block is not the size we asked for. Request the rest of the block
+    // again along with the blocks after it. BERT blocks continue with the
+    // size the server sends.
+    if (szx == BERT_SZX) {
+      dl->bert_size = len;
+    }
+    dl->next_request = offset + len;
+    for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+      if (dl->slots[i].in_use && dl->slots[i].offset > offset) {
+        dl->slots[i].in_use = false;
       }
     }
   }
+  update_szx_for_success(dl);
+
+  // Grow the window by one block for each window's worth of blocks received
+  // without loss.
+  if (++dl->successes >= dl->window) {
+    dl->successes = 0;
+    if (dl->window < dl->options.window) {
+      dl->window++;
+    }
+  }
+
+  if (offset == dl->next_deliver) {
+    slot->in_use = false;
+    if (!deliver_block(dl, offset, szx, data, len, more)) {
+      return;
+    }
+    deliver_buffered_blocks(dl);
+  } else {
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->more = more;
+    slot->received = true;
+  }
+
+  if (!dl->done) {
+    fill_window(dl);
+  }
 }
 
-/**
- * Message handler function for CoAP messages received from the server.
- */
-static void message_handler(coap_context_t *ctx, coap_session_t *session,
-                            coap_pdu_t *sent, coap_pdu_t *received,
-                            const coap_tid_t id) {
+static void check_timeouts(download_t *dl) {
+  if (confirmable_requests(dl) || dl->reliable || dl->done || dl->failed) {
+    // libcoap retransmits confirmable requests and tells us through the NACK
+    // handler when it gives up. Nothing is lost on TCP.
+    return;
+  }
+  coap_tick_t now;
+  coap_ticks(&now);
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW && !dl->failed; i++) {
+    block_slot_t *slot = &dl->slots[i];
+    if (slot->in_use && !slot->received && slot->deadline <= now) {
+      retry_block(dl, slot);
+    }
+  }
+}
+
+// Time until the first outstanding request times out. This is also the
+// longest we'll block in the libcoap I/O loop.
+static unsigned int next_timeout_ms(const download_t *dl) {
+  unsigned int timeout = 1000;
+  coap_tick_t now;
+  coap_ticks(&now);
+  if (dl->held) {
+    coap_tick_t ms = dl->hold_until > now ? (dl->hold_until - now) * 1000 /
+                                                COAP_TICKS_PER_SECOND
+                                          : 0;
+    if (ms < timeout) {
+      timeout = ms > 0 ? ms : 1;
+    }
+  }
+  if (confirmable_requests(dl) || dl->reliable) {
+    return timeout;
+  }
+  for (int i = 0; i < DOWNLOAD_MAX_WINDOW; i++) {
+    const block_slot_t *slot = &dl->slots[i];
+    if (slot->in_use && !slot->received) {
+      if (slot->deadline <= now) {
+        return 1;
+      }
+      coap_tick_t ms = (slot->deadline - now) * 1000 / COAP_TICKS_PER_SECOND;
+      if (ms < timeout) {
+        timeout = ms > 0 ? ms : 1;
+      }
+    }
+  }
+  return timeout;
+}
+
+unsigned int coap_download_poll(download_t *dl) {
+  check_timeouts(dl);
+  if (dl->held && !dl->done && !dl->failed) {
+    coap_tick_t now;
+    coap_ticks(&now);
+    if (now >= dl->hold_until) {
+      dl->held = false;
+      fill_window(dl);
+    } else if (dl->options.pacer && pacer_is_paused(dl->options.pacer) &&
+               slots_in_use(dl) == 0) {
+      // Paused outside the download windows. The journal is brought up to
+      // date so the download resumes from here if the device restarts.
+      save_journal(dl);
+    }
+  }
+  if (!dl->ended && (dl->done || coap_download_has_failed(dl))) {
+    dl->ended = true;
+    if (dl->options.done_callback) {
+      // The callback may free the download
+      dl->options.done_callback(dl->options.user_data, dl->done);
+      return 1;
+    }
+  }
+  return next_timeout_ms(dl);
+}
+
+void coap_download_handle_response(download_t *dl, coap_pdu_t *received) {
   switch (COAP_RESPONSE_CLASS(received->code)) {
   case 2:
-    handle_download_message(received);
+    handle_download_message(dl, received);
 
     break;
   default:
     // Any other code is an error
     printf("Got response code %d from server. Don't know how to handle it\n",
            received->code);
+    dl->failed = true;
     break;
   }
-}
\ No newline at end of file
+}
+
+bool coap_download_handle_nack(download_t *dl, coap_nack_reason_t reason,
+                               const coap_tid_t id) {
+  // A block that libcoap gives up on is requested again
+  block_slot_t *slot = find_slot_by_tid(dl, id);
+  if (!slot || reason == COAP_NACK_TLS_FAILED || reason == COAP_NACK_RST) {
+    return false;
+  }
+  retry_block(dl, slot);
+  return true;
+}
@@ -5,13 +5,301 @@
 #include <coap2/coap.h>
 
 #include "coap.h"
+#include "journal.h"
+#include "manifest.h"
+#include "pacer.h"
 
-typedef bool (*download_cb_t)(int block_num, uint8_t *buf, size_t block_size,
+/**
+ * Upper limit for the number of Block2 requests that can be in flight at the
+ * same time.
+ */
+#define DOWNLOAD_MAX_WINDOW 16
+
+/**
+ * Smallest block size (SZX 2, 64 bytes) used when the block size is reduced
+ * because of loss.
+ */
+#define DOWNLOAD_MIN_SZX 2
+
+/**
+ * Block size requested when no other size is set.
+ */
+#define DOWNLOAD_DEFAULT_BLOCK_SIZE 1024
+
+/**
+ * Largest BERT block used for downloads over TCP.
+ */
+#define DOWNLOAD_MAX_BERT_SIZE 8192
+
+/**
+ * Callback for downloaded blocks. The block size is the size of this block and
+ * the block starts at block_num * block_size in the image. The block size can
+ * change during the download so use the offset rather than the block number to
+ * track progress. The length of the last block may be shorter than the block
+ * size. The max size is the image size reported by the server or 0 if it is
+ * unknown. Return false to abort the download.
+ */
+typedef bool (*download_cb_t)(void *user_data, int block_num,
+                              size_t block_size, uint8_t *buf, size_t len,
                               uint32_t max_size);
 
 /**
- * Download the firmware via blockwise transfer.
+ * Callback to make the blocks delivered so far durable. This is called before
+ * the download journal is written with the same user data as the block
+ * callback.
+ */
+typedef bool (*download_sync_cb_t)(void *user_data);
+
+/**
+ * Callback for the end of a download. Ok is true if every block was
+ * delivered. The download can be freed in the callback.
+ */
+typedef void (*download_done_cb_t)(void *user_data, bool ok);
+
+/**
+ * Callback to hold the download back. No new block requests are sent while
+ * it returns false; coap_download_poll asks again.
+ */
+typedef bool (*download_ready_cb_t)(void *user_data);
+
+/**
+ * Counters for a download. These are updated as the download runs.
+ */
+typedef struct {
+  uint32_t bytes;   // Payload bytes received
+  uint32_t retries; // Block requests sent again
+} download_stats_t;
+
+/**
+ * Options for a single download.
+ */
+typedef struct {
+  unsigned int window;                // Max number of requests in flight
+  size_t block_size;                  // Preferred block size, 0 for default
+  download_journal_t *journal;        // Journal for resuming, can be NULL
+  const block_manifest_t *manifest;   // Block hashes to verify, can be NULL
+  download_stats_t *stats;            // Counters for the download, can be NULL
+  download_cb_t callback;             // Called for each block in order
+  download_sync_cb_t sync_callback;   // Called before the journal is written
+  download_done_cb_t done_callback;   // Called by coap_download_poll at the end
+  download_ready_cb_t ready_callback; // Can hold back requests, can be NULL
+  pacer_t *pacer;                     // Paces the block requests, can be NULL
+  void *user_data;                    // Passed to the callbacks
+  uint32_t offset;                    // Start of the range to download. Must be
+                                      // block aligned.
+  uint32_t length;                    // Length of the range, 0 for the rest of
+                                      // the image
+  const char *proxy_uri;              // Sent as Proxy-Uri instead of the path,
+                                      // can be NULL
+} download_options_t;
+
+/**
+ * A download in progress.
+ */
+typedef struct download_s download_t;
+
+/**
+ * Download settings for a client. coap_download_firmware and
+ * coap_download_mirrors build the options for their downloads from the
+ * configuration attached to the state. Set the fields with the
+ * coap_set_download_* functions.
+ */
+typedef struct download_config_s {
+  unsigned int window;
+  coap_proto_t proto;
+  size_t block_size;
+  download_journal_t *journal;
+  download_sync_cb_t sync_callback;
+  download_ready_cb_t ready_callback;
+  const block_manifest_t *manifest;
+  download_stats_t *stats;
+  pacer_t *pacer;
+  const char *proxy_host; // NULL to download directly
+  int proxy_port;
+} download_config_t;
+
+/**
+ * Fill in the built-in defaults: stop-and-wait over DTLS with
+ * DOWNLOAD_DEFAULT_BLOCK_SIZE blocks, no journal and no proxy.
+ */
+void coap_download_config_init(download_config_t *config);
+
+/**
+ * Use the configuration for downloads started from the state. The
+ * configuration isn't copied and must outlive the state. States without a
+ * configuration use the built-in defaults.
+ */
+void coap_set_download_config(coap_state_t *state,
+                              const download_config_t *config);
+
+/**
+ * Set the maximum number of Block2 requests kept in flight during a download.
+ * A window of 1 gives the plain stop-and-wait transfer with confirmable
+ * requests. Larger windows use non-confirmable requests with loss detection in
+ * the client and the window grows and shrinks between 1 and the maximum as
+ * blocks are received or lost. Blocks are always delivered to the download
+ * callback in order.
  */
-bool coap_download_firmware(const char *hostname, const int port,
-                            const char *path, download_cb_t callback,
+void coap_set_download_window(download_config_t *config, unsigned int window);
+
+/**
+ * Set the transport used for downloads, COAP_PROTO_DTLS or COAP_PROTO_TLS. A
+ * download over TLS falls back to DTLS if the server doesn't respond over TCP.
+ */
+void coap_set_download_transport(download_config_t *config,
+                                 coap_proto_t proto);
+
+/**
+ * Set the preferred block size for downloads. Over DTLS the size is rounded
+ * down to a power of two between 64 and 1024 bytes. Over TLS sizes above 1024
+ * bytes use BERT blocks of up to DOWNLOAD_MAX_BERT_SIZE bytes. The size is
+ * limited to what fits in a PDU on the session. During the download the block
+ * size is reduced when blocks are lost and increased again after a run of
+ * blocks without loss. Smaller blocks are used if the server asks for them.
+ */
+void coap_set_download_block_size(download_config_t *config,
+                                  size_t block_size);
+
+/**
+ * Set the manifest used to verify downloaded blocks. Blocks are passed to the
+ * callback in manifest sized blocks once they match the manifest. A block that
+ * doesn't match is downloaded again. Set to NULL to skip verification.
+ */
+void coap_set_download_manifest(download_config_t *config,
+                                const block_manifest_t *manifest);
+
+/**
+ * Set the counters updated by coap_download_firmware. Set to NULL to skip the
+ * counters.
+ */
+void coap_set_download_stats(download_config_t *config,
+                             download_stats_t *stats);
+
+/**
+ * Set the journal used to resume interrupted downloads. When the journal on
+ * disk is for the same image the download continues from the first missing
+ * block. Set the journal to NULL to always download the complete image.
+ */
+void coap_set_download_journal(download_config_t *config,
+                               download_journal_t *journal,
+                               download_sync_cb_t sync_cb);
+
+/**
+ * Download images through a caching proxy. The session is set up to the proxy
+ * and the block requests carry the image's URI in the Proxy-Uri option. If
+ * nothing comes through the proxy the image is downloaded from the server
+ * directly. Set the host to NULL to download directly.
+ */
+void coap_set_download_proxy(download_config_t *config, const char *host,
+                             int port);
+
+/**
+ * Slow the download down to the rate the blocks can be consumed. The ready
+ * callback is asked before each block request is sent. Set it to NULL to
+ * download as fast as the network allows.
+ */
+void coap_set_download_flow_control(download_config_t *config,
+                                    download_ready_cb_t ready_cb);
+
+/**
+ * Pace block requests to a byte rate and to the allowed time windows. Requests
+ * are sent in bursts with the radio idle in between. At the end of a window
+ * the requests in flight complete and the download waits for the next window.
+ * Set the pacer to NULL to download as fast as the network allows.
+ */
+void coap_set_download_pacer(download_config_t *config, pacer_t *pacer);
+
+/**
+ * Fill in the options that coap_download_firmware uses: the configuration of
+ * the state and the callback.
+ */
+void coap_download_default_options(const coap_state_t *state,
+                                   download_options_t *options,
+                                   download_cb_t callback, void *user_data);
+
+/**
+ * The transport in the configuration of the state.
+ */
+coap_proto_t coap_download_transport(const coap_state_t *state);
+
+/**
+ * Download the firmware via blockwise transfer. The session in the state is
+ * used if the image is on the same host and port, otherwise a new session is
+ * set up for the download and closed when it is done. This blocks until the
+ * download is completed or has failed.
+ */
+bool coap_download_firmware(coap_state_t *state, const char *hostname,
+                            const int port, const char *path,
+                            download_cb_t callback, void *user_data,
                             const char *cert_file, const char *key_file);
+
+/**
+ * Start a download on a connected session without waiting for it to complete.
+ * Responses are processed by the session's I/O loop. Call
+ * coap_download_poll after each turn of the loop until the download is done or
+ * has failed and release it with coap_download_free. When a range is set in
+ * the options only that part of the image is downloaded and the journal isn't
+ * used.
+ */
+download_t *coap_download_start(coap_state_t *state, const char *path,
+                                const download_options_t *options);
+
+/**
+ * Check for lost requests. Returns the number of milliseconds until the next
+ * request times out. The done callback is called here once the download has
+ * completed or failed.
+ */
+unsigned int coap_download_poll(download_t *download);
+
+/**
+ * Returns true while new requests are held back by the ready callback or the
+ * pacer.
+ */
+bool coap_download_is_held(const download_t *download);
+
+/**
+ * Returns true when every block has been delivered.
+ */
+bool coap_download_is_done(const download_t *download);
+
+/**
+ * The image size reported by the server. This is 0 until the first block has
+ * arrived or if the server doesn't report the size.
+ */
+uint32_t coap_download_size(const download_t *download);
+
+/**
+ * Copy the ETag the server sent with the first block. Returns the length of
+ * the ETag, 0 if there's none (yet).
+ */
+size_t coap_download_etag(const download_t *download, uint8_t *etag,
+                          size_t max_len);
+
+/**
+ * Returns true if the last block received says there's more of the image.
+ */
+bool coap_download_has_more(const download_t *download);
+
+/**
+ * Returns true if the download has failed.
+ */
+bool coap_download_has_failed(const download_t *download);
+
+/**
+ * Detach the download from its session and free it. An unfinished download is
+ * recorded in the journal.
+ */
+void coap_download_free(download_t *download);
+
+/**
+ * Process a response for the session's download. This is called by the
+ * session's response handler.
+ */
+void coap_download_handle_response(download_t *download, coap_pdu_t *received);
+
+/**
+ * Process a NACK for the session's download. Returns false if the NACK isn't
+ * for a block request.
+ */
+bool coap_download_handle_nack(download_t *download, coap_nack_reason_t reason,
+                               const coap_tid_t id);
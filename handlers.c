@@ -1,32 +1,71 @@
 #include <coap2/coap.h>
 #include <stdio.h>
 
+#include "coap.h"
+#include "handlers.h"
+#include "session_cache.h"
+
+// Mark the session as failed. The owner of the state reconnects or gives up.
+static void session_failed(coap_session_t *session) {
+  coap_state_t *state = session ? coap_session_get_app_data(session) : NULL;
+  if (state) {
+    state->failed = true;
+    metrics_end(&state->connect_span, METRICS_CONNECT, false, 0);
+  }
+}
+
+// End the connect span when the handshake is done. This is the DTLS
+// handshake for DTLS sessions and the CSM exchange for TCP sessions.
+static void session_connected(coap_session_t *session) {
+  coap_state_t *state = session ? coap_session_get_app_data(session) : NULL;
+  if (state) {
+    state->resuming = false;
+    metrics_end(&state->connect_span, METRICS_CONNECT, true, 0);
+  }
+}
+
+// A handshake that offered a cached session failed. The session is dropped
+// so the next connection does a full handshake.
+static void handshake_failed(coap_session_t *session) {
+  coap_state_t *state = session ? coap_session_get_app_data(session) : NULL;
+  if (state && state->resuming) {
+    printf("Discarding cached DTLS session for %s:%d\n", state->host,
+           state->port);
+    session_cache_remove(state->session_cache);
+    state->resuming = false;
+  }
+}
+
 int event_handler(coap_context_t *ctx, coap_event_t event,
                   coap_session_t *session) {
   switch (event) {
   case COAP_EVENT_DTLS_CLOSED:
     printf("Event: DTLS closed\n");
-    // This exits the program but you might want to restart the connection
-    // process somehow.
-    exit(1);
+    session_failed(session);
     break;
   case COAP_EVENT_DTLS_CONNECTED:
     printf("Event: DTLS connected\n");
+    if (session && !COAP_PROTO_RELIABLE(session->proto)) {
+      session_connected(session);
+    }
     break;
   case COAP_EVENT_DTLS_RENEGOTIATE:
     printf("Event: DTLS renegotiate\n");
     break;
   case COAP_EVENT_DTLS_ERROR:
     printf("Event: DTLS error\n");
+    handshake_failed(session);
     break;
   case COAP_EVENT_SESSION_CONNECTED:
     printf("Event: Session connected\n");
+    session_connected(session);
     break;
   case COAP_EVENT_SESSION_CLOSED:
     printf("Event: Session closed\n");
     break;
   case COAP_EVENT_SESSION_FAILED:
     printf("Event: Session failed\n");
+    session_failed(session);
     break;
   default:
     printf("Unhandled CoAP event: %04x\n", event);
@@ -56,7 +95,7 @@ void nack_handler(coap_context_t *context, coap_session_t *session,
     break;
   }
 
-  // This terminates the program but you should obviously handle this a bit more
-  // graceful in a real production setting.
-  exit(1);
+  // The request won't be answered. Flag the session so the caller can
+  // reconnect.
+  session_failed(session);
 }
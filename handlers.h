@@ -1,13 +1,17 @@
 #pragma once
 
+#include <coap2/coap.h>
+
 /**
- * Low-level event notifications for the CoAP service
+ * Low-level event notifications for the CoAP service. The session is marked
+ * as failed when the DTLS connection is closed or the session fails.
  */
 int event_handler(coap_context_t *ctx, coap_event_t event,
                   coap_session_t *session);
 
 /**
- * The NACK handler is invoked when a message can't be delivered to the server
+ * The NACK handler is invoked when a message can't be delivered to the server.
+ * The session is marked as failed.
  */
 void nack_handler(coap_context_t *context, coap_session_t *session,
                   coap_pdu_t *sent, coap_nack_reason_t reason,
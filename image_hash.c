@@ -0,0 +1,78 @@
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image_hash.h"
+
+#define READ_BUFFER_SIZE 4096
+
+bool image_hash_init(image_hash_t *hash) {
+  hash->md_ctx = EVP_MD_CTX_new();
+  if (!hash->md_ctx) {
+    return false;
+  }
+  if (EVP_DigestInit_ex(hash->md_ctx, EVP_sha256(), NULL) != 1) {
+    image_hash_free(hash);
+    return false;
+  }
+  return true;
+}
+
+bool image_hash_update(image_hash_t *hash, const uint8_t *buf, size_t len) {
+  return hash->md_ctx && EVP_DigestUpdate(hash->md_ctx, buf, len) == 1;
+}
+
+bool image_hash_final(image_hash_t *hash, uint8_t *digest) {
+  if (!hash->md_ctx) {
+    return false;
+  }
+  bool ok = EVP_DigestFinal_ex(hash->md_ctx, digest, NULL) == 1;
+  image_hash_free(hash);
+  return ok;
+}
+
+void image_hash_free(image_hash_t *hash) {
+  EVP_MD_CTX_free(hash->md_ctx);
+  hash->md_ctx = NULL;
+}
+
+// Hash up to limit bytes from the file
+static bool hash_file(const char *path, image_hash_t *hash, off_t limit) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    printf("Could not open %s for hashing\n", path);
+    return false;
+  }
+  uint8_t buf[READ_BUFFER_SIZE];
+  size_t n;
+  while (limit > 0) {
+    size_t want = limit < (off_t)sizeof(buf) ? (size_t)limit : sizeof(buf);
+    if ((n = fread(buf, 1, want, f)) == 0) {
+      break;
+    }
+    image_hash_update(hash, buf, n);
+    limit -= n;
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  if (!ok) {
+    printf("Error reading %s\n", path);
+  }
+  return ok;
+}
+
+bool image_hash_update_file(image_hash_t *hash, const char *path, off_t len) {
+  return hash_file(path, hash, len);
+}
+
+bool image_hash_file(const char *path, uint8_t *digest) {
+  image_hash_t hash;
+  if (!image_hash_init(&hash)) {
+    return false;
+  }
+  if (!hash_file(path, &hash, INT64_MAX)) {
+    image_hash_free(&hash);
+    return false;
+  }
+  return image_hash_final(&hash, digest);
+}
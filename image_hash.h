@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Size of a SHA-256 digest.
+ */
+#define IMAGE_HASH_SIZE 32
+
+/**
+ * Running SHA-256 over an image.
+ */
+typedef struct {
+  void *md_ctx;
+} image_hash_t;
+
+/**
+ * Start a new hash.
+ */
+bool image_hash_init(image_hash_t *hash);
+
+/**
+ * Add data to the hash.
+ */
+bool image_hash_update(image_hash_t *hash, const uint8_t *buf, size_t len);
+
+/**
+ * Get the digest and release the hash.
+ */
+bool image_hash_final(image_hash_t *hash, uint8_t *digest);
+
+/**
+ * Release the hash without getting the digest.
+ */
+void image_hash_free(image_hash_t *hash);
+
+/**
+ * Add the first len bytes of a file to the hash.
+ */
+bool image_hash_update_file(image_hash_t *hash, const char *path, off_t len);
+
+/**
+ * Hash a file.
+ */
+bool image_hash_file(const char *path, uint8_t *digest);
@@ -0,0 +1,408 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image_sink.h"
+
+#define TMP_SUFFIX ".part"
+
+typedef struct {
+  off_t offset;
+  size_t len;
+  uint8_t data[IMAGE_SINK_SLOT_SIZE];
+} ring_slot_t;
+
+// Single producer, single consumer ring. The network thread only moves head
+// and the writer thread only moves tail so the slots need no lock. The mutex
+// and condition are only used to sleep when the ring is empty or full. A
+// thread sets its waiting flag before it checks the ring for the last time,
+// and the other thread checks the flag after moving its index, with a
+// sequentially consistent fence between the store and the load on both sides.
+// One of them always sees the other's store, so the lock is only taken when a
+// thread is asleep or about to be.
+struct image_sink_writer_s {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_bool writer_waiting;   // The ring was empty
+  atomic_bool producer_waiting; // The ring was full or is being drained
+  atomic_bool failed;
+  bool stop; // Guarded by lock
+  ring_slot_t slots[IMAGE_SINK_RING_SLOTS];
+};
+
+static bool write_fully(int fd, const uint8_t *buf, size_t len, off_t offset);
+static bool write_buffered(image_sink_t *sink, off_t offset,
+                           const uint8_t *buf, size_t len);
+static bool flush_buffer(image_sink_t *sink);
+static bool start_writer(image_sink_t *sink);
+static bool stop_writer(image_sink_t *sink);
+static bool drain_writer(image_sink_t *sink);
+
+// Called with the lock held before the last check of the ring
+static void announce_wait(atomic_bool *waiting) {
+  atomic_store_explicit(waiting, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+// Called after moving head or tail. The fence orders the index store before
+// the load of the other thread's flag.
+static void wake_waiting(struct image_sink_writer_s *w, atomic_bool *waiting) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiting, memory_order_relaxed)) {
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+void image_sink_set_writer_thread(image_sink_t *sink, bool enabled) {
+  sink->use_writer = enabled;
+}
+
+void image_sink_init(image_sink_t *sink, const char *path) {
+  memset(sink, 0, sizeof(*sink));
+  sink->fd = -1;
+  sink->path = path;
+  snprintf(sink->tmp_path, sizeof(sink->tmp_path), "%s%s", path, TMP_SUFFIX);
+}
+
+// A resumed file has the blocks the journal refers to, so it is kept for the
+// next attempt
+static void close_failed(image_sink_t *sink, bool resume) {
+  if (!resume) {
+    image_sink_abort(sink);
+    return;
+  }
+  close(sink->fd);
+  sink->fd = -1;
+}
+
+bool image_sink_open(image_sink_t *sink, uint32_t size, mode_t mode,
+                     bool resume) {
+  if (sink->fd >= 0) {
+    stop_writer(sink);
+    flush_buffer(sink);
+    close(sink->fd);
+  }
+  int flags = O_CREAT | O_WRONLY | (resume ? 0 : O_TRUNC);
+  sink->fd = open(sink->tmp_path, flags, mode);
+  if (sink->fd < 0) {
+    printf("**** Error opening image file %s: %s\n", sink->tmp_path,
+           strerror(errno));
+    return false;
+  }
+  sink->size = size;
+  sink->end = 0;
+  sink->buf_len = 0;
+  if (resume) {
+    sink->end = lseek(sink->fd, 0, SEEK_END);
+  }
+
+  if (size > 0) {
+    // Reserve the space up front so the file system doesn't have to extend
+    // the file for every block.
+    int err = posix_fallocate(sink->fd, 0, size);
+    if (err == EOPNOTSUPP || err == EINVAL) {
+      // The file system can't preallocate. The writes extend the file.
+      err = 0;
+    }
+    if (err != 0) {
+      printf("**** Could not preallocate %u bytes for image: %s\n", size,
+             strerror(err));
+      close_failed(sink, resume);
+      return false;
+    }
+  }
+  if (sink->use_writer && !start_writer(sink)) {
+    close_failed(sink, resume);
+    return false;
+  }
+  return true;
+}
+
+bool image_sink_is_open(const image_sink_t *sink) { return sink->fd >= 0; }
+
+bool image_sink_has_partial(const image_sink_t *sink) {
+  return access(sink->tmp_path, F_OK) == 0;
+}
+
+bool image_sink_write(image_sink_t *sink, off_t offset, const uint8_t *buf,
+                      size_t len) {
+  if (sink->fd < 0) {
+    return false;
+  }
+  if (sink->size > 0 && offset + len > sink->size) {
+    printf("**** Write of %zu bytes at offset %ld is past the image size %u\n",
+           len, (long)offset, sink->size);
+    return false;
+  }
+  struct image_sink_writer_s *w = sink->writer;
+  if (!w) {
+    return write_buffered(sink, offset, buf, len);
+  }
+
+  while (len > 0) {
+    if (atomic_load_explicit(&w->failed, memory_order_relaxed)) {
+      return false;
+    }
+    size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&w->tail, memory_order_acquire) ==
+        IMAGE_SINK_RING_SLOTS) {
+      // The ring is full; the download should have held back before this
+      pthread_mutex_lock(&w->lock);
+      announce_wait(&w->producer_waiting);
+      while (head - atomic_load_explicit(&w->tail, memory_order_acquire) ==
+             IMAGE_SINK_RING_SLOTS) {
+        pthread_cond_wait(&w->cond, &w->lock);
+      }
+      atomic_store_explicit(&w->producer_waiting, false, memory_order_relaxed);
+      pthread_mutex_unlock(&w->lock);
+    }
+    ring_slot_t *slot = &w->slots[head % IMAGE_SINK_RING_SLOTS];
+    size_t n = len < sizeof(slot->data) ? len : sizeof(slot->data);
+    memcpy(slot->data, buf, n);
+    slot->offset = offset;
+    slot->len = n;
+    atomic_store_explicit(&w->head, head + 1, memory_order_release);
+    wake_waiting(w, &w->writer_waiting);
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool image_sink_has_room(const image_sink_t *sink) {
+  const struct image_sink_writer_s *w = sink->writer;
+  if (!w) {
+    return true;
+  }
+  size_t used = atomic_load_explicit(&w->head, memory_order_relaxed) -
+                atomic_load_explicit(&w->tail, memory_order_acquire);
+  return used <= IMAGE_SINK_RING_SLOTS / 2;
+}
+
+// The write path used by the sink's own thread (with no writer thread) or by
+// the writer thread.
+static bool write_buffered(image_sink_t *sink, off_t offset,
+                           const uint8_t *buf, size_t len) {
+  if (offset + len > sink->end) {
+    sink->end = offset + len;
+  }
+
+  // Append to the buffer if this write continues the buffered data
+  if (sink->buf_len > 0 && offset == sink->buf_offset + sink->buf_len &&
+      sink->buf_len + len <= sizeof(sink->buf)) {
+    memcpy(sink->buf + sink->buf_len, buf, len);
+    sink->buf_len += len;
+    return true;
+  }
+  if (!flush_buffer(sink)) {
+    return false;
+  }
+  if (len > sizeof(sink->buf)) {
+    return write_fully(sink->fd, buf, len, offset);
+  }
+  memcpy(sink->buf, buf, len);
+  sink->buf_offset = offset;
+  sink->buf_len = len;
+  return true;
+}
+
+bool image_sink_sync(image_sink_t *sink) {
+  if (sink->fd < 0) {
+    return false;
+  }
+  // The writer stays idle after the drain because only this thread fills
+  // the ring
+  if (!drain_writer(sink) || !flush_buffer(sink)) {
+    return false;
+  }
+  if (fdatasync(sink->fd) != 0) {
+    printf("**** Error syncing image file: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool image_sink_close(image_sink_t *sink) {
+  if (sink->fd < 0) {
+    return false;
+  }
+  bool ret = stop_writer(sink);
+  ret = flush_buffer(sink) && ret;
+  if (ret && sink->size == 0 && ftruncate(sink->fd, sink->end) != 0) {
+    printf("**** Error truncating image file: %s\n", strerror(errno));
+    ret = false;
+  }
+  if (ret && fsync(sink->fd) != 0) {
+    printf("**** Error syncing image file: %s\n", strerror(errno));
+    ret = false;
+  }
+  if (close(sink->fd) != 0) {
+    ret = false;
+  }
+  sink->fd = -1;
+  if (!ret) {
+    unlink(sink->tmp_path);
+    return false;
+  }
+  if (rename(sink->tmp_path, sink->path) != 0) {
+    printf("**** Error renaming %s to %s: %s\n", sink->tmp_path, sink->path,
+           strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void image_sink_suspend(image_sink_t *sink) {
+  if (sink->fd < 0) {
+    return;
+  }
+  image_sink_sync(sink);
+  stop_writer(sink);
+  close(sink->fd);
+  sink->fd = -1;
+}
+
+void image_sink_abort(image_sink_t *sink) {
+  if (sink->fd >= 0) {
+    stop_writer(sink);
+    close(sink->fd);
+    sink->fd = -1;
+  }
+  unlink(sink->tmp_path);
+}
+
+static bool flush_buffer(image_sink_t *sink) {
+  if (sink->buf_len == 0) {
+    return true;
+  }
+  bool ret = write_fully(sink->fd, sink->buf, sink->buf_len, sink->buf_offset);
+  sink->buf_len = 0;
+  return ret;
+}
+
+// Write the entire buffer, retrying on short writes and interrupts.
+static bool write_fully(int fd, const uint8_t *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("**** Error writing image file: %s\n", strerror(errno));
+      return false;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static void *writer_main(void *arg) {
+  image_sink_t *sink = arg;
+  struct image_sink_writer_s *w = sink->writer;
+  while (true) {
+    size_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&w->head, memory_order_acquire)) {
+      pthread_mutex_lock(&w->lock);
+      announce_wait(&w->writer_waiting);
+      while (tail == atomic_load_explicit(&w->head, memory_order_acquire) &&
+             !w->stop) {
+        pthread_cond_wait(&w->cond, &w->lock);
+      }
+      atomic_store_explicit(&w->writer_waiting, false, memory_order_relaxed);
+      bool stop =
+          w->stop && tail == atomic_load_explicit(&w->head,
+                                                  memory_order_acquire);
+      pthread_mutex_unlock(&w->lock);
+      if (stop) {
+        break;
+      }
+      continue;
+    }
+    ring_slot_t *slot = &w->slots[tail % IMAGE_SINK_RING_SLOTS];
+    // After an error the rest of the ring is discarded
+    if (!atomic_load_explicit(&w->failed, memory_order_relaxed) &&
+        !write_buffered(sink, slot->offset, slot->data, slot->len)) {
+      atomic_store_explicit(&w->failed, true, memory_order_relaxed);
+    }
+    atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+    // Wake the network thread if it is waiting for room or a drain
+    wake_waiting(w, &w->producer_waiting);
+  }
+  return NULL;
+}
+
+static bool start_writer(image_sink_t *sink) {
+  // The ring is allocated once per open and reused for every block
+  struct image_sink_writer_s *w = calloc(1, sizeof(*w));
+  if (!w) {
+    printf("**** Could not allocate image writer\n");
+    return false;
+  }
+  atomic_init(&w->head, 0);
+  atomic_init(&w->tail, 0);
+  atomic_init(&w->writer_waiting, false);
+  atomic_init(&w->producer_waiting, false);
+  atomic_init(&w->failed, false);
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  sink->writer = w;
+  int err = pthread_create(&w->thread, NULL, writer_main, sink);
+  if (err != 0) {
+    printf("**** Could not start image writer: %s\n", strerror(err));
+    sink->writer = NULL;
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+    return false;
+  }
+  return true;
+}
+
+// Wait until the writer thread has written everything in the ring. Returns
+// false if any of the writes failed.
+static bool drain_writer(image_sink_t *sink) {
+  struct image_sink_writer_s *w = sink->writer;
+  if (!w) {
+    return true;
+  }
+  size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+  pthread_mutex_lock(&w->lock);
+  announce_wait(&w->producer_waiting);
+  while (atomic_load_explicit(&w->tail, memory_order_acquire) != head) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  atomic_store_explicit(&w->producer_waiting, false, memory_order_relaxed);
+  pthread_mutex_unlock(&w->lock);
+  return !atomic_load_explicit(&w->failed, memory_order_relaxed);
+}
+
+static bool stop_writer(image_sink_t *sink) {
+  struct image_sink_writer_s *w = sink->writer;
+  if (!w) {
+    return true;
+  }
+  bool ret = drain_writer(sink);
+  pthread_mutex_lock(&w->lock);
+  w->stop = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  free(w);
+  sink->writer = NULL;
+  return ret;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Writes are collected in a buffer of this size before they're written to the
+ * file.
+ */
+#define IMAGE_SINK_BUFFER_SIZE 16384
+
+/**
+ * With a writer thread the writes are passed to the thread in a ring of this
+ * many buffers of IMAGE_SINK_SLOT_SIZE bytes. Larger writes take several
+ * buffers.
+ */
+#define IMAGE_SINK_RING_SLOTS 32
+#define IMAGE_SINK_SLOT_SIZE 8192
+
+struct image_sink_writer_s;
+
+/**
+ * The image sink writes the downloaded firmware image to a file. The file is
+ * opened once, preallocated to the image size and written to a temporary file
+ * which replaces the image file when the download is completed.
+ */
+typedef struct {
+  int fd;
+  const char *path;
+  char tmp_path[256];
+  uint32_t size;
+  off_t end;
+  off_t buf_offset;
+  size_t buf_len;
+  uint8_t buf[IMAGE_SINK_BUFFER_SIZE];
+  bool use_writer; // Start a writer thread when the sink is opened
+  struct image_sink_writer_s *writer; // Set while a writer thread runs
+} image_sink_t;
+
+/**
+ * Initialise the sink. This does not touch the file system.
+ */
+void image_sink_init(image_sink_t *sink, const char *path);
+
+/**
+ * Write the image from a separate thread. When this is set a writer thread is
+ * started when the sink is opened. Call this after image_sink_init.
+ * image_sink_write copies the data into a ring of buffers and returns without
+ * waiting for the storage; it only blocks when the ring is full. The other
+ * calls wait for the ring to drain before they touch the file so sync and
+ * close still mean the data is stored.
+ */
+void image_sink_set_writer_thread(image_sink_t *sink, bool enabled);
+
+/**
+ * Open the sink's temporary file and preallocate it to the image size. The
+ * size can be 0 if the server hasn't reported the image size. When resuming an
+ * interrupted download the blocks already in the temporary file are kept.
+ * If the sink is open it is reopened.
+ */
+bool image_sink_open(image_sink_t *sink, uint32_t size, mode_t mode,
+                     bool resume);
+
+/**
+ * Returns true if the sink is open.
+ */
+bool image_sink_is_open(const image_sink_t *sink);
+
+/**
+ * Returns true if there's a temporary file from an earlier download.
+ */
+bool image_sink_has_partial(const image_sink_t *sink);
+
+/**
+ * Write a buffer at the offset in the image. Consecutive writes are coalesced
+ * before they are written to the file.
+ */
+bool image_sink_write(image_sink_t *sink, off_t offset, const uint8_t *buf,
+                      size_t len);
+
+/**
+ * Returns true if the sink can take a full download window of blocks without
+ * blocking. This is always true without a writer thread.
+ */
+bool image_sink_has_room(const image_sink_t *sink);
+
+/**
+ * Flush buffered writes and sync the file data to storage.
+ */
+bool image_sink_sync(image_sink_t *sink);
+
+/**
+ * Flush and sync the image and rename it to the image path.
+ */
+bool image_sink_close(image_sink_t *sink);
+
+/**
+ * Flush and close the sink but keep the temporary file so the download can be
+ * resumed later.
+ */
+void image_sink_suspend(image_sink_t *sink);
+
+/**
+ * Close the sink and remove the temporary file.
+ */
+void image_sink_abort(image_sink_t *sink);
@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image_slots.h"
+
+#define SLOT_A "slot_a"
+#define SLOT_B "slot_b"
+#define LINK_NAME "current"
+#define TRIAL_SUFFIX ".trial"
+
+static bool same_file(const char *a, const char *b) {
+  struct stat sa;
+  struct stat sb;
+  return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev &&
+         sa.st_ino == sb.st_ino;
+}
+
+bool image_slots_init(image_slots_t *slots, const char *dir,
+                      const char *running) {
+  memset(slots, 0, sizeof(*slots));
+  char slot_a[IMAGE_SLOTS_MAX_PATH];
+  char slot_b[IMAGE_SLOTS_MAX_PATH];
+  // A truncated path would name some other file, so don't use any of them
+  if (snprintf(slots->link, sizeof(slots->link), "%s/%s", dir, LINK_NAME) >=
+          (int)sizeof(slots->link) ||
+      snprintf(slots->trial, sizeof(slots->trial), "%s%s", slots->link,
+               TRIAL_SUFFIX) >= (int)sizeof(slots->trial) ||
+      snprintf(slot_a, sizeof(slot_a), "%s/%s", dir, SLOT_A) >=
+          (int)sizeof(slot_a) ||
+      snprintf(slot_b, sizeof(slot_b), "%s/%s", dir, SLOT_B) >=
+          (int)sizeof(slot_b)) {
+    printf("**** Image directory path is too long: %s\n", dir);
+    return false;
+  }
+  // The link may change while we run so the running image is kept by its
+  // real path.
+  char *real = realpath(running, NULL);
+  if (!real) {
+    printf("**** Could not find running image %s: %s\n", running,
+           strerror(errno));
+    return false;
+  }
+  bool fits = strlen(real) < sizeof(slots->running);
+  if (fits) {
+    strcpy(slots->running, real);
+  } else {
+    printf("**** Running image path is too long: %s\n", real);
+  }
+  free(real);
+  if (!fits) {
+    return false;
+  }
+
+  // Never write to the running image or the active image
+  bool use_b = same_file(slots->running, slot_a) ||
+               (!same_file(slots->running, slot_b) &&
+                same_file(slots->link, slot_a));
+  slots->inactive_name = use_b ? SLOT_B : SLOT_A;
+  strcpy(slots->inactive, use_b ? slot_b : slot_a);
+
+  // Only the active image can be on trial
+  slots->on_trial = access(slots->trial, F_OK) == 0 &&
+                    same_file(slots->running, slots->link);
+  return true;
+}
+
+// The trial marker has the path of the previous image and the number of
+// times the image on trial has started
+static bool read_trial(const image_slots_t *slots, char *previous,
+                       int *starts) {
+  FILE *fp = fopen(slots->trial, "r");
+  if (!fp) {
+    return false;
+  }
+  bool ok = fgets(previous, IMAGE_SLOTS_MAX_PATH, fp) != NULL &&
+            fscanf(fp, "%d", starts) == 1;
+  fclose(fp);
+  previous[strcspn(previous, "\n")] = 0;
+  return ok && previous[0];
+}
+
+static bool write_trial(const image_slots_t *slots, const char *previous,
+                        int starts) {
+  char tmp[IMAGE_SLOTS_MAX_PATH + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", slots->trial);
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    printf("**** Could not write %s: %s\n", tmp, strerror(errno));
+    return false;
+  }
+  fprintf(fp, "%s\n%d\n", previous, starts);
+  bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp, slots->trial) != 0) {
+    printf("**** Could not write %s\n", slots->trial);
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+// Sync the directory so renames in it survive a power loss
+static void sync_dir(const char *path) {
+  char dir[IMAGE_SLOTS_MAX_PATH];
+  strcpy(dir, path);
+  char *slash = strrchr(dir, '/');
+  if (slash) {
+    *slash = 0;
+  } else {
+    strcpy(dir, ".");
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// Replace the link with one to the target in a single rename
+static bool swap_link(const image_slots_t *slots, const char *target) {
+  char tmp[IMAGE_SLOTS_MAX_PATH + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", slots->link);
+  unlink(tmp);
+  if (symlink(target, tmp) != 0) {
+    printf("**** Could not create link to %s: %s\n", target, strerror(errno));
+    return false;
+  }
+  if (rename(tmp, slots->link) != 0) {
+    printf("**** Could not replace %s: %s\n", slots->link, strerror(errno));
+    unlink(tmp);
+    return false;
+  }
+  sync_dir(slots->link);
+  return true;
+}
+
+int image_slots_begin_trial(image_slots_t *slots) {
+  if (!slots->on_trial) {
+    return 0;
+  }
+  char previous[IMAGE_SLOTS_MAX_PATH];
+  int starts = 0;
+  if (!read_trial(slots, previous, &starts)) {
+    printf("**** Ignoring invalid trial marker %s\n", slots->trial);
+    image_slots_confirm(slots);
+    return 0;
+  }
+  write_trial(slots, previous, ++starts);
+  return starts;
+}
+
+bool image_slots_activate(image_slots_t *slots) {
+  // The marker goes first. If we stop before the link is swapped the old
+  // image keeps running and ignores the marker.
+  if (!write_trial(slots, slots->running, 0)) {
+    return false;
+  }
+  // The link is relative since the slot is in the same directory
+  if (!swap_link(slots, slots->inactive_name)) {
+    unlink(slots->trial);
+    return false;
+  }
+  printf("Activated %s\n", slots->inactive);
+  return true;
+}
+
+void image_slots_confirm(image_slots_t *slots) {
+  if (unlink(slots->trial) == 0) {
+    printf("Image confirmed\n");
+  }
+  slots->on_trial = false;
+}
+
+bool image_slots_rollback(image_slots_t *slots) {
+  char previous[IMAGE_SLOTS_MAX_PATH];
+  int starts;
+  if (!read_trial(slots, previous, &starts)) {
+    printf("**** No image to roll back to\n");
+    return false;
+  }
+  if (!swap_link(slots, previous)) {
+    return false;
+  }
+  unlink(slots->trial);
+  slots->on_trial = false;
+  printf("Rolled back to %s\n", previous);
+  return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define IMAGE_SLOTS_MAX_PATH 256
+
+/**
+ * Two image slots (slot_a and slot_b) in a directory with a symlink (current)
+ * to the active one. New images are written to the slot that isn't running
+ * and activated by pointing the link at it. The newly activated image is on
+ * trial until it has reported to the server. If it doesn't, the link is
+ * pointed back at the previous image.
+ */
+typedef struct {
+  char link[IMAGE_SLOTS_MAX_PATH];     // The link to the active image
+  char trial[IMAGE_SLOTS_MAX_PATH];    // Marker for an image on trial
+  char running[IMAGE_SLOTS_MAX_PATH];  // The image that is running
+  char inactive[IMAGE_SLOTS_MAX_PATH]; // The slot for the next image
+  const char *inactive_name;
+  bool on_trial;
+} image_slots_t;
+
+/**
+ * Set up the slots in the directory. The running image is the path the
+ * process was started with. This can be the link, a slot or another binary
+ * when the slots are used for the first time.
+ */
+bool image_slots_init(image_slots_t *slots, const char *dir,
+                      const char *running);
+
+/**
+ * Count a start of an image on trial. Returns the number of times the image
+ * has been started without reporting, or 0 if the running image isn't on
+ * trial.
+ */
+int image_slots_begin_trial(image_slots_t *slots);
+
+/**
+ * Point the link at the inactive slot. The running image is kept as the
+ * image to go back to until the new image is confirmed.
+ */
+bool image_slots_activate(image_slots_t *slots);
+
+/**
+ * Confirm the image on trial. It can't be rolled back after this.
+ */
+void image_slots_confirm(image_slots_t *slots);
+
+/**
+ * Point the link back at the image that was running before the image on
+ * trial was activated.
+ */
+bool image_slots_rollback(image_slots_t *slots);
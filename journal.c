@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x464f544a // "FOTJ"
+#define JOURNAL_VERSION 1
+#define TMP_SUFFIX ".tmp"
+
+static bool is_marked(const download_journal_t *journal,
+                      unsigned int block_num) {
+  return journal->blocks[block_num / 8] & (1 << (block_num % 8));
+}
+
+void journal_init(download_journal_t *journal, const char *file) {
+  memset(journal, 0, sizeof(*journal));
+  journal->file = file;
+}
+
+bool journal_load(download_journal_t *journal) {
+  const char *file = journal->file;
+  journal_init(journal, file);
+
+  FILE *fp = fopen(file, "rb");
+  if (!fp) {
+    return false;
+  }
+  uint32_t magic = 0;
+  uint8_t version = 0;
+  uint8_t etag_len = 0;
+  bool ok = fread(&magic, sizeof(magic), 1, fp) == 1 &&
+            magic == JOURNAL_MAGIC &&
+            fread(&version, sizeof(version), 1, fp) == 1 &&
+            version == JOURNAL_VERSION &&
+            fread(journal->path, sizeof(journal->path), 1, fp) == 1 &&
+            memchr(journal->path, 0, sizeof(journal->path)) &&
+            fread(&journal->size, sizeof(journal->size), 1, fp) == 1 &&
+            fread(&journal->szx, sizeof(journal->szx), 1, fp) == 1 &&
+            journal->szx <= JOURNAL_MAX_SZX &&
+            fread(&etag_len, sizeof(etag_len), 1, fp) == 1 &&
+            etag_len <= JOURNAL_MAX_ETAG &&
+            fread(journal->etag, sizeof(journal->etag), 1, fp) == 1 &&
+            fread(&journal->block_count, sizeof(journal->block_count), 1,
+                  fp) == 1 &&
+            journal->block_count <= JOURNAL_MAX_BLOCKS &&
+            // A journal saved before the first block has no bitmap
+            (journal->block_count == 0 ||
+             fread(journal->blocks, (journal->block_count + 7) / 8, 1, fp) ==
+                 1);
+  fclose(fp);
+  if (!ok) {
+    printf("Ignoring invalid download journal %s\n", file);
+    journal_init(journal, file);
+    return false;
+  }
+  journal->etag_len = etag_len;
+  journal->valid = true;
+  return true;
+}
+
+bool journal_save(download_journal_t *journal) {
+  if (!journal->valid) {
+    return false;
+  }
+  char tmp[256];
+  snprintf(tmp, sizeof(tmp), "%s%s", journal->file, TMP_SUFFIX);
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) {
+    printf("**** Error opening journal %s: %s\n", tmp, strerror(errno));
+    return false;
+  }
+  uint32_t magic = JOURNAL_MAGIC;
+  uint8_t version = JOURNAL_VERSION;
+  uint8_t etag_len = journal->etag_len;
+  bool ok = fwrite(&magic, sizeof(magic), 1, fp) == 1 &&
+            fwrite(&version, sizeof(version), 1, fp) == 1 &&
+            fwrite(journal->path, sizeof(journal->path), 1, fp) == 1 &&
+            fwrite(&journal->size, sizeof(journal->size), 1, fp) == 1 &&
+            fwrite(&journal->szx, sizeof(journal->szx), 1, fp) == 1 &&
+            fwrite(&etag_len, sizeof(etag_len), 1, fp) == 1 &&
+            fwrite(journal->etag, sizeof(journal->etag), 1, fp) == 1 &&
+            fwrite(&journal->block_count, sizeof(journal->block_count), 1,
+                   fp) == 1 &&
+            (journal->block_count == 0 ||
+             fwrite(journal->blocks, (journal->block_count + 7) / 8, 1, fp) ==
+                 1);
+  ok = fflush(fp) == 0 && ok;
+  ok = fsync(fileno(fp)) == 0 && ok;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp, journal->file) != 0) {
+    printf("**** Error writing journal %s\n", journal->file);
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+void journal_remove(download_journal_t *journal) {
+  unlink(journal->file);
+  journal_init(journal, journal->file);
+}
+
+void journal_reset(download_journal_t *journal, const char *path,
+                   uint32_t size, uint8_t szx, const uint8_t *etag,
+                   size_t etag_len) {
+  journal_init(journal, journal->file);
+  strncpy(journal->path, path, sizeof(journal->path) - 1);
+  journal->size = size;
+  journal->szx = szx;
+  if (etag_len > JOURNAL_MAX_ETAG) {
+    etag_len = JOURNAL_MAX_ETAG;
+  }
+  memcpy(journal->etag, etag, etag_len);
+  journal->etag_len = etag_len;
+  journal->valid = true;
+}
+
+bool journal_matches(const download_journal_t *journal, const char *path,
+                     uint32_t size, const uint8_t *etag, size_t etag_len) {
+  return journal->valid && strcmp(journal->path, path) == 0 &&
+         journal->size == size && journal->etag_len == etag_len &&
+         memcmp(journal->etag, etag, etag_len) == 0;
+}
+
+void journal_mark_block(download_journal_t *journal, unsigned int block_num) {
+  if (block_num >= JOURNAL_MAX_BLOCKS) {
+    return;
+  }
+  journal->blocks[block_num / 8] |= (1 << (block_num % 8));
+  if (block_num >= journal->block_count) {
+    journal->block_count = block_num + 1;
+  }
+}
+
+unsigned int journal_first_missing(const download_journal_t *journal) {
+  unsigned int block_num = 0;
+  while (block_num < journal->block_count && is_marked(journal, block_num)) {
+    block_num++;
+  }
+  return block_num;
+}
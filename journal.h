@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of blocks tracked by the journal. This is 64 MiB with 1024
+ * byte blocks.
+ */
+#define JOURNAL_MAX_BLOCKS 65536
+#define JOURNAL_MAX_PATH 64
+#define JOURNAL_MAX_ETAG 8
+
+/**
+ * Largest block size exponent in a journal (1024 byte blocks). BERT downloads
+ * are journaled in 1024 byte blocks.
+ */
+#define JOURNAL_MAX_SZX 6
+
+/**
+ * The download journal records which blocks of an image have been written so
+ * an interrupted download can continue where it stopped. The image is
+ * identified by the path on the server, the size and the ETag (if the server
+ * sends one).
+ */
+typedef struct {
+  const char *file;
+  bool valid;
+  char path[JOURNAL_MAX_PATH];
+  uint32_t size;
+  uint8_t szx;
+  uint8_t etag[JOURNAL_MAX_ETAG];
+  size_t etag_len;
+  uint32_t block_count;
+  uint8_t blocks[JOURNAL_MAX_BLOCKS / 8];
+} download_journal_t;
+
+/**
+ * Initialise the journal. The journal is stored in the named file.
+ */
+void journal_init(download_journal_t *journal, const char *file);
+
+/**
+ * Load the journal from disk. Returns false if there's no journal or it can't
+ * be read.
+ */
+bool journal_load(download_journal_t *journal);
+
+/**
+ * Write the journal to disk. The file is replaced atomically.
+ */
+bool journal_save(download_journal_t *journal);
+
+/**
+ * Remove the journal from disk and clear it.
+ */
+void journal_remove(download_journal_t *journal);
+
+/**
+ * Start a new journal for an image.
+ */
+void journal_reset(download_journal_t *journal, const char *path,
+                   uint32_t size, uint8_t szx, const uint8_t *etag,
+                   size_t etag_len);
+
+/**
+ * Check if the journal is for the image.
+ */
+bool journal_matches(const download_journal_t *journal, const char *path,
+                     uint32_t size, const uint8_t *etag, size_t etag_len);
+
+/**
+ * Mark a block as completed.
+ */
+void journal_mark_block(download_journal_t *journal, unsigned int block_num);
+
+/**
+ * Returns the first block that isn't completed.
+ */
+unsigned int journal_first_missing(const download_journal_t *journal);
@@ -1,13 +1,24 @@
-#include <fcntl.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "coap.h"
+#include "decompress.h"
+#include "delta.h"
 #include "download.h"
+#include "image_hash.h"
+#include "image_sink.h"
+#include "image_slots.h"
+#include "metrics.h"
+#include "mirrors.h"
+#include "pacer.h"
 #include "reporting.h"
+#include "resolve.h"
+#include "telemetry.h"
 
 #ifndef VERSION
 #define VERSION "0.0.0"
@@ -16,52 +27,412 @@
 #define CERT_FILE "cert.crt"
 #define KEY_FILE "key.pem"
 
-#define IMAGE_FILE "image.new"
+// New images are written to the inactive A/B slot in this directory and
+// started through the link to the active slot
+#define SLOT_DIR "."
 #define IMAGE_FILE_MODE 0700
-// Block counter for firmware dowload.
-static int last_block = -1;
-static size_t downloaded_bytes = 0;
+// A new image that hasn't reported within this time or in this many starts
+// is rolled back
+#define TRIAL_SECONDS 300
+#define MAX_TRIAL_STARTS 3
+// Number of image blocks requested in parallel
+#define DOWNLOAD_WINDOW 8
+// Images are downloaded with CoAP over TCP and BERT blocks of this size. The
+// download falls back to DTLS and 1024 byte blocks if TCP doesn't work.
+#define DOWNLOAD_TRANSPORT COAP_PROTO_TLS
+#define DOWNLOAD_BLOCK_SIZE 8192
+// Default port for a caching proxy on the LAN
+#define PROXY_PORT 5684
+// DTLS sessions and server addresses are cached in this directory between runs
+#define SESSION_CACHE_DIR "."
+// Telemetry that hasn't been reported yet is kept here between runs
+#define TELEMETRY_FILE SESSION_CACHE_DIR "/fota.telemetry"
+// Default report interval and random jitter added to it in daemon mode
+#define REPORT_INTERVAL_SECONDS 30
+#define REPORT_JITTER_SECONDS 5
+// In observe mode the server pushes updates and the registration is refreshed
+// (which also works as a poll) at this interval.
+#define OBSERVE_POLL_SECONDS 600
+// Longest wait between reconnect attempts in daemon mode
+#define MAX_RECONNECT_SECONDS 300
 
-void upgrade_cb(fota_response_t *resp);
+// Everything a client keeps between reports and during a download. The client
+// is the user data for the CoAP, download, patch and decompression callbacks
+// so several clients can run in one process.
+typedef struct {
+  image_slots_t slots;
+  // Progress for firmware dowload. The block size can change during the
+  // download so blocks are tracked by offset.
+  size_t downloaded_bytes;
+  image_sink_t image_sink;
+  bool writer_thread; // The image is written from a separate thread
+  download_journal_t journal;
+  char journal_file[IMAGE_SLOTS_MAX_PATH + 8];
+  download_config_t download;
+  // Downloads are paced when a rate or a window is set
+  pacer_config_t pacer_config;
+  pacer_t pacer;
+  // The running image is the base for patches
+  const char *running_image;
+  uint8_t running_hash[IMAGE_HASH_SIZE];
+  delta_patch_t patch;
+  // Compressed downloads are decompressed as the blocks arrive
+  decompress_t decompressor;
+  bool compressed_download;
+  size_t image_bytes;
+  // The new image is hashed as it is written and checked against the hash in
+  // the response when the download completes.
+  image_hash_t new_image_hash;
+  block_manifest_t manifest;
+  // Telemetry is collected between reports and sent with the next report
+  telemetry_t telemetry;
+  download_stats_t download_stats;
+  time_t start_time;
+  // Set by the upgrade callback when there's a new version to download
+  fota_response_t pending_update;
+  bool update_pending;
+} client_t;
 
-bool download_block_cb(int block_num, uint8_t *buf, size_t len,
-                       uint32_t max_size);
+void upgrade_cb(void *user_data, fota_response_t *resp);
+
+void report_done_cb(void *user_data, bool ok);
+
+bool download_update(client_t *client, coap_state_t *state,
+                     fota_response_t *resp);
+
+bool send_report(client_t *client, coap_state_t *state, fota_report_t *report,
+                 bool observe);
+
+int run_daemon(client_t *client, coap_state_t *state, fota_report_t *report,
+               int interval, int jitter, bool observe, char **argv);
+
+void usage(const char *name);
+
+void start_image(client_t *client, char **argv);
+
+static bool is_paced(const client_t *client) {
+  return client->pacer_config.rate > 0 || client->pacer_config.window_count > 0;
+}
+
+bool download_block_cb(void *user_data, int block_num, size_t block_size,
+                       uint8_t *buf, size_t len, uint32_t max_size);
+
+bool download_patch_cb(void *user_data, int block_num, size_t block_size,
+                       uint8_t *buf, size_t len, uint32_t max_size);
+
+bool download_compressed_cb(void *user_data, int block_num, size_t block_size,
+                            uint8_t *buf, size_t len, uint32_t max_size);
+
+bool download_manifest_cb(void *user_data, int block_num, size_t block_size,
+                          uint8_t *buf, size_t len, uint32_t max_size);
+
+bool write_patched_cb(void *user_data, uint32_t offset, const uint8_t *buf,
+                      size_t len, uint32_t size);
+
+bool write_image_cb(void *user_data, const uint8_t *buf, size_t len);
+
+bool apply_patch_cb(void *user_data, const uint8_t *buf, size_t len);
+
+bool sync_image_cb(void *user_data);
+bool image_ready_cb(void *user_data);
 
 int main(int argc, char **argv) {
   char *version = VERSION;
   printf("FOTA demo client, version: %s\n", version);
 
+  bool daemon = false;
+  bool observe = false;
+  int interval = -1;
+  int jitter = REPORT_JITTER_SECONDS;
+  const char *metrics_file = NULL;
+  const char *proxy_host = NULL;
+  int proxy_port = PROXY_PORT;
+  client_t client;
+  memset(&client, 0, sizeof(client));
+  pacer_config_t *pacing = &client.pacer_config;
+  int rate = 0;
+  int burst = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "doi:j:m:p:P:wr:b:t:")) != -1) {
+    switch (opt) {
+    case 'd':
+      daemon = true;
+      break;
+    case 'o':
+      daemon = true;
+      observe = true;
+      break;
+    case 'i':
+      interval = atoi(optarg);
+      break;
+    case 'j':
+      jitter = atoi(optarg);
+      break;
+    case 'm':
+      metrics_file = optarg;
+      break;
+    case 'p':
+      proxy_host = optarg;
+      break;
+    case 'P':
+      proxy_port = atoi(optarg);
+      break;
+    case 'w':
+      client.writer_thread = true;
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      break;
+    case 'b':
+      burst = atoi(optarg);
+      break;
+    case 't':
+      if (pacing->window_count == PACER_MAX_WINDOWS ||
+          !pacer_parse_window(optarg,
+                              &pacing->windows[pacing->window_count])) {
+        usage(argv[0]);
+        exit(2);
+      }
+      pacing->window_count++;
+      break;
+    default:
+      usage(argv[0]);
+      exit(2);
+    }
+  }
+  if (interval == -1) {
+    interval = observe ? OBSERVE_POLL_SECONDS : REPORT_INTERVAL_SECONDS;
+  }
+  if (interval < 1 || jitter < 0 || proxy_port < 1 || rate < 0 || burst < 0) {
+    usage(argv[0]);
+    exit(2);
+  }
+  pacing->rate = rate;
+  pacing->burst = burst;
+  if (metrics_file && !metrics_open(metrics_file)) {
+    exit(2);
+  }
+  srand(time(NULL) ^ getpid());
+  client.start_time = time(NULL);
+
   fota_report_t report = {
       .manufacturer = (uint8_t *)"Lab5e Demo Corp",
       .model = (uint8_t *)"model 01",
       .serial = (uint8_t *)"0001",
       .version = (uint8_t *)version,
+      .telemetry = &client.telemetry,
   };
+  telemetry_load(&client.telemetry, TELEMETRY_FILE);
+
+  if (!image_slots_init(&client.slots, SLOT_DIR, argv[0])) {
+    exit(1);
+  }
+  // An image that keeps starting without reporting is rolled back
+  int trial_starts = image_slots_begin_trial(&client.slots);
+  if (trial_starts > MAX_TRIAL_STARTS) {
+    printf("**** New image started %d times without reporting\n",
+           trial_starts - 1);
+    if (image_slots_rollback(&client.slots)) {
+      start_image(&client, argv);
+    }
+  }
+
+  // Advertise the running image so the server can offer a patch from it
+  client.running_image = client.slots.running;
+  if (image_hash_file(client.running_image, client.running_hash)) {
+    report.image_hash = client.running_hash;
+    report.delta_support = true;
+  }
 
   coap_state_t state;
 
-  if (!coap_init(&state, CERT_FILE, KEY_FILE)) {
+  resolve_set_cache_dir(SESSION_CACHE_DIR);
+  if (!coap_init(&state, CERT_FILE, KEY_FILE, SESSION_CACHE_DIR)) {
     printf("Could not init CoAP library\n");
-    exit(1);
+    if (!daemon) {
+      exit(1);
+    }
+    // The daemon keeps trying
+    state.failed = true;
   }
 
   // The response is a callback from the CoAP library and the upgrade handler
   // function is called when there's a new version available.
-  coap_set_upgrade_handler(upgrade_cb);
+  coap_set_upgrade_handler(&state, upgrade_cb, &client);
+  coap_set_report_done_handler(&state, report_done_cb);
+  download_config_t *download = &client.download;
+  coap_download_config_init(download);
+  coap_set_download_window(download, DOWNLOAD_WINDOW);
+  coap_set_download_transport(download, DOWNLOAD_TRANSPORT);
+  coap_set_download_block_size(download, DOWNLOAD_BLOCK_SIZE);
+  snprintf(client.journal_file, sizeof(client.journal_file), "%s.journal",
+           client.slots.inactive);
+  journal_init(&client.journal, client.journal_file);
+  coap_set_download_journal(download, &client.journal, sync_image_cb);
+  coap_set_download_stats(download, &client.download_stats);
+  coap_set_download_proxy(download, proxy_host, proxy_port);
+  if (client.writer_thread) {
+    coap_set_download_flow_control(download, image_ready_cb);
+  }
+  if (is_paced(&client)) {
+    coap_set_download_pacer(download, &client.pacer);
+  }
+  coap_set_download_config(&state, download);
 
-  if (!coap_send_report(&state, &report)) {
+  if (daemon) {
+    return run_daemon(&client, &state, &report, interval, jitter, observe,
+                      argv);
+  }
+
+  if (!send_report(&client, &state, &report, false)) {
     printf("Error sending report to server\n");
+    telemetry_save(&client.telemetry, TELEMETRY_FILE);
     exit(3);
   }
 
   // Wait for the exchange to complete
   coap_wait_for_exchange(&state);
+  if (state.failed) {
+    coap_shutdown(&state);
+    telemetry_save(&client.telemetry, TELEMETRY_FILE);
+    exit(1);
+  }
+  if (client.slots.on_trial && state.report_acked) {
+    image_slots_confirm(&client.slots);
+  }
+
+  // The download runs after the report exchange so it can use the same
+  // session if the image is on the report server. The new image is started
+  // through the link on the next run.
+  if (client.update_pending) {
+    client.update_pending = false;
+    if (download_update(&client, &state, &client.pending_update)) {
+      image_slots_activate(&client.slots);
+    }
+  }
 
   coap_shutdown(&state);
   return 0;
 }
 
-void upgrade_cb(fota_response_t *resp) {
+void usage(const char *name) {
+  printf("Usage: %s [-d] [-o] [-i interval] [-j jitter] [-m file] [-p host] "
+         "[-P port] [-w] [-r rate] [-b burst] [-t HH:MM-HH:MM]\n",
+         name);
+  printf("  -d           Run as a daemon and report periodically\n");
+  printf("  -o           Run as a daemon and observe the update resource\n");
+  printf("  -i interval  Seconds between reports in daemon mode (default %d, "
+         "%d when observing)\n",
+         REPORT_INTERVAL_SECONDS, OBSERVE_POLL_SECONDS);
+  printf("  -j jitter    Random seconds added to the interval (default %d)\n",
+         REPORT_JITTER_SECONDS);
+  printf("  -m file      Append phase timings to the file as JSON lines\n");
+  printf("  -p host      Download images through the caching proxy on host\n");
+  printf("  -P port      Port of the caching proxy (default %d)\n", PROXY_PORT);
+  printf("  -w           Write images to storage from a separate thread\n");
+  printf("  -r rate      Limit downloads to this many bytes per second\n");
+  printf("  -b burst     Bytes requested back to back (default one second's "
+         "worth)\n");
+  printf("  -t window    Only download between HH:MM-HH:MM UTC (up to %d)\n",
+         PACER_MAX_WINDOWS);
+}
+
+// Replace the process with the active image. The DTLS session and server
+// addresses are in the caches on disk so the new image picks up the session
+// where this one left off.
+void start_image(client_t *client, char **argv) {
+  telemetry_save(&client->telemetry, TELEMETRY_FILE);
+  printf("Starting %s\n", client->slots.link);
+  argv[0] = client->slots.link;
+  execv(client->slots.link, argv);
+  printf("**** Could not start %s: %s\n", client->slots.link,
+         strerror(errno));
+}
+
+static coap_tick_t next_report_time(int interval, int jitter) {
+  coap_tick_t now;
+  coap_ticks(&now);
+  int seconds = interval + (jitter > 0 ? rand() % (jitter + 1) : 0);
+  return now + (coap_tick_t)seconds * COAP_TICKS_PER_SECOND;
+}
+
+// Daemon mode. The session is kept open between reports and the reports are
+// scheduled on the libcoap I/O loop. A failed session is reconnected with an
+// increasing delay. When a new image is downloaded the process replaces
+// itself with the new image. In observe mode each report refreshes the
+// registration, so it is registered again right after a reconnect.
+int run_daemon(client_t *client, coap_state_t *state, fota_report_t *report,
+               int interval, int jitter, bool observe, char **argv) {
+  int reconnect_delay = 1;
+  coap_tick_t next_report;
+  coap_ticks(&next_report);
+
+  while (true) {
+    if (state->failed) {
+      printf("Session failed, reconnecting in %d seconds\n", reconnect_delay);
+      telemetry_set_string(&client->telemetry, TELEMETRY_LAST_ERROR,
+                           "session failed");
+      sleep(reconnect_delay);
+      if (!coap_reconnect(state)) {
+        reconnect_delay *= 2;
+        if (reconnect_delay > MAX_RECONNECT_SECONDS) {
+          reconnect_delay = MAX_RECONNECT_SECONDS;
+        }
+        continue;
+      }
+      reconnect_delay = 1;
+      coap_ticks(&next_report);
+    }
+
+    coap_tick_t now;
+    coap_ticks(&now);
+    if (now >= next_report) {
+      if (!send_report(client, state, report, observe)) {
+        printf("Error sending report to server\n");
+        state->failed = true;
+        continue;
+      }
+      next_report = next_report_time(interval, jitter);
+    }
+
+    unsigned int timeout_ms =
+        (next_report - now) * 1000 / COAP_TICKS_PER_SECOND;
+    coap_run_once(state->ctx, timeout_ms > 0 ? timeout_ms : 1);
+
+    // A new image is confirmed by its first report. If it can't report the
+    // previous image takes over.
+    if (client->slots.on_trial) {
+      if (state->report_acked) {
+        image_slots_confirm(&client->slots);
+      } else if (time(NULL) - client->start_time > TRIAL_SECONDS) {
+        printf("**** New image hasn't reported in %d seconds\n",
+               TRIAL_SECONDS);
+        if (image_slots_rollback(&client->slots)) {
+          coap_shutdown(state);
+          start_image(client, argv);
+          return 1;
+        }
+      }
+    }
+
+    // Updates wait until the running image is confirmed since the download
+    // overwrites the image it would be rolled back to
+    if (client->update_pending && !client->slots.on_trial) {
+      client->update_pending = false;
+      if (download_update(client, state, &client->pending_update) &&
+          image_slots_activate(&client->slots)) {
+        // Store the DTLS session so the new image can resume it
+        coap_shutdown(state);
+        start_image(client, argv);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+void upgrade_cb(void *user_data, fota_response_t *resp) {
+  client_t *client = user_data;
   if (!resp->has_new_version) {
     printf("No new version available\n");
     return;
@@ -69,45 +440,438 @@ void upgrade_cb(fota_response_t *resp) {
 
   printf("There's a new version available at coap://%s:%d%s\n", resp->hostname,
          resp->port, resp->path);
+  client->pending_update = *resp;
+  client->update_pending = true;
+}
 
-  coap_download_firmware((const char *)resp->hostname, resp->port,
-                         (const char *)resp->path, download_block_cb, CERT_FILE,
-                         KEY_FILE);
+// The server has either taken the telemetry or it is kept for the next
+// report. Either way the saved records change.
+void report_done_cb(void *user_data, bool ok) {
+  client_t *client = user_data;
+  telemetry_save(&client->telemetry, TELEMETRY_FILE);
 }
 
-// Callback for block download. This checks if the block num is in sequence and
+// Write image data and add it to the hash of the new image. The data is
+// written in order.
+static bool write_image(client_t *client, off_t offset, const uint8_t *buf,
+                        size_t len) {
+  return image_hash_update(&client->new_image_hash, buf, len) &&
+         image_sink_write(&client->image_sink, offset, buf, len);
+}
+
+// Start a new image in the inactive slot
+static void init_sink(client_t *client) {
+  image_sink_init(&client->image_sink, client->slots.inactive);
+  image_sink_set_writer_thread(&client->image_sink, client->writer_thread);
+}
+
+// Check the hash of the new image and move it into place. The digest is ready
+// when the last block is written so the image isn't read back.
+static bool finish_image(client_t *client, fota_response_t *resp) {
+  uint8_t digest[IMAGE_HASH_SIZE];
+  if (!image_hash_final(&client->new_image_hash, digest)) {
+    printf("**** Could not hash image\n");
+    image_sink_abort(&client->image_sink);
+    return false;
+  }
+  if (resp->has_image_hash &&
+      memcmp(digest, resp->image_hash, IMAGE_HASH_SIZE) != 0) {
+    printf("**** Image hash doesn't match, discarding image\n");
+    image_sink_abort(&client->image_sink);
+    journal_remove(&client->journal);
+    return false;
+  }
+  if (!image_sink_close(&client->image_sink)) {
+    printf("**** Error writing image file\n");
+    return false;
+  }
+  return true;
+}
+
+// Download the per-block hash manifest for the image. The download continues
+// without it if it can't be fetched.
+static void download_manifest(client_t *client, coap_state_t *state,
+                              fota_response_t *resp) {
+  block_manifest_t *manifest = &client->manifest;
+  manifest_init(manifest);
+  client->downloaded_bytes = 0;
+  coap_set_download_journal(&client->download, NULL, NULL);
+  bool ok = coap_download_firmware(
+      state, (const char *)resp->hostname, resp->port,
+      (const char *)resp->manifest_path, download_manifest_cb, client,
+      CERT_FILE, KEY_FILE);
+  coap_set_download_journal(&client->download, &client->journal,
+                            sync_image_cb);
+  if (ok && manifest_is_valid(manifest)) {
+    printf("Verifying %u blocks of %u bytes with manifest\n",
+           manifest->block_count, manifest->block_size);
+    coap_set_download_manifest(&client->download, manifest);
+    return;
+  }
+  printf("Could not get block manifest, downloading without it\n");
+  manifest_free(manifest);
+}
+
+// Download a patch and apply it to the running image as the blocks arrive.
+// Patches are small so they aren't resumed; the journal is only used for full
+// images.
+static bool download_patch(client_t *client, coap_state_t *state,
+                           fota_response_t *resp) {
+  init_sink(client);
+  client->downloaded_bytes = 0;
+  if (!image_hash_init(&client->new_image_hash)) {
+    return false;
+  }
+  if (!delta_init(&client->patch, client->running_image, client->running_hash,
+                  write_patched_cb, client)) {
+    image_hash_free(&client->new_image_hash);
+    return false;
+  }
+  client->compressed_download = resp->compressed;
+  if (client->compressed_download &&
+      !decompress_init(&client->decompressor, apply_patch_cb, client)) {
+    delta_close(&client->patch);
+    return false;
+  }
+  printf("Downloading patch from coap://%s:%d%s\n", resp->hostname,
+         resp->port, resp->patch_path);
+  coap_set_download_journal(&client->download, NULL, NULL);
+  bool ok = coap_download_firmware(state, (const char *)resp->hostname,
+                                   resp->port, (const char *)resp->patch_path,
+                                   download_patch_cb, client, CERT_FILE,
+                                   KEY_FILE);
+  coap_set_download_journal(&client->download, &client->journal,
+                            sync_image_cb);
+  delta_close(&client->patch);
+  if (client->compressed_download) {
+    ok = ok && decompress_is_complete(&client->decompressor);
+    decompress_end(&client->decompressor);
+  }
+
+  if (!ok || !delta_is_complete(&client->patch)) {
+    printf("Patch failed\n");
+    image_hash_free(&client->new_image_hash);
+    image_sink_abort(&client->image_sink);
+    return false;
+  }
+  if (!finish_image(client, resp)) {
+    return false;
+  }
+  printf("Patch applied\n");
+  return true;
+}
+
+// Download the image from the host in the response and any mirrors at the
+// same time. The journal isn't used with mirrors. Mirrors aren't used when
+// there's a proxy since the proxy has the image cached for the whole site.
+static bool download_from_hosts(client_t *client, coap_state_t *state,
+                                fota_response_t *resp,
+                                download_cb_t callback) {
+  if (resp->mirror_count == 0 || client->download.proxy_host) {
+    return coap_download_firmware(state, (const char *)resp->hostname,
+                                  resp->port, (const char *)resp->path,
+                                  callback, client, CERT_FILE, KEY_FILE);
+  }
+  download_source_t sources[FOTA_MAX_MIRRORS + 1] = {
+      {(const char *)resp->hostname, resp->port}};
+  size_t count = 1;
+  for (size_t i = 0; i < resp->mirror_count; i++) {
+    sources[count].hostname = (const char *)resp->mirrors[i].hostname;
+    sources[count].port = resp->mirrors[i].port;
+    count++;
+  }
+  return coap_download_mirrors(state, sources, count,
+                               (const char *)resp->path, callback, client,
+                               CERT_FILE, KEY_FILE);
+}
+
+// Download a compressed image. The image is decompressed as the blocks arrive
+// so offsets in the download don't match offsets in the image and the
+// download can't be resumed from the journal.
+static bool download_compressed(client_t *client, coap_state_t *state,
+                                fota_response_t *resp) {
+  image_sink_abort(&client->image_sink);
+  journal_remove(&client->journal);
+  client->downloaded_bytes = 0;
+  client->image_bytes = 0;
+  client->compressed_download = true;
+  if (!image_hash_init(&client->new_image_hash)) {
+    return false;
+  }
+  if (!decompress_init(&client->decompressor, write_image_cb, client)) {
+    image_hash_free(&client->new_image_hash);
+    return false;
+  }
+  coap_set_download_journal(&client->download, NULL, NULL);
+  bool ok = download_from_hosts(client, state, resp, download_compressed_cb);
+  coap_set_download_journal(&client->download, &client->journal,
+                            sync_image_cb);
+  ok = ok && decompress_is_complete(&client->decompressor);
+  decompress_end(&client->decompressor);
+
+  if (!ok) {
+    printf("Download failed\n");
+    image_hash_free(&client->new_image_hash);
+    image_sink_abort(&client->image_sink);
+    return false;
+  }
+  if (!finish_image(client, resp)) {
+    return false;
+  }
+  printf("Download complete (%zu bytes from %zu compressed)\n",
+         client->image_bytes, client->downloaded_bytes);
+  return true;
+}
+
+// Download the full image. An interrupted download is resumed from the
+// journal.
+static bool download_image(client_t *client, coap_state_t *state,
+                           fota_response_t *resp) {
+  client->downloaded_bytes = 0;
+  if (!image_hash_init(&client->new_image_hash)) {
+    return false;
+  }
+  bool resume = image_sink_has_partial(&client->image_sink);
+  if (!resume) {
+    // The journal is useless without the blocks it refers to
+    journal_remove(&client->journal);
+  }
+
+  // Mirrors are only used for a new download. An interrupted download is
+  // resumed from the host in the response.
+  bool ok = resume ? coap_download_firmware(state,
+                                            (const char *)resp->hostname,
+                                            resp->port,
+                                            (const char *)resp->path,
+                                            download_block_cb, client,
+                                            CERT_FILE, KEY_FILE)
+                   : download_from_hosts(client, state, resp,
+                                         download_block_cb);
+  if (!ok) {
+    // The partial image is kept so the download can resume on the next run
+    printf("Download failed\n");
+    image_hash_free(&client->new_image_hash);
+    image_sink_suspend(&client->image_sink);
+    return false;
+  }
+  if (!finish_image(client, resp)) {
+    return false;
+  }
+  printf("Download complete\n");
+  return true;
+}
+
+// Send the report with the telemetry collected since the last report. In
+// observe mode the report registers for (or refreshes) update notifications.
+bool send_report(client_t *client, coap_state_t *state, fota_report_t *report,
+                 bool observe) {
+  telemetry_t *telemetry = &client->telemetry;
+  telemetry_set_uint32(telemetry, TELEMETRY_UPTIME,
+                       time(NULL) - client->start_time);
+  if (state->rtt.strong.samples > 0) {
+    telemetry_set_uint32(telemetry, TELEMETRY_RTO, state->rtt.rto_ms);
+    telemetry_set_uint32(telemetry, TELEMETRY_SRTT, state->rtt.strong.srtt_ms);
+  }
+  bool sent = observe ? coap_observe_updates(state, report)
+                      : coap_send_report(state, report);
+  if (!sent) {
+    telemetry_set_string(telemetry, TELEMETRY_LAST_ERROR, "report failed");
+    return false;
+  }
+  return true;
+}
+
+static bool fetch_update(client_t *client, coap_state_t *state,
+                         fota_response_t *resp) {
+  init_sink(client);
+  // An interrupted download of the full image is resumed rather than replaced
+  // by a patch.
+  if (resp->has_patch && !image_sink_has_partial(&client->image_sink)) {
+    if (download_patch(client, state, resp)) {
+      return true;
+    }
+    printf("Downloading the full image instead\n");
+    init_sink(client);
+  }
+  if (resp->has_manifest) {
+    download_manifest(client, state, resp);
+  }
+  bool ok = resp->compressed ? download_compressed(client, state, resp)
+                             : download_image(client, state, resp);
+  coap_set_download_manifest(&client->download, NULL);
+  manifest_free(&client->manifest);
+  return ok;
+}
+
+// Download the update and record how it went in the telemetry for the next
+// report.
+bool download_update(client_t *client, coap_state_t *state,
+                     fota_response_t *resp) {
+  download_stats_t *stats = &client->download_stats;
+  memset(stats, 0, sizeof(*stats));
+  pacer_init(&client->pacer, &client->pacer_config);
+  coap_tick_t start;
+  coap_ticks(&start);
+  bool ok = fetch_update(client, state, resp);
+  coap_tick_t end;
+  coap_ticks(&end);
+
+  telemetry_t *telemetry = &client->telemetry;
+  telemetry_set_uint32(telemetry, TELEMETRY_DOWNLOAD_TIME,
+                       (end - start) * 1000 / COAP_TICKS_PER_SECOND);
+  telemetry_set_uint32(telemetry, TELEMETRY_DOWNLOAD_BYTES, stats->bytes);
+  telemetry_add_uint32(telemetry, TELEMETRY_RETRANSMITS, stats->retries);
+  if (is_paced(client)) {
+    pacer_stats_t pacing;
+    pacer_get_stats(&client->pacer, &pacing);
+    printf("Download paced at %u bytes/s (%u configured, %u while windows "
+           "were open), %u bursts, %u pauses\n",
+           pacing.achieved_rate, pacing.configured_rate, pacing.open_rate,
+           pacing.bursts, pacing.pauses);
+    telemetry_set_uint32(telemetry, TELEMETRY_DOWNLOAD_RATE,
+                         pacing.achieved_rate);
+  }
+  if (!ok) {
+    telemetry_set_string(telemetry, TELEMETRY_LAST_ERROR, "download failed");
+  }
+  // One-shot runs exit before the next report
+  telemetry_save(telemetry, TELEMETRY_FILE);
+  return ok;
+}
+
+// Callback for block download. This checks if the block is in sequence and
 // returns false if the download fails.
-bool download_block_cb(int block_num, uint8_t *buf, size_t len,
-                       uint32_t max_size) {
-  if (block_num != (last_block + 1)) {
-    printf("Downloaded block %d but expected block %d\n", block_num,
-           (last_block + 1));
-    return false;
-  }
-  if (downloaded_bytes == 0) {
-    // This is the first packet. Delete the image file if it exists
-    struct stat stattmp;
-    if (stat(IMAGE_FILE, &stattmp) != -1) {
-      unlink(IMAGE_FILE);
+bool download_block_cb(void *user_data, int block_num, size_t block_size,
+                       uint8_t *buf, size_t len, uint32_t max_size) {
+  client_t *client = user_data;
+  image_sink_t *sink = &client->image_sink;
+  size_t offset = (size_t)block_num * block_size;
+  if (offset == 0 || !image_sink_is_open(sink)) {
+    // This is the first block of the download. The image file is
+    // preallocated to the size reported by the server. A download that
+    // resumes keeps the blocks already written.
+    bool resume = offset > 0;
+    if (!image_sink_open(sink, max_size, IMAGE_FILE_MODE, resume)) {
+      return false;
     }
+    client->downloaded_bytes = offset;
+    // The hash is restarted from the blocks already in the file
+    image_hash_free(&client->new_image_hash);
+    if (!image_hash_init(&client->new_image_hash) ||
+        (resume && !image_hash_update_file(&client->new_image_hash,
+                                           sink->tmp_path, offset))) {
+      return false;
+    }
+  }
+  if (offset != client->downloaded_bytes) {
+    printf("Downloaded block at offset %zu but expected offset %zu\n", offset,
+           client->downloaded_bytes);
+    return false;
+  }
+  if (!write_image(client, (off_t)offset, buf, len)) {
+    return false;
   }
-  downloaded_bytes += len;
+  client->downloaded_bytes += len;
   printf("Downloaded %zi of %d bytes (block %d with %zi bytes)\n",
-         downloaded_bytes, max_size, block_num, len);
-  last_block = block_num;
+         client->downloaded_bytes, max_size, block_num, len);
+  return true;
+}
+
+// Make the blocks written so far durable before the download journal records
+// them.
+bool sync_image_cb(void *user_data) {
+  client_t *client = user_data;
+  return image_sink_sync(&client->image_sink);
+}
+
+// Hold the download back while the image writer is behind.
+bool image_ready_cb(void *user_data) {
+  client_t *client = user_data;
+  return image_sink_has_room(&client->image_sink);
+}
 
-  // Append to image file
-  int fd = open(IMAGE_FILE, O_CREAT | O_WRONLY | O_APPEND, IMAGE_FILE_MODE);
-  if (fd < 0) {
-    printf("**** Error opening image file: %d\n", fd);
+// Callback for patch blocks. The patch is applied to the running image as it
+// arrives and the result is written to the image sink by write_patched_cb.
+bool download_patch_cb(void *user_data, int block_num, size_t block_size,
+                       uint8_t *buf, size_t len, uint32_t max_size) {
+  client_t *client = user_data;
+  size_t offset = (size_t)block_num * block_size;
+  if (offset != client->downloaded_bytes) {
+    printf("Downloaded patch block at offset %zu but expected offset %zu\n",
+           offset, client->downloaded_bytes);
+    return false;
+  }
+  bool ok = client->compressed_download
+                ? decompress_write(&client->decompressor, buf, len)
+                : delta_apply(&client->patch, buf, len);
+  if (!ok) {
+    return false;
   }
-  write(fd, buf, len);
-  close(fd);
+  client->downloaded_bytes += len;
+  printf("Downloaded %zi of %d patch bytes\n", client->downloaded_bytes,
+         max_size);
+  return true;
+}
 
-  if (downloaded_bytes == max_size) {
-    printf("Download complate\n");
-    downloaded_bytes = 0;
-    last_block = -1;
+// Callback for compressed image blocks. The decompressed data is written to
+// the image sink by write_image_cb.
+bool download_compressed_cb(void *user_data, int block_num, size_t block_size,
+                            uint8_t *buf, size_t len, uint32_t max_size) {
+  client_t *client = user_data;
+  size_t offset = (size_t)block_num * block_size;
+  if (offset != client->downloaded_bytes) {
+    printf("Downloaded block at offset %zu but expected offset %zu\n", offset,
+           client->downloaded_bytes);
+    return false;
+  }
+  if (!decompress_write(&client->decompressor, buf, len)) {
+    return false;
   }
+  client->downloaded_bytes += len;
+  printf("Downloaded %zi of %d bytes (%zi bytes decompressed)\n",
+         client->downloaded_bytes, max_size, client->image_bytes);
   return true;
-}
\ No newline at end of file
+}
+
+bool write_patched_cb(void *user_data, uint32_t offset, const uint8_t *buf,
+                      size_t len, uint32_t size) {
+  client_t *client = user_data;
+  if (!image_sink_is_open(&client->image_sink) &&
+      !image_sink_open(&client->image_sink, size, IMAGE_FILE_MODE, false)) {
+    return false;
+  }
+  return write_image(client, offset, buf, len);
+}
+
+// The size of a compressed image isn't known up front so the image file isn't
+// preallocated.
+bool write_image_cb(void *user_data, const uint8_t *buf, size_t len) {
+  client_t *client = user_data;
+  if (!image_sink_is_open(&client->image_sink) &&
+      !image_sink_open(&client->image_sink, 0, IMAGE_FILE_MODE, false)) {
+    return false;
+  }
+  if (!write_image(client, client->image_bytes, buf, len)) {
+    return false;
+  }
+  client->image_bytes += len;
+  return true;
+}
+
+bool apply_patch_cb(void *user_data, const uint8_t *buf, size_t len) {
+  client_t *client = user_data;
+  return delta_apply(&client->patch, buf, len);
+}
+
+bool download_manifest_cb(void *user_data, int block_num, size_t block_size,
+                          uint8_t *buf, size_t len, uint32_t max_size) {
+  client_t *client = user_data;
+  size_t offset = (size_t)block_num * block_size;
+  if (offset != client->downloaded_bytes) {
+    printf("Downloaded manifest block at offset %zu but expected offset %zu\n",
+           offset, client->downloaded_bytes);
+    return false;
+  }
+  client->downloaded_bytes += len;
+  return manifest_append(&client->manifest, buf, len);
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+
+void manifest_init(block_manifest_t *manifest) {
+  memset(manifest, 0, sizeof(*manifest));
+}
+
+bool manifest_append(block_manifest_t *manifest, const uint8_t *buf,
+                     size_t len) {
+  while (len > 0 && manifest->header_len < sizeof(manifest->header)) {
+    manifest->header[manifest->header_len++] = *buf++;
+    len--;
+    if (manifest->header_len == sizeof(manifest->header)) {
+      const uint8_t *h = manifest->header;
+      manifest->block_size = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) |
+                             ((uint32_t)h[2] << 8) | h[3];
+      if (manifest->block_size == 0 ||
+          manifest->block_size > MANIFEST_MAX_BLOCK_SIZE) {
+        printf("Unsupported manifest block size %u\n", manifest->block_size);
+        return false;
+      }
+    }
+  }
+  if (len == 0) {
+    return true;
+  }
+  if (manifest->hashes_len + len > MANIFEST_MAX_BLOCKS * IMAGE_HASH_SIZE) {
+    printf("Manifest is too large\n");
+    return false;
+  }
+  if (manifest->hashes_len + len > manifest->hashes_cap) {
+    size_t cap = manifest->hashes_cap ? manifest->hashes_cap * 2 : 4096;
+    while (cap < manifest->hashes_len + len) {
+      cap *= 2;
+    }
+    uint8_t *hashes = realloc(manifest->hashes, cap);
+    if (!hashes) {
+      printf("Could not allocate manifest\n");
+      return false;
+    }
+    manifest->hashes = hashes;
+    manifest->hashes_cap = cap;
+  }
+  memcpy(manifest->hashes + manifest->hashes_len, buf, len);
+  manifest->hashes_len += len;
+  manifest->block_count = manifest->hashes_len / IMAGE_HASH_SIZE;
+  return true;
+}
+
+bool manifest_is_valid(const block_manifest_t *manifest) {
+  return manifest->header_len == sizeof(manifest->header) &&
+         manifest->block_count > 0 &&
+         manifest->hashes_len % IMAGE_HASH_SIZE == 0;
+}
+
+bool manifest_check_block(const block_manifest_t *manifest, uint32_t index,
+                          const uint8_t *buf, size_t len) {
+  if (index >= manifest->block_count) {
+    printf("Block %u is not in the manifest\n", index);
+    return false;
+  }
+  uint8_t digest[IMAGE_HASH_SIZE];
+  image_hash_t hash;
+  if (!image_hash_init(&hash) || !image_hash_update(&hash, buf, len) ||
+      !image_hash_final(&hash, digest)) {
+    image_hash_free(&hash);
+    return false;
+  }
+  return memcmp(digest, manifest->hashes + index * IMAGE_HASH_SIZE,
+                IMAGE_HASH_SIZE) == 0;
+}
+
+void manifest_free(block_manifest_t *manifest) {
+  free(manifest->hashes);
+  manifest_init(manifest);
+}
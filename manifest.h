@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_hash.h"
+
+/**
+ * Largest block size accepted in a manifest. Blocks are held in memory until
+ * they are verified.
+ */
+#define MANIFEST_MAX_BLOCK_SIZE 16384
+
+/**
+ * Largest number of blocks in a manifest.
+ */
+#define MANIFEST_MAX_BLOCKS 65536
+
+/**
+ * A per-block hash manifest for an image. The manifest is a 4 byte big endian
+ * block size followed by the SHA-256 of each block of the image as it is
+ * downloaded. The last block can be shorter than the block size.
+ */
+typedef struct {
+  uint32_t block_size;
+  uint32_t block_count;
+  uint8_t header[4];
+  size_t header_len;
+  uint8_t *hashes;
+  size_t hashes_len;
+  size_t hashes_cap;
+} block_manifest_t;
+
+/**
+ * Initialise an empty manifest.
+ */
+void manifest_init(block_manifest_t *manifest);
+
+/**
+ * Add the next part of the manifest as it is downloaded.
+ */
+bool manifest_append(block_manifest_t *manifest, const uint8_t *buf,
+                     size_t len);
+
+/**
+ * Returns true when the manifest is complete and well formed.
+ */
+bool manifest_is_valid(const block_manifest_t *manifest);
+
+/**
+ * Check a block against the manifest.
+ */
+bool manifest_check_block(const block_manifest_t *manifest, uint32_t index,
+                          const uint8_t *buf, size_t len);
+
+/**
+ * Release the manifest.
+ */
+void manifest_free(block_manifest_t *manifest);
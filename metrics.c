@@ -0,0 +1,69 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+static FILE *metrics_file;
+// Offset from the monotonic clock to the wall clock when the file was opened
+static int64_t wall_offset_us;
+
+static const char *phase_names[] = {
+    [METRICS_DNS] = "dns",
+    [METRICS_CONNECT] = "connect",
+    [METRICS_REPORT] = "report",
+    [METRICS_BLOCK] = "block",
+};
+
+static uint64_t clock_us(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool metrics_open(const char *file) {
+  metrics_close();
+  if (!file) {
+    return true;
+  }
+  metrics_file = fopen(file, "a");
+  if (!metrics_file) {
+    printf("Could not open metrics file %s\n", file);
+    return false;
+  }
+  // Each span is a complete line in the file even if the client is killed
+  setvbuf(metrics_file, NULL, _IOLBF, 0);
+  wall_offset_us = clock_us(CLOCK_REALTIME) - clock_us(CLOCK_MONOTONIC);
+  return true;
+}
+
+void metrics_close(void) {
+  if (metrics_file) {
+    fclose(metrics_file);
+    metrics_file = NULL;
+  }
+}
+
+void metrics_start(metrics_span_t *span) {
+  memset(span, 0, sizeof(*span));
+  if (metrics_file) {
+    span->start_us = clock_us(CLOCK_MONOTONIC);
+  }
+}
+
+void metrics_end(metrics_span_t *span, metrics_phase_t phase, bool ok,
+                 uint32_t id) {
+  if (span->start_us == 0 || !metrics_file) {
+    return;
+  }
+  uint64_t duration = clock_us(CLOCK_MONOTONIC) - span->start_us;
+  fprintf(metrics_file,
+          "{\"t\":%" PRIu64 ",\"phase\":\"%s\",\"us\":%" PRIu64
+          ",\"retx\":%" PRIu32 ",\"bytes\":%" PRIu32
+          ",\"ok\":%s,\"id\":%" PRIu32 "}\n",
+          (span->start_us + wall_offset_us) / 1000, phase_names[phase],
+          duration, span->retransmits, span->bytes, ok ? "true" : "false",
+          id);
+  span->start_us = 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * The phases that are timed
+ */
+typedef enum {
+  METRICS_DNS,     // Address lookup for a host
+  METRICS_CONNECT, // DTLS or TLS session establishment
+  METRICS_REPORT,  // Report request and response
+  METRICS_BLOCK,   // Block2 request and response
+} metrics_phase_t;
+
+/**
+ * A timed span. The start is zero when metrics are disabled and nothing is
+ * recorded for the span.
+ */
+typedef struct {
+  uint64_t start_us;
+  uint32_t retransmits;
+  uint32_t bytes;
+} metrics_span_t;
+
+/**
+ * Write spans to the file as JSON lines. Each line has the wall clock start
+ * time in ms, the phase, the duration in us, the number of retransmissions,
+ * the number of bytes, whether the phase succeeded and an ID for the phase
+ * (the offset of a block). Set to NULL to disable.
+ */
+bool metrics_open(const char *file);
+
+/**
+ * Flush and close the metrics file.
+ */
+void metrics_close(void);
+
+/**
+ * Start a span. This only reads the clock when metrics are enabled.
+ */
+void metrics_start(metrics_span_t *span);
+
+/**
+ * End a span and write it to the metrics file. The span is cleared so it's
+ * only written once.
+ */
+void metrics_end(metrics_span_t *span, metrics_phase_t phase, bool ok,
+                 uint32_t id);
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mirrors.h"
+
+// Size of the ranges handed out to the hosts
+#define CHUNK_SIZE (64 * 1024)
+// A host that hasn't delivered anything for this long is dropped
+#define STALL_SECONDS 10
+// Longest wait in the I/O loop
+#define POLL_MS 1000
+
+typedef enum {
+  CHUNK_PENDING,
+  CHUNK_ACTIVE,
+  CHUNK_DONE,
+} chunk_state_t;
+
+typedef struct {
+  chunk_state_t state;
+  uint8_t *data;
+  size_t len;
+  bool last; // The image ends with this chunk
+} chunk_t;
+
+struct mirror_download_s;
+
+typedef struct {
+  struct mirror_download_s *md;
+  const download_source_t *source;
+  coap_state_t *conn;
+  download_t *dl;
+  int chunk; // The chunk being downloaded or -1
+  coap_tick_t progress;
+  uint32_t bytes;
+} source_t;
+
+typedef struct mirror_download_s {
+  coap_state_t *state;
+  const char *path;
+  source_t sources[MIRRORS_MAX_SOURCES];
+  size_t source_count;
+  download_options_t options;
+  size_t chunk_size;
+  uint32_t total_size; // Zero until a host reports the size
+  chunk_t *chunks;
+  size_t chunk_count; // Chunks in the image, or allocated so far if the size
+                      // isn't known
+  size_t next_deliver;
+  bool done;
+  bool failed;
+} mirror_download_t;
+
+// Room for at least this many chunks
+static bool grow_chunks(mirror_download_t *md, size_t count) {
+  if (count <= md->chunk_count) {
+    return true;
+  }
+  chunk_t *chunks = realloc(md->chunks, count * sizeof(chunk_t));
+  if (!chunks) {
+    printf("Could not allocate download chunks\n");
+    return false;
+  }
+  memset(chunks + md->chunk_count, 0,
+         (count - md->chunk_count) * sizeof(chunk_t));
+  md->chunks = chunks;
+  md->chunk_count = count;
+  return true;
+}
+
+// Blocks arrive in order within a chunk
+static bool chunk_cb(void *user_data, int block_num, size_t block_size,
+                     uint8_t *buf, size_t len, uint32_t max_size) {
+  source_t *src = user_data;
+  mirror_download_t *md = src->md;
+  chunk_t *chunk = &md->chunks[src->chunk];
+  size_t start = (size_t)src->chunk * md->chunk_size;
+  size_t offset = (size_t)block_num * block_size;
+  if (offset != start + chunk->len ||
+      chunk->len + len > md->chunk_size) {
+    printf("Block at offset %zu is outside the range from %s\n", offset,
+           src->source->hostname);
+    return false;
+  }
+  memcpy(chunk->data + chunk->len, buf, len);
+  chunk->len += len;
+  src->bytes += len;
+  coap_ticks(&src->progress);
+  return true;
+}
+
+// The first host to report the size decides how many chunks there are
+static void set_size(mirror_download_t *md, uint32_t size) {
+  md->total_size = size;
+  size_t count = (size + md->chunk_size - 1) / md->chunk_size;
+  if (count == 0 || !grow_chunks(md, count)) {
+    md->failed = true;
+    return;
+  }
+  md->chunk_count = count;
+  md->chunks[count - 1].last = true;
+  printf("Downloading %u bytes from %zu hosts\n", size, md->source_count);
+}
+
+// Put the source's chunk back in the queue
+static void release_chunk(source_t *src) {
+  if (src->chunk < 0) {
+    return;
+  }
+  chunk_t *chunk = &src->md->chunks[src->chunk];
+  free(chunk->data);
+  chunk->data = NULL;
+  chunk->len = 0;
+  chunk->state = CHUNK_PENDING;
+  src->chunk = -1;
+}
+
+static void drop_source(source_t *src, const char *reason) {
+  printf("Dropping %s:%d from the download: %s\n", src->source->hostname,
+         src->source->port, reason);
+  if (src->dl) {
+    coap_download_free(src->dl);
+    src->dl = NULL;
+  }
+  release_chunk(src);
+  coap_release_session(src->md->state, src->conn);
+  src->conn = NULL;
+}
+
+// The next chunk to download. Until the size is known the chunks are
+// downloaded one at a time.
+static int next_chunk(mirror_download_t *md) {
+  if (md->total_size == 0) {
+    for (size_t i = 0; i < md->chunk_count; i++) {
+      if (md->chunks[i].state == CHUNK_ACTIVE) {
+        return -1;
+      }
+      if (md->chunks[i].state == CHUNK_PENDING) {
+        return i;
+      }
+    }
+    if (md->chunk_count > 0 && md->chunks[md->chunk_count - 1].last) {
+      return -1;
+    }
+    return grow_chunks(md, md->chunk_count + 1) ? (int)md->chunk_count - 1
+                                                : -1;
+  }
+  // Only keep a limited number of chunks in memory ahead of the callback
+  size_t limit = md->next_deliver + 2 * md->source_count;
+  for (size_t i = md->next_deliver; i < md->chunk_count && i < limit; i++) {
+    if (md->chunks[i].state == CHUNK_PENDING) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// The consumer's flow control sees the caller's user data, not the source
+static bool source_ready(void *user_data) {
+  source_t *src = user_data;
+  mirror_download_t *md = src->md;
+  return md->options.ready_callback(md->options.user_data);
+}
+
+static void start_chunk(source_t *src, int index) {
+  mirror_download_t *md = src->md;
+  chunk_t *chunk = &md->chunks[index];
+  chunk->data = malloc(md->chunk_size);
+  if (!chunk->data) {
+    printf("Could not allocate download chunk\n");
+    md->failed = true;
+    return;
+  }
+  chunk->len = 0;
+  chunk->state = CHUNK_ACTIVE;
+  src->chunk = index;
+
+  download_options_t options = md->options;
+  options.offset = index * md->chunk_size;
+  options.length = md->chunk_size;
+  options.callback = chunk_cb;
+  options.user_data = src;
+  if (md->options.ready_callback) {
+    options.ready_callback = source_ready;
+  }
+  coap_ticks(&src->progress);
+  src->dl = coap_download_start(src->conn, md->path, &options);
+  if (!src->dl) {
+    drop_source(src, "could not start download");
+  }
+}
+
+static void finish_chunk(source_t *src) {
+  mirror_download_t *md = src->md;
+  chunk_t *chunk = &md->chunks[src->chunk];
+  uint32_t size = coap_download_size(src->dl);
+  if (md->total_size > 0 && size != md->total_size) {
+    drop_source(src, "image size differs");
+    return;
+  }
+  if (md->total_size == 0 && !coap_download_has_more(src->dl)) {
+    chunk->last = true;
+  }
+  chunk->state = CHUNK_DONE;
+  coap_download_free(src->dl);
+  src->dl = NULL;
+  src->chunk = -1;
+}
+
+// Pass completed chunks to the callback in order
+static void deliver_chunks(mirror_download_t *md) {
+  while (!md->done && !md->failed && md->next_deliver < md->chunk_count &&
+         md->chunks[md->next_deliver].state == CHUNK_DONE) {
+    chunk_t *chunk = &md->chunks[md->next_deliver];
+    if (md->options.callback &&
+        !md->options.callback(md->options.user_data, md->next_deliver,
+                              md->chunk_size, chunk->data, chunk->len,
+                              md->total_size)) {
+      printf("Aborting download\n");
+      md->failed = true;
+      return;
+    }
+    free(chunk->data);
+    chunk->data = NULL;
+    md->done = chunk->last;
+    md->next_deliver++;
+  }
+}
+
+// Check the source's download and give it more work. Returns the time until
+// the source's next timeout.
+static unsigned int run_source(source_t *src, coap_tick_t now) {
+  mirror_download_t *md = src->md;
+  unsigned int timeout = POLL_MS;
+  if (!src->conn) {
+    return timeout;
+  }
+  if (src->dl) {
+    timeout = coap_download_poll(src->dl);
+    if (md->total_size == 0 && coap_download_size(src->dl) > 0) {
+      set_size(md, coap_download_size(src->dl));
+    }
+    if (coap_download_is_done(src->dl)) {
+      finish_chunk(src);
+    } else if (coap_download_has_failed(src->dl)) {
+      drop_source(src, "download failed");
+    } else if (coap_download_is_held(src->dl)) {
+      // Waiting for the pacer or the consumer isn't a stall
+      src->progress = now;
+    } else if (now - src->progress > STALL_SECONDS * COAP_TICKS_PER_SECOND) {
+      drop_source(src, "stalled");
+    }
+  }
+  if (src->conn && !src->dl && !md->failed) {
+    int index = next_chunk(md);
+    if (index >= 0) {
+      start_chunk(src, index);
+      timeout = 1;
+    }
+  }
+  return timeout;
+}
+
+// Connect to a source. The session in the state is used if it's to the same
+// host. Other sessions share the state's I/O loop.
+static coap_state_t *connect_source(coap_state_t *state,
+                                    const download_source_t *source,
+                                    coap_proto_t proto, const char *cert_file,
+                                    const char *key_file) {
+  if (state->session && state->port == source->port && state->proto == proto &&
+      strcmp(state->host, source->hostname) == 0) {
+    return state;
+  }
+  return coap_add_session(state, source->hostname, source->port, proto,
+                          cert_file, key_file);
+}
+
+// Run the download with every source connected over the transport. Started is
+// set if any host sent a block.
+static bool download_mirrors_over(coap_state_t *state,
+                                  const download_source_t *sources,
+                                  size_t count, const char *path,
+                                  const download_options_t *options,
+                                  coap_proto_t proto, const char *cert_file,
+                                  const char *key_file, bool *started) {
+  mirror_download_t md;
+  memset(&md, 0, sizeof(md));
+  md.state = state;
+  md.path = path;
+  md.options = *options;
+  // Ranges must cover whole manifest blocks
+  md.chunk_size = CHUNK_SIZE;
+  if (md.options.manifest) {
+    size_t block_size = md.options.manifest->block_size;
+    md.chunk_size = (CHUNK_SIZE + block_size - 1) / block_size * block_size;
+  }
+
+  for (size_t i = 0; i < count && i < MIRRORS_MAX_SOURCES; i++) {
+    source_t *src = &md.sources[md.source_count++];
+    src->md = &md;
+    src->source = &sources[i];
+    src->chunk = -1;
+    src->conn = connect_source(state, &sources[i], proto, cert_file, key_file);
+    if (!src->conn) {
+      printf("Could not connect to %s:%d\n", sources[i].hostname,
+             sources[i].port);
+    }
+  }
+
+  while (!md.done && !md.failed) {
+    coap_tick_t now;
+    coap_ticks(&now);
+    unsigned int timeout = POLL_MS;
+    bool running = false;
+    for (size_t i = 0; i < md.source_count && !md.failed; i++) {
+      unsigned int ms = run_source(&md.sources[i], now);
+      if (ms < timeout) {
+        timeout = ms;
+      }
+      running = running || md.sources[i].conn;
+    }
+    deliver_chunks(&md);
+    if (!running) {
+      printf("No hosts left to download from\n");
+      md.failed = true;
+    }
+    if (!md.done && !md.failed) {
+      coap_run_once(state->ctx, timeout);
+    }
+  }
+
+  for (size_t i = 0; i < md.source_count; i++) {
+    source_t *src = &md.sources[i];
+    if (src->bytes > 0) {
+      printf("Got %u bytes from %s:%d\n", src->bytes, src->source->hostname,
+             src->source->port);
+      *started = true;
+    }
+    if (src->dl) {
+      coap_download_free(src->dl);
+    }
+    if (src->conn) {
+      coap_release_session(state, src->conn);
+    }
+  }
+  for (size_t i = 0; i < md.chunk_count; i++) {
+    free(md.chunks[i].data);
+  }
+  free(md.chunks);
+  return md.done;
+}
+
+bool coap_download_mirrors(coap_state_t *state,
+                           const download_source_t *sources, size_t count,
+                           const char *path, download_cb_t callback,
+                           void *user_data, const char *cert_file,
+                           const char *key_file) {
+  download_options_t options;
+  coap_download_default_options(state, &options, callback, user_data);
+  coap_proto_t proto = coap_download_transport(state);
+  bool started = false;
+  if (download_mirrors_over(state, sources, count, path, &options, proto,
+                            cert_file, key_file, &started)) {
+    return true;
+  }
+  // The same fallback as coap_download_firmware. Nothing has been passed to
+  // the callback if no host sent a block.
+  if (proto != COAP_PROTO_DTLS && !started) {
+    printf("Download over TLS failed, retrying with DTLS\n");
+    return download_mirrors_over(state, sources, count, path, &options,
+                                 COAP_PROTO_DTLS, cert_file, key_file,
+                                 &started);
+  }
+  return false;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "coap.h"
+#include "download.h"
+
+/**
+ * Maximum number of hosts a download is spread over.
+ */
+#define MIRRORS_MAX_SOURCES 5
+
+/**
+ * A host serving the image.
+ */
+typedef struct {
+  const char *hostname;
+  int port;
+} download_source_t;
+
+/**
+ * Download an image from several hosts at once. The image is split into
+ * ranges that are handed out to the hosts as they finish the previous range
+ * so faster hosts download more of the image. Ranges are passed to the
+ * callback in order. A host that fails or stops sending blocks is dropped and
+ * its range is given to another host. The first host is the primary. It
+ * reuses the session in the state if it's the same host, and it alone is used
+ * until the image size is known. The download options are the defaults for
+ * coap_download_firmware except that the journal isn't used. If no host sends
+ * a block over TLS the download is retried over DTLS. This blocks until the
+ * download is completed or every host has failed.
+ */
+bool coap_download_mirrors(coap_state_t *state,
+                           const download_source_t *sources, size_t count,
+                           const char *path, download_cb_t callback,
+                           void *user_data, const char *cert_file,
+                           const char *key_file);
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pacer.h"
+
+#define MS_PER_DAY ((uint64_t)PACER_SECONDS_PER_DAY * 1000)
+
+static uint64_t clock_ms(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void pacer_init(pacer_t *pacer, const pacer_config_t *config) {
+  memset(pacer, 0, sizeof(*pacer));
+  pacer->config = *config;
+  if (pacer->config.window_count > PACER_MAX_WINDOWS) {
+    pacer->config.window_count = PACER_MAX_WINDOWS;
+  }
+  if (pacer->config.burst == 0) {
+    pacer->config.burst = pacer->config.rate;
+  }
+  pacer->tokens = pacer->config.burst;
+  pacer->last_ms = clock_ms(CLOCK_MONOTONIC);
+}
+
+bool pacer_parse_window(const char *text, pacer_window_t *window) {
+  unsigned int start_h, start_m, end_h, end_m;
+  char extra;
+  if (sscanf(text, "%u:%u-%u:%u%c", &start_h, &start_m, &end_h, &end_m,
+             &extra) != 4 ||
+      start_h > 23 || start_m > 59 || end_h > 23 || end_m > 59) {
+    return false;
+  }
+  uint32_t start = start_h * 3600 + start_m * 60;
+  uint32_t end = end_h * 3600 + end_m * 60;
+  window->start = start;
+  // A window that ends where it starts is open all day
+  window->length = end > start ? end - start
+                               : end + PACER_SECONDS_PER_DAY - start;
+  return true;
+}
+
+// Time until one of the windows opens, 0 if one is open now
+static unsigned int window_delay_ms(const pacer_t *pacer) {
+  if (pacer->config.window_count == 0) {
+    return 0;
+  }
+  uint64_t now = clock_ms(CLOCK_REALTIME) % MS_PER_DAY;
+  uint64_t delay = MS_PER_DAY;
+  for (size_t i = 0; i < pacer->config.window_count; i++) {
+    uint64_t start = (uint64_t)pacer->config.windows[i].start * 1000;
+    uint64_t length = (uint64_t)pacer->config.windows[i].length * 1000;
+    if ((now + MS_PER_DAY - start) % MS_PER_DAY < length) {
+      return 0;
+    }
+    uint64_t wait = (start + MS_PER_DAY - now) % MS_PER_DAY;
+    if (wait < delay) {
+      delay = wait;
+    }
+  }
+  return delay > 0 ? delay : 1;
+}
+
+static void refill(pacer_t *pacer, uint64_t now) {
+  pacer->tokens += (double)(now - pacer->last_ms) * pacer->config.rate / 1000;
+  if (pacer->tokens > pacer->config.burst) {
+    pacer->tokens = pacer->config.burst;
+  }
+  pacer->last_ms = now;
+}
+
+unsigned int pacer_delay_ms(pacer_t *pacer, size_t bytes) {
+  uint64_t now = clock_ms(CLOCK_MONOTONIC);
+  unsigned int delay = window_delay_ms(pacer);
+  if (delay > 0) {
+    if (!pacer->paused) {
+      pacer->paused = true;
+      pacer->pauses++;
+      pacer->pause_start_ms = now;
+    }
+    return delay;
+  }
+  if (pacer->paused) {
+    pacer->paused = false;
+    pacer->paused_ms += now - pacer->pause_start_ms;
+    if (pacer->start_ms > 0) {
+      pacer->bursts++;
+    }
+  }
+  if (pacer->config.rate == 0) {
+    return 0;
+  }
+
+  refill(pacer, now);
+  // A request larger than the bucket goes out when the bucket is full and
+  // leaves it in debt
+  double need = bytes < pacer->config.burst ? bytes : pacer->config.burst;
+  if (pacer->refilling) {
+    need = pacer->config.burst;
+  }
+  if (pacer->tokens >= need) {
+    if (pacer->refilling) {
+      pacer->refilling = false;
+      pacer->bursts++;
+    }
+    return 0;
+  }
+  // Let the bucket fill completely so the next requests go out together
+  pacer->refilling = true;
+  double ms = (pacer->config.burst - pacer->tokens) * 1000 / pacer->config.rate;
+  return ms >= 1 ? (unsigned int)ms : 1;
+}
+
+void pacer_consume(pacer_t *pacer, size_t bytes) {
+  if (pacer->start_ms == 0) {
+    // Waiting for the first window isn't part of the download
+    pacer->start_ms = clock_ms(CLOCK_MONOTONIC);
+    pacer->paused_ms = 0;
+    pacer->pauses = 0;
+    pacer->bursts = 1;
+  }
+  pacer->tokens -= bytes;
+  pacer->bytes += bytes;
+}
+
+bool pacer_is_paused(const pacer_t *pacer) { return pacer->paused; }
+
+void pacer_get_stats(const pacer_t *pacer, pacer_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->configured_rate = pacer->config.rate;
+  stats->bytes = pacer->bytes;
+  stats->bursts = pacer->bursts;
+  stats->pauses = pacer->pauses;
+  if (pacer->start_ms == 0) {
+    return;
+  }
+  uint64_t now = clock_ms(CLOCK_MONOTONIC);
+  uint64_t paused = pacer->paused_ms;
+  if (pacer->paused) {
+    paused += now - pacer->pause_start_ms;
+  }
+  uint64_t elapsed = now - pacer->start_ms;
+  stats->elapsed_ms = elapsed;
+  stats->paused_ms = paused;
+  if (elapsed > 0) {
+    stats->achieved_rate = pacer->bytes * 1000 / elapsed;
+  }
+  if (elapsed > paused) {
+    stats->open_rate = pacer->bytes * 1000 / (elapsed - paused);
+  }
+}
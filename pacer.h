@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of daily windows where downloads are allowed.
+ */
+#define PACER_MAX_WINDOWS 4
+
+#define PACER_SECONDS_PER_DAY 86400
+
+/**
+ * A daily window where downloads are allowed. The start is in seconds after
+ * midnight UTC. A window can run past midnight.
+ */
+typedef struct {
+  uint32_t start;
+  uint32_t length;
+} pacer_window_t;
+
+typedef struct {
+  uint32_t rate;  // Average bytes per second, 0 for no limit
+  uint32_t burst; // Bytes sent back to back before the radio can sleep
+  pacer_window_t windows[PACER_MAX_WINDOWS];
+  size_t window_count; // 0 to allow downloads at any time
+} pacer_config_t;
+
+/**
+ * Achieved and configured rates for a paced download. The achieved rate is
+ * over the whole time since the first request. The open rate leaves out the
+ * time spent outside the allowed windows.
+ */
+typedef struct {
+  uint32_t configured_rate;
+  uint32_t achieved_rate;
+  uint32_t open_rate;
+  uint64_t bytes;      // Bytes requested, including retries
+  uint32_t bursts;     // Bursts of requests with the radio idle in between
+  uint32_t pauses;     // Times the download stopped at the end of a window
+  uint32_t elapsed_ms; // Since the first request
+  uint32_t paused_ms;  // Spent outside the allowed windows
+} pacer_stats_t;
+
+/**
+ * Paces block requests with a token bucket and daily time windows. The bucket
+ * fills at the configured rate up to the burst size. When a request doesn't
+ * fit the pacer waits until the bucket is full again so requests go out in
+ * bursts and the radio can sleep between them. Outside the windows no
+ * requests are sent at all.
+ */
+typedef struct {
+  pacer_config_t config;
+  double tokens;
+  uint64_t last_ms;  // Last refill of the bucket
+  uint64_t start_ms; // First request, 0 before that
+  bool refilling;    // Waiting for a full bucket before the next burst
+  bool paused;       // Outside the allowed windows
+  uint64_t pause_start_ms;
+  uint64_t bytes;
+  uint32_t bursts;
+  uint32_t pauses;
+  uint64_t paused_ms;
+} pacer_t;
+
+/**
+ * Initialise the pacer with a full bucket. A burst of 0 is the same as one
+ * second at the configured rate.
+ */
+void pacer_init(pacer_t *pacer, const pacer_config_t *config);
+
+/**
+ * Parse a window written as HH:MM-HH:MM in UTC.
+ */
+bool pacer_parse_window(const char *text, pacer_window_t *window);
+
+/**
+ * Returns 0 if a request for this many bytes can be sent now. Otherwise this
+ * is the number of milliseconds until it can be sent.
+ */
+unsigned int pacer_delay_ms(pacer_t *pacer, size_t bytes);
+
+/**
+ * Take the bytes of a request that is sent from the bucket. Retries are
+ * counted too since they use the radio as well.
+ */
+void pacer_consume(pacer_t *pacer, size_t bytes);
+
+/**
+ * Returns true while the time is outside the allowed windows.
+ */
+bool pacer_is_paused(const pacer_t *pacer);
+
+/**
+ * Get the statistics for the requests paced so far.
+ */
+void pacer_get_stats(const pacer_t *pacer, pacer_stats_t *stats);
@@ -0,0 +1,619 @@
+// Caching proxy for image downloads. Devices on the LAN download images
+// through the proxy (fota-sample -p host) by sending their block requests to
+// it with the image's URI in the Proxy-Uri option. Each image is fetched from
+// the server once and kept in a content-addressed block cache on disk.
+// Requests for blocks that haven't arrived from the server yet wait for the
+// upstream download so an image is only fetched once no matter how many
+// devices ask for it at the same time.
+//
+// Image URIs are assumed not to change content (the server uses a new path
+// for each version). A cached image is served without asking the server;
+// the size and ETag are only checked when blocks are fetched.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_cache.h"
+#include "coap.h"
+#include "download.h"
+
+#define DEFAULT_PORT 5684
+#define DEFAULT_CACHE_DIR "proxy-cache"
+// The proxy connects to the server as a device with this identity
+#define CERT_FILE "cert.crt"
+#define KEY_FILE "key.pem"
+// The devices connect to the proxy with this identity. The certificate must
+// be issued by a CA the devices trust.
+#define SERVER_CERT_FILE "proxy.crt"
+#define SERVER_KEY_FILE "proxy.key"
+#define KEEPALIVE_SECONDS 10
+
+// Block requests in flight to the server for each image
+#define UPSTREAM_WINDOW 8
+#define MAX_IMAGES 16
+#define MAX_WAITERS 256
+// Devices retry a block request long before this so the request is dropped
+#define WAITER_TIMEOUT_SECONDS 30
+// Longest time the I/O loop blocks
+#define MAX_LOOP_WAIT_MS 1000
+// Largest block size served (SZX 6, 1024 bytes)
+#define MAX_SZX 6
+#define MAX_URI (COAP_MAX_HOST + JOURNAL_MAX_PATH + 32)
+#define MAX_TOKEN 8
+
+typedef struct {
+  bool in_use;
+  char uri[MAX_URI];
+  char host[COAP_MAX_HOST];
+  int port;
+  char path[JOURNAL_MAX_PATH];
+  block_cache_t cache;
+  coap_state_t *upstream;
+  download_t *dl;
+  bool restart; // The image changed during the fetch. Fetch from the start.
+  // Blocks from the server are collected into cache units here
+  size_t unit;
+  size_t unit_len;
+  uint8_t unit_buf[BLOCK_CACHE_UNIT_SIZE];
+  int waiters;
+  coap_tick_t last_used;
+} image_t;
+
+// A device request for a block that isn't in the cache yet. It's answered
+// with a separate response when the block arrives.
+typedef struct {
+  bool in_use;
+  image_t *image;
+  coap_session_t *session;
+  uint8_t token[MAX_TOKEN];
+  size_t token_len;
+  uint8_t type;
+  unsigned int num;
+  unsigned int szx;
+  coap_tick_t since;
+} waiter_t;
+
+typedef struct {
+  int port;
+  const char *cache_dir;
+  const char *cert_file;
+  const char *key_file;
+  const char *server_cert_file;
+  const char *server_key_file;
+} proxy_config_t;
+
+static proxy_config_t config = {
+    .port = DEFAULT_PORT,
+    .cache_dir = DEFAULT_CACHE_DIR,
+    .cert_file = CERT_FILE,
+    .key_file = KEY_FILE,
+    .server_cert_file = SERVER_CERT_FILE,
+    .server_key_file = SERVER_KEY_FILE,
+};
+
+// Upstream sessions are added to the proxy's context through this state
+static coap_state_t upstream_base;
+static image_t images[MAX_IMAGES];
+static waiter_t waiters[MAX_WAITERS];
+
+static size_t szx_size(unsigned int szx) { return 1 << (szx + 4); }
+
+// Split "coaps://host:port/path" into the image's host, port and path. IPv6
+// addresses are in brackets.
+static bool parse_uri(const char *uri, image_t *image) {
+  const char *scheme = "coaps://";
+  if (strncmp(uri, scheme, strlen(scheme)) != 0) {
+    return false;
+  }
+  const char *host = uri + strlen(scheme);
+  const char *host_end;
+  const char *rest;
+  if (host[0] == '[') {
+    host++;
+    host_end = strchr(host, ']');
+    if (!host_end) {
+      return false;
+    }
+    rest = host_end + 1;
+  } else {
+    host_end = host + strcspn(host, ":/");
+    rest = host_end;
+  }
+  size_t host_len = host_end - host;
+  if (host_len == 0 || host_len >= sizeof(image->host)) {
+    return false;
+  }
+  image->port = COAPS_DEFAULT_PORT;
+  if (rest[0] == ':') {
+    char *end;
+    long port = strtol(rest + 1, &end, 10);
+    if (end == rest + 1 || port < 1 || port > 65535) {
+      return false;
+    }
+    image->port = port;
+    rest = end;
+  }
+  if (rest[0] != '/' || strlen(rest) >= sizeof(image->path)) {
+    return false;
+  }
+  memcpy(image->host, host, host_len);
+  image->host[host_len] = 0;
+  strcpy(image->path, rest);
+  return true;
+}
+
+// Find the image for the URI or start tracking it. An unused entry or the
+// least recently used idle image makes room for a new one. Returns NULL with
+// the response code for the device if the image can't be tracked.
+static image_t *find_image(const char *uri, uint8_t *code) {
+  coap_tick_t now;
+  coap_ticks(&now);
+  image_t *victim = NULL;
+  for (int i = 0; i < MAX_IMAGES; i++) {
+    image_t *image = &images[i];
+    if (image->in_use && strcmp(image->uri, uri) == 0) {
+      image->last_used = now;
+      return image;
+    }
+    if (!image->in_use) {
+      if (!victim || victim->in_use) {
+        victim = image;
+      }
+      continue;
+    }
+    if (image->dl || image->waiters > 0) {
+      continue;
+    }
+    if (!victim || (victim->in_use && image->last_used < victim->last_used)) {
+      victim = image;
+    }
+  }
+  if (!victim) {
+    printf("Too many images in use\n");
+    *code = COAP_RESPONSE_CODE(503);
+    return NULL;
+  }
+
+  image_t *image = victim;
+  if (image->in_use) {
+    block_cache_close(&image->cache);
+    if (image->upstream) {
+      coap_release_session(&upstream_base, image->upstream);
+    }
+  }
+  memset(image, 0, sizeof(*image));
+  if (!parse_uri(uri, image)) {
+    printf("Can't proxy %s\n", uri);
+    *code = COAP_RESPONSE_CODE(505);
+    return NULL;
+  }
+  if (!block_cache_open(&image->cache, config.cache_dir, uri)) {
+    *code = COAP_RESPONSE_CODE(500);
+    return NULL;
+  }
+  strcpy(image->uri, uri);
+  image->in_use = true;
+  image->last_used = now;
+  if (image->cache.size > 0) {
+    printf("Using cached %s (%zu of %zu blocks)\n", uri,
+           block_cache_first_missing(&image->cache), image->cache.unit_count);
+  }
+  return image;
+}
+
+// Fill in a 2.05 response with the block from the cache. Returns false if the
+// block isn't in the cache.
+static bool add_block(image_t *image, coap_pdu_t *pdu, unsigned int num,
+                      unsigned int szx) {
+  size_t block_size = szx_size(szx);
+  uint32_t offset = num * block_size;
+  uint8_t buf[BLOCK_CACHE_UNIT_SIZE];
+  size_t len;
+  size_t start = offset % BLOCK_CACHE_UNIT_SIZE;
+  if (!block_cache_get(&image->cache, offset / BLOCK_CACHE_UNIT_SIZE, buf,
+                       &len) ||
+      start >= len) {
+    return false;
+  }
+  size_t n = len - start < block_size ? len - start : block_size;
+  bool more = offset + n < image->cache.size;
+
+  pdu->code = COAP_RESPONSE_CODE(205);
+  if (image->cache.etag_len > 0) {
+    coap_add_option(pdu, COAP_OPTION_ETAG, image->cache.etag_len,
+                    image->cache.etag);
+  }
+  uint8_t opt[4];
+  size_t opt_len = coap_encode_var_safe(opt, sizeof(opt),
+                                        (num << 4) | (more ? 0x08 : 0) | szx);
+  coap_add_option(pdu, COAP_OPTION_BLOCK2, opt_len, opt);
+  opt_len = coap_encode_var_safe(opt, sizeof(opt), image->cache.size);
+  coap_add_option(pdu, COAP_OPTION_SIZE2, opt_len, opt);
+  coap_add_data(pdu, n, buf + start);
+  return true;
+}
+
+static bool add_waiter(image_t *image, coap_session_t *session,
+                       coap_pdu_t *request, unsigned int num,
+                       unsigned int szx) {
+  for (int i = 0; i < MAX_WAITERS; i++) {
+    waiter_t *waiter = &waiters[i];
+    if (waiter->in_use) {
+      continue;
+    }
+    waiter->in_use = true;
+    waiter->image = image;
+    waiter->session = coap_session_reference(session);
+    waiter->token_len = request->token_length < MAX_TOKEN
+                            ? request->token_length
+                            : MAX_TOKEN;
+    memcpy(waiter->token, request->token, waiter->token_len);
+    waiter->type = request->type;
+    waiter->num = num;
+    waiter->szx = szx;
+    coap_ticks(&waiter->since);
+    image->waiters++;
+    return true;
+  }
+  printf("Too many requests waiting for blocks\n");
+  return false;
+}
+
+static void remove_waiter(waiter_t *waiter) {
+  coap_session_release(waiter->session);
+  waiter->image->waiters--;
+  waiter->in_use = false;
+}
+
+// Send the block (or the error code if it's not 0) as a separate response
+// and forget the request.
+static void answer_waiter(waiter_t *waiter, uint8_t code) {
+  coap_session_t *session = waiter->session;
+  coap_pdu_t *pdu =
+      coap_pdu_init(waiter->type, code, coap_new_message_id(session),
+                    coap_session_max_pdu_size(session));
+  if (pdu) {
+    coap_add_token(pdu, waiter->token_len, waiter->token);
+    if (code == 0 &&
+        !add_block(waiter->image, pdu, waiter->num, waiter->szx)) {
+      pdu->code = COAP_RESPONSE_CODE(502);
+    }
+    coap_send(session, pdu);
+  }
+  remove_waiter(waiter);
+}
+
+// Answer the requests for the image that can be answered from the cache
+static void serve_waiters(image_t *image) {
+  for (int i = 0; i < MAX_WAITERS && image->waiters > 0; i++) {
+    waiter_t *waiter = &waiters[i];
+    if (!waiter->in_use || waiter->image != image) {
+      continue;
+    }
+    uint32_t offset = waiter->num * szx_size(waiter->szx);
+    if (image->cache.size > 0 && offset >= image->cache.size) {
+      answer_waiter(waiter, COAP_RESPONSE_CODE(402));
+    } else if (block_cache_has(&image->cache,
+                               offset / BLOCK_CACHE_UNIT_SIZE)) {
+      answer_waiter(waiter, 0);
+    }
+  }
+}
+
+static void fail_waiters(image_t *image) {
+  for (int i = 0; i < MAX_WAITERS && image->waiters > 0; i++) {
+    if (waiters[i].in_use && waiters[i].image == image) {
+      answer_waiter(&waiters[i], COAP_RESPONSE_CODE(502));
+    }
+  }
+}
+
+// Collect blocks from the server into cache units. The fetch starts at a unit
+// boundary and the blocks arrive in order.
+static bool upstream_block_cb(void *user_data, int block_num,
+                              size_t block_size, uint8_t *buf, size_t len,
+                              uint32_t max_size) {
+  image_t *image = (image_t *)user_data;
+  if (max_size == 0) {
+    printf("The server doesn't report the size of %s\n", image->uri);
+    return false;
+  }
+  uint8_t etag[JOURNAL_MAX_ETAG];
+  size_t etag_len = coap_download_etag(image->dl, etag, sizeof(etag));
+  if (!block_cache_same_image(&image->cache, max_size, etag, etag_len)) {
+    printf("Caching %s (%u bytes)\n", image->uri, max_size);
+    if (!block_cache_reset(&image->cache, max_size, etag, etag_len)) {
+      return false;
+    }
+    if (image->unit > 0) {
+      // The cached blocks in front of the fetch are for another image
+      image->restart = true;
+      return false;
+    }
+  }
+
+  uint32_t offset = block_num * block_size;
+  while (len > 0) {
+    if (offset != image->unit * BLOCK_CACHE_UNIT_SIZE + image->unit_len) {
+      printf("Unexpected block at offset %u for %s\n", offset, image->uri);
+      return false;
+    }
+    size_t n = BLOCK_CACHE_UNIT_SIZE - image->unit_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(image->unit_buf + image->unit_len, buf, n);
+    image->unit_len += n;
+    buf += n;
+    len -= n;
+    offset += n;
+    if (image->unit_len == BLOCK_CACHE_UNIT_SIZE ||
+        offset >= image->cache.size) {
+      if (!block_cache_put(&image->cache, image->unit, image->unit_buf,
+                           image->unit_len)) {
+        return false;
+      }
+      serve_waiters(image);
+      image->unit++;
+      image->unit_len = 0;
+    }
+  }
+  return true;
+}
+
+// Fetch the image from the first block missing in the cache
+static void start_fetch(image_t *image) {
+  if (image->dl) {
+    return;
+  }
+  size_t unit = block_cache_first_missing(&image->cache);
+  if (image->cache.size > 0 && unit >= image->cache.unit_count) {
+    serve_waiters(image);
+    return;
+  }
+  if (!image->upstream) {
+    image->upstream =
+        coap_add_session(&upstream_base, image->host, image->port,
+                         COAP_PROTO_DTLS, config.cert_file, config.key_file);
+    if (!image->upstream) {
+      printf("Could not connect to %s:%d\n", image->host, image->port);
+      fail_waiters(image);
+      return;
+    }
+  }
+  download_options_t options = {
+      .window = UPSTREAM_WINDOW,
+      .block_size = BLOCK_CACHE_UNIT_SIZE,
+      .callback = upstream_block_cb,
+      .user_data = image,
+      .offset = unit * BLOCK_CACHE_UNIT_SIZE,
+  };
+  image->unit = unit;
+  image->unit_len = 0;
+  image->restart = false;
+  image->dl = coap_download_start(image->upstream, image->path, &options);
+  if (!image->dl) {
+    fail_waiters(image);
+    return;
+  }
+  printf("Fetching %s from offset %u\n", image->uri, options.offset);
+}
+
+static void finish_fetch(image_t *image) {
+  bool done = coap_download_is_done(image->dl);
+  coap_download_free(image->dl);
+  image->dl = NULL;
+  if (image->restart && !image->upstream->failed) {
+    start_fetch(image);
+    return;
+  }
+  printf("%s %s\n", done ? "Cached" : "Could not fetch", image->uri);
+  coap_release_session(&upstream_base, image->upstream);
+  image->upstream = NULL;
+  serve_waiters(image);
+  // Blocks that are still missing aren't coming
+  fail_waiters(image);
+}
+
+// Block2 requests for images. The request carries the image's URI in the
+// Proxy-Uri option. Blocks in the cache are returned right away. Other
+// requests are left without a response code so libcoap acknowledges a
+// confirmable request with an empty ACK (and sends nothing for a
+// non-confirmable one). They're answered when the block arrives.
+static void proxy_handler(coap_context_t *ctx, coap_resource_t *resource,
+                          coap_session_t *session, coap_pdu_t *request,
+                          coap_binary_t *token, coap_string_t *query,
+                          coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option =
+      coap_check_option(request, COAP_OPTION_PROXY_URI, &opt_iter);
+  if (!option) {
+    response->code = COAP_RESPONSE_CODE(404);
+    return;
+  }
+  char uri[MAX_URI];
+  size_t len = coap_opt_length(option);
+  if (len >= sizeof(uri)) {
+    response->code = COAP_RESPONSE_CODE(414);
+    return;
+  }
+  memcpy(uri, coap_opt_value(option), len);
+  uri[len] = 0;
+
+  uint8_t code = 0;
+  image_t *image = find_image(uri, &code);
+  if (!image) {
+    response->code = code;
+    return;
+  }
+
+  coap_block_t block;
+  if (!coap_get_block(request, COAP_OPTION_BLOCK2, &block)) {
+    block.num = 0;
+    block.szx = MAX_SZX;
+  }
+  if (block.szx > MAX_SZX) {
+    block.szx = MAX_SZX;
+  }
+  uint32_t offset = block.num * szx_size(block.szx);
+  if (image->cache.size > 0 && offset >= image->cache.size) {
+    response->code = COAP_RESPONSE_CODE(402);
+    return;
+  }
+  if (image->cache.size > 0 &&
+      add_block(image, response, block.num, block.szx)) {
+    return;
+  }
+  if (!add_waiter(image, session, request, block.num, block.szx)) {
+    response->code = COAP_RESPONSE_CODE(503);
+    return;
+  }
+  start_fetch(image);
+}
+
+static bool start_server(coap_context_t *ctx) {
+  // Devices must present a certificate from the same CA as the proxy's
+  // upstream identity
+  coap_dtls_pki_t pki;
+  memset(&pki, 0, sizeof(pki));
+  pki.version = COAP_DTLS_PKI_SETUP_VERSION;
+  pki.verify_peer_cert = 1;
+  pki.require_peer_cert = 1;
+  pki.allow_self_signed = 1;
+  pki.allow_expired_certs = 0;
+  pki.cert_chain_validation = 1;
+  pki.check_cert_revocation = 0;
+  pki.cert_chain_verify_depth = 2;
+  pki.pki_key.key_type = COAP_PKI_KEY_PEM;
+  pki.pki_key.key.pem.public_cert = config.server_cert_file;
+  pki.pki_key.key.pem.private_key = config.server_key_file;
+  pki.pki_key.key.pem.ca_file = config.cert_file;
+  if (!coap_context_set_pki(ctx, &pki)) {
+    printf("Could not set up the proxy certificate\n");
+    return false;
+  }
+
+  // Listen on every address. libcoap accepts IPv4 on the IPv6 socket.
+  coap_address_t addr;
+  coap_address_init(&addr);
+  addr.addr.sin6.sin6_family = AF_INET6;
+  addr.addr.sin6.sin6_addr = in6addr_any;
+  addr.addr.sin6.sin6_port = htons(config.port);
+  addr.size = sizeof(addr.addr.sin6);
+  if (!coap_new_endpoint(ctx, &addr, COAP_PROTO_DTLS)) {
+    printf("Could not listen on port %d\n", config.port);
+    return false;
+  }
+
+  coap_resource_t *resource = coap_resource_unknown_init(NULL);
+  if (!resource) {
+    return false;
+  }
+  coap_register_handler(resource, COAP_REQUEST_GET, proxy_handler);
+  coap_add_resource(ctx, resource);
+  return true;
+}
+
+// Drop requests the devices have given up on
+static void expire_waiters(coap_tick_t now) {
+  for (int i = 0; i < MAX_WAITERS; i++) {
+    waiter_t *waiter = &waiters[i];
+    if (waiter->in_use &&
+        now - waiter->since > WAITER_TIMEOUT_SECONDS * COAP_TICKS_PER_SECOND) {
+      remove_waiter(waiter);
+    }
+  }
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [options]\n", name);
+  printf("  -p port      Port to listen on (default %d)\n", DEFAULT_PORT);
+  printf("  -d dir       Block cache directory (default %s)\n",
+         DEFAULT_CACHE_DIR);
+  printf("  -c file      Certificate for the server (default %s)\n",
+         CERT_FILE);
+  printf("  -k file      Key for the server (default %s)\n", KEY_FILE);
+  printf("  -C file      Certificate for the devices (default %s)\n",
+         SERVER_CERT_FILE);
+  printf("  -K file      Key for the devices (default %s)\n",
+         SERVER_KEY_FILE);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:d:c:k:C:K:")) != -1) {
+    switch (opt) {
+    case 'p':
+      config.port = atoi(optarg);
+      break;
+    case 'd':
+      config.cache_dir = optarg;
+      break;
+    case 'c':
+      config.cert_file = optarg;
+      break;
+    case 'k':
+      config.key_file = optarg;
+      break;
+    case 'C':
+      config.server_cert_file = optarg;
+      break;
+    case 'K':
+      config.server_key_file = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (config.port < 1 || config.port > 65535) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  coap_startup();
+  coap_dtls_set_log_level(LOG_WARNING);
+  coap_set_log_level(LOG_WARNING);
+
+  memset(&upstream_base, 0, sizeof(upstream_base));
+  upstream_base.ctx = coap_new_context(NULL);
+  if (!upstream_base.ctx) {
+    printf("Could not create CoAP context\n");
+    return 1;
+  }
+  coap_context_set_keepalive(upstream_base.ctx, KEEPALIVE_SECONDS);
+  // Responses from the server are routed to the image downloads
+  coap_register_handlers(&upstream_base);
+  if (!start_server(upstream_base.ctx)) {
+    return 1;
+  }
+  printf("Caching proxy listening on port %d, cache in %s\n", config.port,
+         config.cache_dir);
+
+  while (true) {
+    unsigned int wait = MAX_LOOP_WAIT_MS;
+    for (int i = 0; i < MAX_IMAGES; i++) {
+      image_t *image = &images[i];
+      if (!image->in_use || !image->dl) {
+        continue;
+      }
+      unsigned int timeout = coap_download_poll(image->dl);
+      if (coap_download_is_done(image->dl) ||
+          coap_download_has_failed(image->dl) || image->upstream->failed) {
+        finish_fetch(image);
+        timeout = 1;
+      }
+      if (timeout < wait) {
+        wait = timeout;
+      }
+    }
+    coap_run_once(upstream_base.ctx, wait > 0 ? wait : 1);
+
+    coap_tick_t now;
+    coap_ticks(&now);
+    expire_waiters(now);
+  }
+  return 0;
+}
@@ -1,106 +1,366 @@
 #include "reporting.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 
+#include "image_hash.h"
+
 #define FIRMWARE_VER_ID 1
 #define MODEL_NUMBER_ID 2
 #define SERIAL_NUMBER_ID 3
 #define CLIENT_MANUFACTURER_ID 4
+#define IMAGE_HASH_ID 5
+#define DELTA_SUPPORT_ID 6
 
 #define HOST_ID 1
 #define PORT_ID 2
 #define PATH_ID 3
 #define AVAILABLE_ID 4
+#define PATCH_PATH_ID 5
+#define COMPRESSED_ID 6
+#define NEW_IMAGE_HASH_ID 7
+#define MANIFEST_PATH_ID 8
+#define MIRROR_ID 9
+
+// Every field is an ID byte and a length byte followed by the value
+#define TLV_HEADER_SIZE 2
+#define TLV_MAX_LEN 255
+
+typedef enum {
+  TLV_STRING, // Up to max_len bytes
+  TLV_BYTES,  // Exactly max_len bytes
+  TLV_UINT32, // 4 bytes, big endian
+  TLV_BOOL,   // 1 byte
+  TLV_LIST,   // Repeated string of up to max_len bytes. Only in responses.
+} tlv_type_t;
+
+// Describes one field in a message. The offset is the position of the field
+// in the struct that is encoded or decoded.
+typedef struct {
+  uint8_t id;
+  tlv_type_t type;
+  size_t max_len;
+  size_t offset;
+} tlv_field_t;
+
+// Room for a string in a fixed size array in fota_response_t (with the NUL)
+#define RESP_STRING_LEN(field) (sizeof(((fota_response_t *)0)->field) - 1)
+#define RESP_BYTES_LEN(field) (sizeof(((fota_response_t *)0)->field))
+// A mirror is a host name with a port
+#define MIRROR_LEN (RESP_STRING_LEN(mirrors[0].hostname) + 6)
+
+// Strings in the report are NUL terminated and skipped if NULL. The image hash
+// is skipped if NULL and bools are skipped if false.
+static const tlv_field_t report_schema[] = {
+    {FIRMWARE_VER_ID, TLV_STRING, TLV_MAX_LEN,
+     offsetof(fota_report_t, version)},
+    {CLIENT_MANUFACTURER_ID, TLV_STRING, TLV_MAX_LEN,
+     offsetof(fota_report_t, manufacturer)},
+    {SERIAL_NUMBER_ID, TLV_STRING, TLV_MAX_LEN,
+     offsetof(fota_report_t, serial)},
+    {MODEL_NUMBER_ID, TLV_STRING, TLV_MAX_LEN, offsetof(fota_report_t, model)},
+    {IMAGE_HASH_ID, TLV_BYTES, IMAGE_HASH_SIZE,
+     offsetof(fota_report_t, image_hash)},
+    {DELTA_SUPPORT_ID, TLV_BOOL, 1, offsetof(fota_report_t, delta_support)},
+};
 
-static size_t encode_tlv_string(uint8_t *buf, uint8_t id, const uint8_t *str);
-static bool decode_tlv_string(const uint8_t *buf, size_t *idx, uint8_t *str);
-static int decode_tlv_uint32(const uint8_t *buf, size_t *idx, uint32_t *val);
-static bool decode_tlv_bool(const uint8_t *buf, size_t *idx, bool *val);
-
-bool fota_encode_report(fota_report_t *report, uint8_t *buf, size_t *len) {
-  size_t sz = encode_tlv_string(buf, FIRMWARE_VER_ID, report->version);
-  sz +=
-      encode_tlv_string(buf + sz, CLIENT_MANUFACTURER_ID, report->manufacturer);
-  sz += encode_tlv_string(buf + sz, SERIAL_NUMBER_ID, report->serial);
-  sz += encode_tlv_string(buf + sz, MODEL_NUMBER_ID, report->model);
-  *len = sz;
+// The maximum lengths match the arrays in fota_response_t so a decoded view
+// always fits.
+static const tlv_field_t response_schema[] = {
+    {HOST_ID, TLV_STRING, RESP_STRING_LEN(hostname),
+     offsetof(fota_response_view_t, hostname)},
+    {PORT_ID, TLV_UINT32, 4, offsetof(fota_response_view_t, port)},
+    {PATH_ID, TLV_STRING, RESP_STRING_LEN(path),
+     offsetof(fota_response_view_t, path)},
+    {AVAILABLE_ID, TLV_BOOL, 1,
+     offsetof(fota_response_view_t, has_new_version)},
+    {PATCH_PATH_ID, TLV_STRING, RESP_STRING_LEN(patch_path),
+     offsetof(fota_response_view_t, patch_path)},
+    {COMPRESSED_ID, TLV_BOOL, 1, offsetof(fota_response_view_t, compressed)},
+    {NEW_IMAGE_HASH_ID, TLV_BYTES, RESP_BYTES_LEN(image_hash),
+     offsetof(fota_response_view_t, image_hash)},
+    {MANIFEST_PATH_ID, TLV_STRING, RESP_STRING_LEN(manifest_path),
+     offsetof(fota_response_view_t, manifest_path)},
+    {MIRROR_ID, TLV_LIST, MIRROR_LEN, offsetof(fota_response_view_t, mirrors)},
+};
+
+#define SCHEMA_SIZE(schema) (sizeof(schema) / sizeof(schema[0]))
+
+static bool encode_field(const tlv_field_t *field, const void *msg,
+                         uint8_t *buf, size_t buf_size, size_t *idx);
+static bool decode_field(const tlv_field_t *field, const uint8_t *value,
+                         size_t len, void *msg);
+static void encode_telemetry(telemetry_t *telemetry, uint8_t *buf,
+                             size_t buf_size, size_t *idx);
+static const tlv_field_t *find_field(const tlv_field_t *schema, size_t count,
+                                     uint8_t id);
+static bool copy_string(uint8_t *dst, size_t dst_size, tlv_view_t view);
+static bool parse_mirror(tlv_view_t view, uint32_t default_port,
+                         fota_mirror_t *mirror);
+
+bool fota_encode_report(const fota_report_t *report, uint8_t *buf,
+                        size_t buf_size, size_t *len) {
+  size_t idx = 0;
+  for (size_t i = 0; i < SCHEMA_SIZE(report_schema); i++) {
+    if (!encode_field(&report_schema[i], report, buf, buf_size, &idx)) {
+      return false;
+    }
+  }
+  if (report->telemetry) {
+    encode_telemetry(report->telemetry, buf, buf_size, &idx);
+  }
+  *len = idx;
   return true;
 }
 
-static size_t encode_tlv_string(uint8_t *buf, uint8_t id, const uint8_t *str) {
-  size_t ret = 0;
-  buf[ret++] = id;
-  buf[ret++] = strlen((const char *)str);
-  for (uint8_t i = 0; i < strlen((const char *)str); i++) {
-    buf[ret++] = str[i];
+// Records that don't fit are sent with the next report
+static void encode_telemetry(telemetry_t *telemetry, uint8_t *buf,
+                             size_t buf_size, size_t *idx) {
+  size_t n = 0;
+  while (n < telemetry->count) {
+    const telemetry_record_t *record = &telemetry->records[n];
+    if (buf_size - *idx < TLV_HEADER_SIZE + record->len) {
+      break;
+    }
+    buf[(*idx)++] = record->type;
+    buf[(*idx)++] = record->len;
+    memcpy(buf + *idx, record->value, record->len);
+    *idx += record->len;
+    n++;
+  }
+  telemetry->in_flight = n;
+}
+
+static bool encode_field(const tlv_field_t *field, const void *msg,
+                         uint8_t *buf, size_t buf_size, size_t *idx) {
+  const uint8_t *value = NULL;
+  size_t len = 0;
+  uint8_t scratch[4];
+  const void *member = (const uint8_t *)msg + field->offset;
+
+  switch (field->type) {
+  case TLV_STRING:
+    value = *(const uint8_t *const *)member;
+    if (!value) {
+      return true;
+    }
+    // One extra byte to tell a string that is too long from one that fits
+    len = strnlen((const char *)value, field->max_len + 1);
+    break;
+  case TLV_BYTES:
+    value = *(const uint8_t *const *)member;
+    if (!value) {
+      return true;
+    }
+    len = field->max_len;
+    break;
+  case TLV_UINT32: {
+    uint32_t v = *(const uint32_t *)member;
+    scratch[0] = v >> 24;
+    scratch[1] = v >> 16;
+    scratch[2] = v >> 8;
+    scratch[3] = v;
+    value = scratch;
+    len = 4;
+    break;
+  }
+  case TLV_BOOL:
+    if (!*(const bool *)member) {
+      return true;
+    }
+    scratch[0] = 1;
+    value = scratch;
+    len = 1;
+    break;
+  case TLV_LIST:
+    return false;
+  }
+  if (len > field->max_len) {
+    return false;
   }
-  return ret;
+  if (buf_size - *idx < TLV_HEADER_SIZE + len) {
+    return false;
+  }
+  buf[(*idx)++] = field->id;
+  buf[(*idx)++] = len;
+  memcpy(buf + *idx, value, len);
+  *idx += len;
+  return true;
 }
 
-bool fota_decode_response(uint8_t *buf, size_t len, fota_response_t *resp) {
+bool fota_decode_response_view(const uint8_t *buf, size_t len,
+                               fota_response_view_t *view) {
+  memset(view, 0, sizeof(*view));
   size_t idx = 0;
   while (idx < len) {
+    if (len - idx < TLV_HEADER_SIZE) {
+      return false;
+    }
     uint8_t id = buf[idx++];
-    switch (id) {
-    case HOST_ID:
-      if (!decode_tlv_string(buf, &idx, resp->hostname)) {
-        return false;
-      }
-      break;
-    case PORT_ID:
-      if (!decode_tlv_uint32(buf, &idx, &resp->port)) {
-        return false;
-      }
-      break;
-    case PATH_ID:
-      if (!decode_tlv_string(buf, &idx, resp->path)) {
-        return false;
-      }
-      break;
-    case AVAILABLE_ID:
-      if (!decode_tlv_bool(buf, &idx, &resp->has_new_version)) {
-        return false;
-      }
-      break;
-    default:
+    size_t field_len = buf[idx++];
+    if (field_len > len - idx) {
+      return false;
+    }
+    const tlv_field_t *field =
+        find_field(response_schema, SCHEMA_SIZE(response_schema), id);
+    if (!field) {
       // Unknown ID in response. Return with error
       return false;
     }
+    if (!decode_field(field, buf + idx, field_len, view)) {
+      return false;
+    }
+    idx += field_len;
   }
   return true;
 }
 
-static bool decode_tlv_string(const uint8_t *buf, size_t *idx, uint8_t *str) {
-  int len = (int)buf[(*idx)++];
-  int i = 0;
-  for (i = 0; i < len; i++) {
-    str[i] = buf[(*idx)++];
+static const tlv_field_t *find_field(const tlv_field_t *schema, size_t count,
+                                     uint8_t id) {
+  for (size_t i = 0; i < count; i++) {
+    if (schema[i].id == id) {
+      return &schema[i];
+    }
+  }
+  return NULL;
+}
+
+static bool decode_field(const tlv_field_t *field, const uint8_t *value,
+                         size_t len, void *msg) {
+  void *member = (uint8_t *)msg + field->offset;
+  switch (field->type) {
+  case TLV_STRING:
+    if (len > field->max_len) {
+      return false;
+    }
+    break;
+  case TLV_BYTES:
+    if (len != field->max_len) {
+      return false;
+    }
+    break;
+  case TLV_UINT32:
+    if (len != 4) {
+      // uint32 should be 4 bytes
+      return false;
+    }
+    *(uint32_t *)member = ((uint32_t)value[0] << 24) |
+                          ((uint32_t)value[1] << 16) |
+                          ((uint32_t)value[2] << 8) | value[3];
+    return true;
+  case TLV_BOOL:
+    if (len != 1) {
+      // Should be 1 byte long
+      return false;
+    }
+    *(bool *)member = value[0] == 1;
+    return true;
+  case TLV_LIST: {
+    if (len > field->max_len) {
+      return false;
+    }
+    tlv_list_t *list = member;
+    if (list->count < FOTA_MAX_MIRRORS) {
+      list->items[list->count].data = value;
+      list->items[list->count].len = len;
+      list->count++;
+    }
+    return true;
   }
-  str[i] = 0;
+  }
+  tlv_view_t *view = member;
+  view->data = value;
+  view->len = len;
   return true;
 }
 
-static int decode_tlv_uint32(const uint8_t *buf, size_t *idx, uint32_t *val) {
-  size_t len = (size_t)buf[(*idx)++];
-  if (len != 4) {
-    // uint32 should be 4 bytes
+bool fota_decode_response(const uint8_t *buf, size_t len,
+                          fota_response_t *resp) {
+  fota_response_view_t view;
+  if (!fota_decode_response_view(buf, len, &view)) {
     return false;
   }
-  *val = 0;
-  *val += (buf[(*idx)++] << 24);
-  *val += (buf[(*idx)++] << 16);
-  *val += (buf[(*idx)++] << 8);
-  *val += (buf[(*idx)++]);
+  memset(resp, 0, sizeof(*resp));
+  resp->has_new_version = view.has_new_version;
+  resp->port = view.port;
+  resp->compressed = view.compressed;
+  // The schema limits the lengths so these always fit
+  copy_string(resp->hostname, sizeof(resp->hostname), view.hostname);
+  copy_string(resp->path, sizeof(resp->path), view.path);
+  resp->has_patch =
+      copy_string(resp->patch_path, sizeof(resp->patch_path), view.patch_path);
+  resp->has_manifest = copy_string(
+      resp->manifest_path, sizeof(resp->manifest_path), view.manifest_path);
+  if (view.image_hash.len == sizeof(resp->image_hash)) {
+    memcpy(resp->image_hash, view.image_hash.data, view.image_hash.len);
+    resp->has_image_hash = true;
+  }
+  for (size_t i = 0; i < view.mirrors.count; i++) {
+    fota_mirror_t *mirror = &resp->mirrors[resp->mirror_count];
+    if (parse_mirror(view.mirrors.items[i], resp->port, mirror)) {
+      resp->mirror_count++;
+    }
+  }
   return true;
 }
 
-static bool decode_tlv_bool(const uint8_t *buf, size_t *idx, bool *val) {
-  size_t len = (size_t)buf[(*idx)++];
-  if (len != 1) {
-    // Should be 1 byte long
-    return false;
+// Split "host:port" into the host and port. IPv6 addresses with a port are in
+// brackets ("[::1]:5684"). Without a port the mirror uses the port in the
+// response.
+static bool parse_mirror(tlv_view_t view, uint32_t default_port,
+                         fota_mirror_t *mirror) {
+  const uint8_t *end = view.data + view.len;
+  const uint8_t *host = view.data;
+  const uint8_t *host_end = end;
+  const uint8_t *port = NULL;
+  if (view.len > 0 && host[0] == '[') {
+    host_end = memchr(host, ']', view.len);
+    if (!host_end) {
+      return false;
+    }
+    host++;
+    if (host_end + 1 < end) {
+      if (host_end[1] != ':') {
+        return false;
+      }
+      port = host_end + 2;
+    }
+  } else {
+    const uint8_t *colon = memchr(host, ':', view.len);
+    // More than one colon is an IPv6 address without a port
+    if (colon && !memchr(colon + 1, ':', end - colon - 1)) {
+      host_end = colon;
+      port = colon + 1;
+    }
   }
 
-  *val = (buf[(*idx)++] == 1);
-  return true;
+  mirror->port = default_port;
+  if (port) {
+    uint32_t value = 0;
+    for (const uint8_t *p = port; p < end; p++) {
+      if (*p < '0' || *p > '9' || value > 65535) {
+        return false;
+      }
+      value = value * 10 + (*p - '0');
+    }
+    if (value == 0 || value > 65535) {
+      return false;
+    }
+    mirror->port = value;
+  }
+  tlv_view_t host_view = {host, host_end - host};
+  return host_view.len < sizeof(mirror->hostname) &&
+         copy_string(mirror->hostname, sizeof(mirror->hostname), host_view);
+}
+
+// Copy a string field and NUL terminate it. Returns true if the string isn't
+// empty.
+static bool copy_string(uint8_t *dst, size_t dst_size, tlv_view_t view) {
+  size_t len = view.len < dst_size ? view.len : dst_size - 1;
+  // A field that isn't in the response has no data pointer
+  if (len > 0) {
+    memcpy(dst, view.data, len);
+  }
+  dst[len] = 0;
+  return len > 0;
 }
@@ -4,6 +4,13 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "telemetry.h"
+
+/**
+ * Maximum number of mirrors in a response. Mirrors past this are ignored.
+ */
+#define FOTA_MAX_MIRRORS 4
+
 /**
  * This is the FOTA report sent to the server;
  */
@@ -12,8 +19,20 @@ typedef struct {
   uint8_t *manufacturer;
   uint8_t *serial;
   uint8_t *model;
+  uint8_t *image_hash; // SHA-256 of the running image. Can be NULL.
+  bool delta_support;  // The client can apply patches
+  telemetry_t *telemetry; // Records sent with the report. Can be NULL.
 } fota_report_t;
 
+/**
+ * A host that serves the same image, patch and manifest paths as the host in
+ * the response.
+ */
+typedef struct {
+  uint8_t hostname[32];
+  uint32_t port;
+} fota_mirror_t;
+
 /**
  * FOTA report response.
  */
@@ -22,14 +41,67 @@ typedef struct {
   uint8_t hostname[32];
   uint8_t path[10];
   uint32_t port;
+  bool has_patch;         // A patch from the reported image is available
+  uint8_t patch_path[32]; // Path of the patch on the same host and port
+  bool compressed;        // The image and patch are zlib streams
+  bool has_image_hash;
+  uint8_t image_hash[32]; // SHA-256 of the new image
+  bool has_manifest;
+  uint8_t manifest_path[32]; // Path of the per-block hash manifest
+  fota_mirror_t mirrors[FOTA_MAX_MIRRORS];
+  size_t mirror_count;
 } fota_response_t;
 
 /**
- * Encode a report. This returns a negative value on error.
+ * A field in a decoded message. This points into the message buffer.
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t len;
+} tlv_view_t;
+
+/**
+ * A field that can be repeated in a message.
+ */
+typedef struct {
+  tlv_view_t items[FOTA_MAX_MIRRORS];
+  size_t count;
+} tlv_list_t;
+
+/**
+ * A decoded response that points into the response payload. Strings are not
+ * NUL terminated. Fields that aren't in the response have a length of 0.
+ */
+typedef struct {
+  bool has_new_version;
+  tlv_view_t hostname;
+  tlv_view_t path;
+  uint32_t port;
+  tlv_view_t patch_path;
+  bool compressed;
+  tlv_view_t image_hash;
+  tlv_view_t manifest_path;
+  tlv_list_t mirrors; // "host:port" or "host" for the same port
+} fota_response_view_t;
+
+/**
+ * Encode a report into a buffer of buf_size bytes. This returns false if a
+ * field is too long or the report doesn't fit in the buffer. Telemetry records
+ * are added after the fields as long as they fit and the records that were
+ * added are marked as in flight.
+ */
+bool fota_encode_report(const fota_report_t *report, uint8_t *buf,
+                        size_t buf_size, size_t *len);
+
+/**
+ * Decode a response without copying. The view is only valid as long as the
+ * buffer is. Returns false if the response is malformed.
  */
-bool fota_encode_report(fota_report_t *report, uint8_t *buf, size_t *len);
+bool fota_decode_response_view(const uint8_t *buf, size_t len,
+                               fota_response_view_t *view);
 
 /**
- * Decode a response.
+ * Decode a response into a response struct.
  */
-bool fota_decode_response(uint8_t *buf, size_t len, fota_response_t *resp);
+bool fota_decode_response(const uint8_t *buf, size_t len,
+                          fota_response_t *resp);
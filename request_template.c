@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "coap_util.h"
+#include "request_template.h"
+
+// The last bytes of the token count the requests in a download
+#define TOKEN_SEQ_SIZE 4
+// Largest encoded option header (with extended delta and length)
+#define MAX_OPTION_HEADER 5
+
+static bool add_option(request_template_t *request, uint16_t number,
+                       const uint8_t *value, size_t len) {
+  if (request->count == REQUEST_TEMPLATE_MAX_OPTIONS) {
+    return false;
+  }
+  request->options[request->count++] =
+      (template_option_t){number, len, value};
+  request->pdu_size += MAX_OPTION_HEADER + len;
+  return true;
+}
+
+bool request_template_init(request_template_t *request, const char *path,
+                           const char *proxy_uri) {
+  memset(request, 0, sizeof(*request));
+  // Token, Block2 option and the template options
+  request->pdu_size = REQUEST_TEMPLATE_TOKEN_SIZE + MAX_OPTION_HEADER + 3;
+  random_token(request->token, REQUEST_TEMPLATE_TOKEN_SIZE - TOKEN_SEQ_SIZE);
+
+  if (proxy_uri) {
+    size_t len = strlen(proxy_uri);
+    if (len > sizeof(request->values)) {
+      printf("Proxy URI %s is too long\n", proxy_uri);
+      return false;
+    }
+    memcpy(request->values, proxy_uri, len);
+    return add_option(request, COAP_OPTION_PROXY_URI, request->values, len);
+  }
+
+  size_t buf_len = sizeof(request->values);
+  int res = coap_split_path((const uint8_t *)path, strlen(path),
+                            request->values, &buf_len);
+  if (res < 0) {
+    printf("Error parsing path %s\n", path);
+    return false;
+  }
+  const uint8_t *opt = request->values;
+  while (res--) {
+    size_t len = coap_opt_length(opt);
+    if (len > 0 &&
+        !add_option(request, COAP_OPTION_URI_PATH, coap_opt_value(opt), len)) {
+      printf("Path %s has too many segments\n", path);
+      return false;
+    }
+    opt += coap_opt_size(opt);
+  }
+  return true;
+}
+
+void request_template_next_token(request_template_t *request, uint8_t *token) {
+  uint32_t seq = ++request->token_seq;
+  for (int i = REQUEST_TEMPLATE_TOKEN_SIZE - 1;
+       i >= REQUEST_TEMPLATE_TOKEN_SIZE - TOKEN_SEQ_SIZE; i--) {
+    request->token[i] = seq & 0xff;
+    seq >>= 8;
+  }
+  memcpy(token, request->token, REQUEST_TEMPLATE_TOKEN_SIZE);
+}
+
+void request_template_apply(const request_template_t *request,
+                            coap_pdu_t *pdu, const uint8_t *token,
+                            unsigned int block_num, unsigned int szx) {
+  coap_add_token(pdu, REQUEST_TEMPLATE_TOKEN_SIZE, token);
+
+  uint8_t buf[4];
+  size_t buflen =
+      coap_encode_var_safe(buf, sizeof(buf), (block_num << 4) | szx);
+
+  // Options go in in order. The Block2 option sits between the path and a
+  // Proxy-Uri.
+  bool block_added = false;
+  for (size_t i = 0; i < request->count; i++) {
+    const template_option_t *option = &request->options[i];
+    if (!block_added && option->number > COAP_OPTION_BLOCK2) {
+      coap_add_option(pdu, COAP_OPTION_BLOCK2, buflen, buf);
+      block_added = true;
+    }
+    coap_add_option(pdu, option->number, option->len, option->value);
+  }
+  if (!block_added) {
+    coap_add_option(pdu, COAP_OPTION_BLOCK2, buflen, buf);
+  }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <coap2/coap.h>
+
+/**
+ * Size of the tokens in block requests
+ */
+#define REQUEST_TEMPLATE_TOKEN_SIZE 8
+
+/**
+ * Limits for the options in a template (path segments or the Proxy-Uri)
+ */
+#define REQUEST_TEMPLATE_MAX_OPTIONS 8
+#define REQUEST_TEMPLATE_MAX_VALUES 256
+
+typedef struct {
+  uint16_t number;
+  uint16_t len;
+  const uint8_t *value;
+} template_option_t;
+
+/**
+ * The parts of a block request that are the same for every block. The
+ * options are split once when the download starts and each request is
+ * allocated at a size that holds the template so libcoap never grows it.
+ * Only the message ID, token and Block2 option change between requests. The
+ * options point into the template so it can't be copied.
+ */
+typedef struct {
+  template_option_t options[REQUEST_TEMPLATE_MAX_OPTIONS];
+  size_t count;
+  uint8_t values[REQUEST_TEMPLATE_MAX_VALUES];
+  size_t pdu_size; // Size to allocate requests at
+  uint8_t token[REQUEST_TEMPLATE_TOKEN_SIZE]; // Random prefix followed by a
+                                              // request counter
+  uint32_t token_seq;
+} request_template_t;
+
+/**
+ * Build the template for requests to the path. With a Proxy-Uri the request
+ * carries the URI instead of the path. Returns false if the path or URI
+ * doesn't fit in the template.
+ */
+bool request_template_init(request_template_t *request, const char *path,
+                           const char *proxy_uri);
+
+/**
+ * Get the next token. Tokens don't repeat within a template.
+ */
+void request_template_next_token(request_template_t *request, uint8_t *token);
+
+/**
+ * Add the token, the template options and the Block2 option to a request
+ * allocated at the template's PDU size. This doesn't allocate anything.
+ */
+void request_template_apply(const request_template_t *request,
+                            coap_pdu_t *pdu, const uint8_t *token,
+                            unsigned int block_num, unsigned int szx);
@@ -1,11 +1,47 @@
 #include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <resolv.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "resolve.h"
 
+// Number of hosts kept in memory
+#define CACHE_SIZE 8
+// Longest wait for a host that isn't cached
+#define RESOLVE_TIMEOUT_SECONDS 10
+// TTL limits. Addresses that come from somewhere other than DNS (such as
+// /etc/hosts) get the default TTL.
+#define MIN_TTL_SECONDS 30
+#define MAX_TTL_SECONDS 86400
+#define DEFAULT_TTL_SECONDS 300
+#define MAX_ANSWER_SIZE 2048
+
+typedef struct {
+  bool in_use;
+  char host[RESOLVE_MAX_HOST];
+  resolve_result_t result; // Without ports
+  time_t expires;
+  bool valid;
+  bool pending; // A lookup is running
+  int preferred_family;
+} cache_entry_t;
+
+static const char *cache_dir;
+static cache_entry_t cache[CACHE_SIZE];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+
+static void load_entry(cache_entry_t *entry);
+static void save_entry(const cache_entry_t *entry);
+
 bool resolve_address(const char *addrstr, struct sockaddr *dst) {
   struct addrinfo *info;
   struct addrinfo hints;
@@ -14,11 +50,337 @@ bool resolve_address(const char *addrstr, struct sockaddr *dst) {
   hints.ai_socktype = SOCK_DGRAM;
   hints.ai_family = AF_UNSPEC;
 
-  if (getaddrinfo(addrstr, NULL, &hints, &info) < 0) {
-    printf("Could not look up hostname %s\n", addrstr);
+  int err = getaddrinfo(addrstr, NULL, &hints, &info);
+  if (err != 0) {
+    printf("Could not look up hostname %s: %s\n", addrstr, gai_strerror(err));
     return false;
   }
   memcpy(dst, info->ai_addr, info->ai_addrlen);
   freeaddrinfo(info);
   return true;
-}
\ No newline at end of file
+}
+
+void resolve_set_cache_dir(const char *dir) { cache_dir = dir; }
+
+void resolve_set_port(struct sockaddr *addr, int port) {
+  if (addr->sa_family == AF_INET6) {
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+  } else {
+    ((struct sockaddr_in *)addr)->sin_port = htons(port);
+  }
+}
+
+socklen_t resolve_address_len(const struct sockaddr *addr) {
+  return addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                     : sizeof(struct sockaddr_in);
+}
+
+static void add_address(resolve_result_t *result, int family,
+                        const void *addr) {
+  size_t same_family = 0;
+  for (size_t i = 0; i < result->count; i++) {
+    if (result->addrs[i].ss_family == family) {
+      same_family++;
+    }
+  }
+  if (result->count == RESOLVE_MAX_ADDRESSES ||
+      same_family == RESOLVE_MAX_PER_FAMILY) {
+    return;
+  }
+  struct sockaddr_storage *dst = &result->addrs[result->count++];
+  memset(dst, 0, sizeof(*dst));
+  dst->ss_family = family;
+  if (family == AF_INET6) {
+    memcpy(&((struct sockaddr_in6 *)dst)->sin6_addr, addr,
+           sizeof(struct in6_addr));
+  } else {
+    memcpy(&((struct sockaddr_in *)dst)->sin_addr, addr,
+           sizeof(struct in_addr));
+  }
+}
+
+// IP address literals don't need a lookup
+static bool parse_literal(const char *host, resolve_result_t *result) {
+  uint8_t addr[sizeof(struct in6_addr)];
+  if (inet_pton(AF_INET6, host, addr) == 1) {
+    add_address(result, AF_INET6, addr);
+    return true;
+  }
+  if (inet_pton(AF_INET, host, addr) == 1) {
+    add_address(result, AF_INET, addr);
+    return true;
+  }
+  return false;
+}
+
+// Put the addresses of the family first. The order within each family is
+// kept.
+static void order_addresses(resolve_result_t *result, int family) {
+  resolve_result_t ordered = {.count = 0};
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < result->count; i++) {
+      if ((result->addrs[i].ss_family == family) == (pass == 0)) {
+        ordered.addrs[ordered.count++] = result->addrs[i];
+      }
+    }
+  }
+  *result = ordered;
+}
+
+// Query DNS for records of the type. The TTL is lowered to the smallest TTL
+// of the records.
+static void query_records(res_state res, const char *host, int type,
+                          resolve_result_t *result, uint32_t *ttl) {
+  uint8_t answer[MAX_ANSWER_SIZE];
+  int len = res_nsearch(res, host, ns_c_in, type, answer, sizeof(answer));
+  if (len < 0) {
+    return;
+  }
+  ns_msg msg;
+  if (ns_initparse(answer, len, &msg) < 0) {
+    return;
+  }
+  int family = type == ns_t_aaaa ? AF_INET6 : AF_INET;
+  size_t addr_len =
+      type == ns_t_aaaa ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+  for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+    ns_rr rr;
+    if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+      return;
+    }
+    // CNAME records are followed by the resolver
+    if (ns_rr_type(rr) != type || ns_rr_rdlen(rr) != addr_len) {
+      continue;
+    }
+    add_address(result, family, ns_rr_rdata(rr));
+    if (ns_rr_ttl(rr) < *ttl) {
+      *ttl = ns_rr_ttl(rr);
+    }
+  }
+}
+
+// Names that DNS doesn't know (such as localhost) are looked up with
+// getaddrinfo
+static void query_system(const char *host, resolve_result_t *result) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_family = AF_UNSPEC;
+  struct addrinfo *info;
+  if (getaddrinfo(host, NULL, &hints, &info) != 0) {
+    return;
+  }
+  for (struct addrinfo *ai = info; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET6) {
+      add_address(result, AF_INET6,
+                  &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr);
+    } else if (ai->ai_family == AF_INET) {
+      add_address(result, AF_INET,
+                  &((struct sockaddr_in *)ai->ai_addr)->sin_addr);
+    }
+  }
+  freeaddrinfo(info);
+}
+
+// Runs on its own thread so the caller can go on with a cached address or
+// give up waiting
+static void *lookup_thread(void *arg) {
+  cache_entry_t *entry = arg;
+  char host[RESOLVE_MAX_HOST];
+  pthread_mutex_lock(&cache_lock);
+  strcpy(host, entry->host);
+  pthread_mutex_unlock(&cache_lock);
+
+  resolve_result_t result = {.count = 0};
+  uint32_t ttl = MAX_TTL_SECONDS;
+  struct __res_state res;
+  memset(&res, 0, sizeof(res));
+  if (res_ninit(&res) == 0) {
+    query_records(&res, host, ns_t_aaaa, &result, &ttl);
+    query_records(&res, host, ns_t_a, &result, &ttl);
+    res_nclose(&res);
+  }
+  if (result.count == 0) {
+    ttl = DEFAULT_TTL_SECONDS;
+    query_system(host, &result);
+  }
+  if (ttl < MIN_TTL_SECONDS) {
+    ttl = MIN_TTL_SECONDS;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  entry->pending = false;
+  if (result.count > 0) {
+    if (entry->preferred_family != AF_UNSPEC) {
+      order_addresses(&result, entry->preferred_family);
+    }
+    entry->result = result;
+    entry->expires = time(NULL) + ttl;
+    entry->valid = true;
+    save_entry(entry);
+  }
+  pthread_cond_broadcast(&cache_cond);
+  pthread_mutex_unlock(&cache_lock);
+  return NULL;
+}
+
+// Find the entry for a host. A new entry replaces the one that expires first
+// and is loaded from the disk cache.
+static cache_entry_t *find_entry(const char *host) {
+  cache_entry_t *free_entry = NULL;
+  for (int i = 0; i < CACHE_SIZE; i++) {
+    cache_entry_t *entry = &cache[i];
+    if (entry->in_use && strcmp(entry->host, host) == 0) {
+      return entry;
+    }
+    if (!entry->pending &&
+        (!free_entry || !entry->in_use ||
+         (free_entry->in_use && entry->expires < free_entry->expires))) {
+      free_entry = entry;
+    }
+  }
+  if (!free_entry) {
+    return NULL;
+  }
+  memset(free_entry, 0, sizeof(*free_entry));
+  free_entry->in_use = true;
+  free_entry->preferred_family = AF_UNSPEC;
+  strcpy(free_entry->host, host);
+  load_entry(free_entry);
+  return free_entry;
+}
+
+static bool start_lookup(cache_entry_t *entry) {
+  if (entry->pending) {
+    return true;
+  }
+  pthread_t thread;
+  entry->pending = true;
+  if (pthread_create(&thread, NULL, lookup_thread, entry) != 0) {
+    printf("Could not start lookup of %s\n", entry->host);
+    entry->pending = false;
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+bool resolve_host(const char *host, int port, resolve_result_t *result) {
+  memset(result, 0, sizeof(*result));
+  if (!parse_literal(host, result)) {
+    if (strlen(host) >= RESOLVE_MAX_HOST) {
+      printf("Hostname %s is too long\n", host);
+      return false;
+    }
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *entry = find_entry(host);
+    if (!entry) {
+      pthread_mutex_unlock(&cache_lock);
+      printf("Too many lookups running\n");
+      return false;
+    }
+    if (!entry->valid || entry->expires <= time(NULL)) {
+      bool started = start_lookup(entry);
+      if (!entry->valid && started) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += RESOLVE_TIMEOUT_SECONDS;
+        while (entry->pending &&
+               pthread_cond_timedwait(&cache_cond, &cache_lock, &deadline) !=
+                   ETIMEDOUT) {
+        }
+      }
+    }
+    if (entry->valid) {
+      *result = entry->result;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (result->count == 0) {
+      printf("Could not look up hostname %s\n", host);
+      return false;
+    }
+  }
+  for (size_t i = 0; i < result->count; i++) {
+    resolve_set_port((struct sockaddr *)&result->addrs[i], port);
+  }
+  return true;
+}
+
+void resolve_prefer(const char *host, const struct sockaddr *addr) {
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < CACHE_SIZE; i++) {
+    cache_entry_t *entry = &cache[i];
+    if (entry->in_use && strcmp(entry->host, host) == 0 &&
+        entry->preferred_family != addr->sa_family) {
+      entry->preferred_family = addr->sa_family;
+      order_addresses(&entry->result, addr->sa_family);
+      save_entry(entry);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_file(const cache_entry_t *entry, char *file, size_t len) {
+  snprintf(file, len, "%s/%s.dns", cache_dir, entry->host);
+}
+
+// The cache file has the expiry time followed by one address per line in the
+// order they are tried.
+static void load_entry(cache_entry_t *entry) {
+  if (!cache_dir) {
+    return;
+  }
+  char file[256];
+  cache_file(entry, file, sizeof(file));
+  FILE *fp = fopen(file, "r");
+  if (!fp) {
+    return;
+  }
+  long long expires;
+  char line[INET6_ADDRSTRLEN + 2];
+  if (fscanf(fp, "%lld\n", &expires) == 1) {
+    while (fgets(line, sizeof(line), fp)) {
+      line[strcspn(line, "\n")] = 0;
+      parse_literal(line, &entry->result);
+    }
+  }
+  fclose(fp);
+  if (entry->result.count > 0) {
+    entry->expires = expires;
+    entry->valid = true;
+    entry->preferred_family = entry->result.addrs[0].ss_family;
+  }
+}
+
+static void save_entry(const cache_entry_t *entry) {
+  if (!cache_dir) {
+    return;
+  }
+  char file[256];
+  char tmp[260];
+  cache_file(entry, file, sizeof(file));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    return;
+  }
+  fprintf(fp, "%lld\n", (long long)entry->expires);
+  for (size_t i = 0; i < entry->result.count; i++) {
+    const struct sockaddr_storage *addr = &entry->result.addrs[i];
+    const void *src =
+        addr->ss_family == AF_INET6
+            ? (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr
+            : (const void *)&((const struct sockaddr_in *)addr)->sin_addr;
+    char str[INET6_ADDRSTRLEN];
+    if (inet_ntop(addr->ss_family, src, str, sizeof(str))) {
+      fprintf(fp, "%s\n", str);
+    }
+  }
+  // Write to a temporary file and rename so a reader never sees a partial
+  // entry
+  if (fclose(fp) == 0) {
+    rename(tmp, file);
+  } else {
+    unlink(tmp);
+  }
+}
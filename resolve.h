@@ -1,8 +1,65 @@
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/socket.h>
 
+/**
+ * Maximum number of addresses kept for a host
+ */
+#define RESOLVE_MAX_ADDRESSES 4
+
+/**
+ * Maximum number of addresses kept for each family so a host with many IPv6
+ * addresses still has IPv4 addresses to race against them
+ */
+#define RESOLVE_MAX_PER_FAMILY (RESOLVE_MAX_ADDRESSES / 2)
+
+/**
+ * Longest host name that is cached
+ */
+#define RESOLVE_MAX_HOST 64
+
+/**
+ * Addresses for a host in the order they should be tried
+ */
+typedef struct {
+  struct sockaddr_storage addrs[RESOLVE_MAX_ADDRESSES];
+  size_t count;
+} resolve_result_t;
+
 /**
  * Resolve a string with an IP adress or DNS name into a socket address
  */
 bool resolve_address(const char *addrstr, struct sockaddr *dst);
+
+/**
+ * Look up the addresses for a host and set the port on them. Addresses are
+ * cached for the TTL of the DNS records. An expired address is returned right
+ * away while it is looked up again in the background. Hosts that aren't in
+ * the cache are looked up in the background and waited for with a timeout.
+ * Both IPv6 and IPv4 addresses are returned with the family that connected
+ * last (see resolve_prefer) first and IPv6 first if none has.
+ */
+bool resolve_host(const char *host, int port, resolve_result_t *result);
+
+/**
+ * Remember that the address family of the address connected to the host. The
+ * family is tried first the next time.
+ */
+void resolve_prefer(const char *host, const struct sockaddr *addr);
+
+/**
+ * Set the directory where resolved addresses are cached between runs. Set to
+ * NULL to keep the cache in memory only.
+ */
+void resolve_set_cache_dir(const char *dir);
+
+/**
+ * Set the port of an IPv4 or IPv6 address
+ */
+void resolve_set_port(struct sockaddr *addr, int port);
+
+/**
+ * Size of an IPv4 or IPv6 address
+ */
+socklen_t resolve_address_len(const struct sockaddr *addr);
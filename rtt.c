@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "rtt.h"
+
+// Total time spent on a confirmable exchange with the default timers
+// (ACK_TIMEOUT 2 s and MAX_RETRANSMIT 4 with doubling)
+#define RTT_TRANSMIT_SPAN_MS 62000
+#define RTT_MIN_RETRANSMIT 1
+#define RTT_MAX_RETRANSMIT 8
+// Variance multipliers for the strong and weak estimates
+#define STRONG_K 4
+#define WEAK_K 1
+
+void rtt_init(rtt_estimator_t *rtt) {
+  memset(rtt, 0, sizeof(*rtt));
+  rtt->rto_ms = RTT_INITIAL_RTO_MS;
+}
+
+static uint32_t clamp_rto(uint32_t rto) {
+  if (rto < RTT_MIN_RTO_MS) {
+    return RTT_MIN_RTO_MS;
+  }
+  if (rto > RTT_MAX_RTO_MS) {
+    return RTT_MAX_RTO_MS;
+  }
+  return rto;
+}
+
+// Smoothed RTT and variance as in RFC 6298
+static void update_estimate(rtt_estimate_t *est, uint32_t rtt_ms, uint32_t k) {
+  if (est->samples++ == 0) {
+    est->srtt_ms = rtt_ms;
+    est->rttvar_ms = rtt_ms / 2;
+  } else {
+    uint32_t diff =
+        est->srtt_ms > rtt_ms ? est->srtt_ms - rtt_ms : rtt_ms - est->srtt_ms;
+    est->rttvar_ms = (3 * est->rttvar_ms + diff) / 4;
+    est->srtt_ms = (7 * est->srtt_ms + rtt_ms) / 8;
+  }
+  est->rto_ms = clamp_rto(est->srtt_ms + k * est->rttvar_ms);
+}
+
+void rtt_update(rtt_estimator_t *rtt, uint32_t rtt_ms, int retransmits) {
+  if (retransmits > RTT_MAX_WEAK_RETRANSMITS) {
+    // Too ambiguous to say anything about the RTT
+    return;
+  }
+  rtt->last_rtt_ms = rtt_ms;
+  if (retransmits == 0) {
+    update_estimate(&rtt->strong, rtt_ms, STRONG_K);
+    rtt->rto_ms = clamp_rto((rtt->strong.rto_ms + rtt->rto_ms) / 2);
+  } else {
+    // Weak samples move the timeout less
+    update_estimate(&rtt->weak, rtt_ms, WEAK_K);
+    rtt->rto_ms = clamp_rto((rtt->weak.rto_ms + 3 * rtt->rto_ms) / 4);
+  }
+}
+
+uint32_t rtt_backoff_eighths(const rtt_estimator_t *rtt) {
+  if (rtt->rto_ms < 1000) {
+    return 24;
+  }
+  if (rtt->rto_ms > 3000) {
+    return 12;
+  }
+  return 16;
+}
+
+uint32_t rtt_timeout_ms(const rtt_estimator_t *rtt, int retransmits) {
+  uint32_t backoff = rtt_backoff_eighths(rtt);
+  uint64_t timeout = rtt->rto_ms;
+  for (int i = 0; i < retransmits && timeout < RTT_MAX_RTO_MS; i++) {
+    timeout = timeout * backoff / 8;
+  }
+  return timeout < RTT_MAX_RTO_MS ? timeout : RTT_MAX_RTO_MS;
+}
+
+unsigned int rtt_max_retransmit(const rtt_estimator_t *rtt) {
+  // libcoap doubles the timeout for every retransmission
+  unsigned int n = RTT_MIN_RETRANSMIT;
+  while (n < RTT_MAX_RETRANSMIT &&
+         (uint64_t)rtt->rto_ms * ((2u << (n + 1)) - 1) <= RTT_TRANSMIT_SPAN_MS) {
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Retransmission timeout used before the first RTT sample (RFC 7252 ACK_TIMEOUT)
+ */
+#define RTT_INITIAL_RTO_MS 2000
+
+/**
+ * Limits for the retransmission timeout
+ */
+#define RTT_MIN_RTO_MS 100
+#define RTT_MAX_RTO_MS 32000
+
+/**
+ * Samples from exchanges that were retransmitted more than this are ignored
+ */
+#define RTT_MAX_WEAK_RETRANSMITS 2
+
+/**
+ * Smoothed RTT and variance for one kind of sample
+ */
+typedef struct {
+  uint32_t srtt_ms;
+  uint32_t rttvar_ms;
+  uint32_t rto_ms;
+  uint32_t samples;
+} rtt_estimate_t;
+
+/**
+ * RTT estimator for a session (CoCoA, draft-ietf-core-cocoa). Exchanges
+ * without retransmissions give strong samples. Exchanges that were
+ * retransmitted give weak samples measured from the first transmission since
+ * it isn't known which transmission the response belongs to. Both estimates
+ * feed the retransmission timeout used for the session.
+ */
+typedef struct {
+  rtt_estimate_t strong;
+  rtt_estimate_t weak;
+  uint32_t rto_ms;      // Retransmission timeout for new exchanges
+  uint32_t last_rtt_ms; // The most recent sample
+} rtt_estimator_t;
+
+/**
+ * Start over with the initial timeout.
+ */
+void rtt_init(rtt_estimator_t *rtt);
+
+/**
+ * Add a sample from an exchange. Retransmits is the number of times the
+ * request was sent again before the response arrived.
+ */
+void rtt_update(rtt_estimator_t *rtt, uint32_t rtt_ms, int retransmits);
+
+/**
+ * Backoff factor for the current timeout. Short timeouts back off faster and
+ * long timeouts slower than the usual doubling. The factor is in eighths.
+ */
+uint32_t rtt_backoff_eighths(const rtt_estimator_t *rtt);
+
+/**
+ * Timeout for a request that has been retransmitted the number of times.
+ */
+uint32_t rtt_timeout_ms(const rtt_estimator_t *rtt, int retransmits);
+
+/**
+ * Number of retransmissions that keep the total time spent on a confirmable
+ * exchange close to what the default timers use (RFC 7252 MAX_TRANSMIT_SPAN).
+ * Sessions with a short timeout get more attempts and sessions with a long
+ * timeout fewer.
+ */
+unsigned int rtt_max_retransmit(const rtt_estimator_t *rtt);
@@ -1,14 +1,16 @@
 #!/usr/bin/bash
 
-# Launch the report-and-possibly-download every 30 seconds
+# Launch the report-and-possibly-download every 30 seconds. Run
+# ./fota-sample -d instead to keep a single client running that reports on its
+# own schedule and starts new images itself.
 while /bin/true; do
-    ./fota-sample
-    # If there is a new image it will be downloaded to image.new. Rename to fota-sample
-    # to use the new version.
-    if [ -f image.new ]; then
-        echo "**** A new version is available!"
-        mv fota-sample fota-sample.old
-        mv image.new fota-sample
+    # New images are downloaded to an A/B slot and activated by pointing the
+    # current link at it. The client rolls back to the previous image if the
+    # new one doesn't report.
+    if [ -e current ]; then
+        ./current
+    else
+        ./fota-sample
     fi
     sleep 30
 done
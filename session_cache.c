@@ -0,0 +1,71 @@
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "session_cache.h"
+
+// Sessions are small (a few hundred bytes with a ticket)
+#define MAX_SESSION_SIZE 4096
+
+bool session_cache_restore(const char *file, void *tls) {
+  SSL *ssl = (SSL *)tls;
+  FILE *fp = fopen(file, "rb");
+  if (!fp) {
+    return false;
+  }
+  uint8_t buf[MAX_SESSION_SIZE];
+  size_t len = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+  if (len == 0 || len == sizeof(buf)) {
+    return false;
+  }
+
+  const uint8_t *p = buf;
+  SSL_SESSION *session = d2i_SSL_SESSION(NULL, &p, len);
+  if (!session) {
+    printf("Ignoring invalid DTLS session cache %s\n", file);
+    session_cache_remove(file);
+    return false;
+  }
+  bool ret = SSL_SESSION_is_resumable(session) &&
+             SSL_set_session(ssl, session) == 1;
+  SSL_SESSION_free(session);
+  return ret;
+}
+
+bool session_cache_store(const char *file, void *tls) {
+  SSL *ssl = (SSL *)tls;
+  if (!ssl || !SSL_is_init_finished(ssl)) {
+    return false;
+  }
+  SSL_SESSION *session = SSL_get1_session(ssl);
+  if (!session) {
+    return false;
+  }
+  uint8_t buf[MAX_SESSION_SIZE];
+  bool ret = false;
+  int len = i2d_SSL_SESSION(session, NULL);
+  if (len > 0 && len < sizeof(buf) && SSL_SESSION_is_resumable(session)) {
+    uint8_t *p = buf;
+    i2d_SSL_SESSION(session, &p);
+
+    // Write to a temporary file and rename so a reader never sees a partial
+    // session.
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp) {
+      ret = fwrite(buf, 1, len, fp) == (size_t)len;
+      ret = fclose(fp) == 0 && ret;
+      if (!ret || rename(tmp, file) != 0) {
+        unlink(tmp);
+        ret = false;
+      }
+    }
+  }
+  SSL_SESSION_free(session);
+  return ret;
+}
+
+void session_cache_remove(const char *file) { unlink(file); }
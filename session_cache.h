@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Restore a cached DTLS session into a TLS connection that hasn't started its
+ * handshake yet. The TLS connection is the library specific object from the
+ * CoAP session (an OpenSSL SSL object). Returns false if there's no usable
+ * session in the cache file.
+ */
+bool session_cache_restore(const char *file, void *tls);
+
+/**
+ * Store the DTLS session of an established connection in the cache file so
+ * the next connection to the same server can resume it.
+ */
+bool session_cache_store(const char *file, void *tls);
+
+/**
+ * Remove a cached session. This is used when it is invalid or the handshake
+ * that offered it fails.
+ */
+void session_cache_remove(const char *file);
@@ -0,0 +1,488 @@
+// Fleet simulator. This runs a number of virtual devices in one process to
+// load test the FOTA backend. Each device has its own identity and DTLS
+// session and they report (and optionally download images) concurrently. The
+// devices are spread across worker threads where each thread runs a single
+// CoAP context and I/O loop for all of its devices.
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coap.h"
+#include "download.h"
+#include "reporting.h"
+
+#define DEFAULT_HOST "data.lab5e.com"
+#define DEFAULT_PORT 5684
+#define DEFAULT_DEVICES 100
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION_SECONDS 60
+#define DEFAULT_INTERVAL_SECONDS 30
+#define DEFAULT_VERSION "1.0.0"
+#define CERT_FILE "cert.crt"
+#define KEY_FILE "key.pem"
+#define KEEPALIVE_SECONDS 10
+
+// A report that isn't answered in this time is counted as a failure
+#define REPORT_TIMEOUT_SECONDS 60
+// Longest time the I/O loop blocks
+#define MAX_LOOP_WAIT_MS 100
+
+typedef enum { DEVICE_IDLE, DEVICE_REPORTING, DEVICE_DOWNLOADING } phase_t;
+
+typedef struct {
+  coap_state_t state;
+  fota_report_t report;
+  char serial[16];
+  phase_t phase;
+  coap_tick_t next_report;
+  coap_tick_t started;
+  bool update_offered;
+  fota_response_t update;
+  download_t *download;
+  struct worker_s *worker;
+} device_t;
+
+// Samples are kept in a growing array so percentiles can be computed at the
+// end of the run.
+typedef struct {
+  double *values;
+  size_t count;
+  size_t size;
+} samples_t;
+
+typedef struct worker_s {
+  pthread_t thread;
+  coap_context_t *ctx;
+  device_t *devices;
+  int num_devices;
+  samples_t report_latency;
+  samples_t download_time;
+  uint64_t reports_sent;
+  uint64_t reports_ok;
+  uint64_t report_failures;
+  uint64_t updates_offered;
+  uint64_t downloads_ok;
+  uint64_t download_failures;
+  uint64_t connect_failures;
+  uint64_t bytes_downloaded;
+} worker_t;
+
+typedef struct {
+  const char *host;
+  int port;
+  const char *model;
+  const char *version;
+  int devices;
+  int threads;
+  int duration;
+  int interval;
+  int ramp;
+  bool download;
+  unsigned int window;
+  size_t block_size;
+  coap_proto_t proto;
+} sim_config_t;
+
+static sim_config_t config = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .model = "model 01",
+    .version = DEFAULT_VERSION,
+    .devices = DEFAULT_DEVICES,
+    .threads = DEFAULT_THREADS,
+    .duration = DEFAULT_DURATION_SECONDS,
+    .interval = DEFAULT_INTERVAL_SECONDS,
+    .ramp = 0,
+    .download = false,
+    .window = 4,
+    .block_size = DOWNLOAD_DEFAULT_BLOCK_SIZE,
+    .proto = COAP_PROTO_DTLS,
+};
+
+static void add_sample(samples_t *samples, double value) {
+  if (samples->count == samples->size) {
+    size_t size = samples->size ? samples->size * 2 : 1024;
+    double *values = realloc(samples->values, size * sizeof(double));
+    if (!values) {
+      return;
+    }
+    samples->values = values;
+    samples->size = size;
+  }
+  samples->values[samples->count++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static double percentile(const samples_t *samples, double p) {
+  if (samples->count == 0) {
+    return 0;
+  }
+  size_t idx = (size_t)(p / 100.0 * (samples->count - 1) + 0.5);
+  return samples->values[idx];
+}
+
+static double elapsed_ms(coap_tick_t from) {
+  coap_tick_t now;
+  coap_ticks(&now);
+  return (double)(now - from) * 1000.0 / COAP_TICKS_PER_SECOND;
+}
+
+static coap_tick_t seconds_from_now(double seconds) {
+  coap_tick_t now;
+  coap_ticks(&now);
+  return now + (coap_tick_t)(seconds * COAP_TICKS_PER_SECOND);
+}
+
+static void upgrade_cb(void *user_data, fota_response_t *resp) {
+  device_t *device = (device_t *)user_data;
+  worker_t *worker = device->worker;
+  worker->reports_ok++;
+  add_sample(&worker->report_latency, elapsed_ms(device->started));
+  device->phase = DEVICE_IDLE;
+  if (resp->has_new_version) {
+    worker->updates_offered++;
+    device->update_offered = true;
+    device->update = *resp;
+  }
+}
+
+// The image is discarded; only the bytes are counted
+static bool download_block_cb(void *user_data, int block_num,
+                              size_t block_size, uint8_t *buf, size_t len,
+                              uint32_t max_size) {
+  device_t *device = (device_t *)user_data;
+  device->worker->bytes_downloaded += len;
+  return true;
+}
+
+static void start_download(device_t *device) {
+  worker_t *worker = device->worker;
+  device->update_offered = false;
+  if (strcmp((const char *)device->update.hostname, config.host) != 0 ||
+      (int)device->update.port != config.port) {
+    // Only downloads from the report server are simulated since they share
+    // the device's session.
+    return;
+  }
+  download_options_t options = {
+      .window = config.window,
+      .block_size = config.block_size,
+      .callback = download_block_cb,
+      .user_data = device,
+  };
+  coap_ticks(&device->started);
+  device->download = coap_download_start(
+      &device->state, (const char *)device->update.path, &options);
+  if (!device->download) {
+    worker->download_failures++;
+    return;
+  }
+  device->phase = DEVICE_DOWNLOADING;
+}
+
+static void finish_download(device_t *device) {
+  worker_t *worker = device->worker;
+  if (coap_download_is_done(device->download)) {
+    worker->downloads_ok++;
+    add_sample(&worker->download_time, elapsed_ms(device->started));
+  } else {
+    worker->download_failures++;
+  }
+  coap_download_free(device->download);
+  device->download = NULL;
+  device->phase = DEVICE_IDLE;
+}
+
+// Run one device's state machine. Returns the number of milliseconds until it
+// needs attention again.
+static unsigned int step_device(device_t *device, coap_tick_t now) {
+  worker_t *worker = device->worker;
+
+  if (device->state.failed) {
+    if (device->phase == DEVICE_IDLE && now < device->next_report) {
+      // Wait until the next report is due before reconnecting
+      return MAX_LOOP_WAIT_MS;
+    }
+    if (device->phase == DEVICE_REPORTING) {
+      worker->report_failures++;
+    }
+    if (device->download) {
+      finish_download(device);
+    }
+    device->phase = DEVICE_IDLE;
+    if (!coap_reconnect(&device->state)) {
+      worker->connect_failures++;
+      device->next_report = seconds_from_now(config.interval);
+      return MAX_LOOP_WAIT_MS;
+    }
+  }
+
+  switch (device->phase) {
+  case DEVICE_IDLE:
+    if (config.download && device->update_offered) {
+      start_download(device);
+      return 1;
+    }
+    if (now >= device->next_report) {
+      device->started = now;
+      device->next_report = seconds_from_now(config.interval);
+      worker->reports_sent++;
+      if (!coap_send_report(&device->state, &device->report)) {
+        worker->report_failures++;
+        return MAX_LOOP_WAIT_MS;
+      }
+      device->phase = DEVICE_REPORTING;
+    }
+    break;
+  case DEVICE_REPORTING:
+    if (elapsed_ms(device->started) > REPORT_TIMEOUT_SECONDS * 1000) {
+      worker->report_failures++;
+      device->phase = DEVICE_IDLE;
+    }
+    break;
+  case DEVICE_DOWNLOADING: {
+    unsigned int timeout = coap_download_poll(device->download);
+    if (coap_download_is_done(device->download) ||
+        coap_download_has_failed(device->download)) {
+      finish_download(device);
+      return 1;
+    }
+    return timeout;
+  }
+  }
+  if (device->phase == DEVICE_IDLE && device->next_report > now) {
+    return (device->next_report - now) * 1000 / COAP_TICKS_PER_SECOND;
+  }
+  return MAX_LOOP_WAIT_MS;
+}
+
+static void *run_worker(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  worker->ctx = coap_new_context(NULL);
+  if (!worker->ctx) {
+    printf("Could not create CoAP context\n");
+    return NULL;
+  }
+  coap_context_set_keepalive(worker->ctx, KEEPALIVE_SECONDS);
+
+  for (int i = 0; i < worker->num_devices; i++) {
+    device_t *device = &worker->devices[i];
+    if (!coap_connect_context(&device->state, worker->ctx, config.host,
+                              config.port, config.proto, CERT_FILE,
+                              KEY_FILE)) {
+      worker->connect_failures++;
+      device->state.failed = true;
+    }
+    coap_register_handlers(&device->state);
+    coap_set_upgrade_handler(&device->state, upgrade_cb, device);
+    // Spread the first reports across the ramp-up period
+    double offset =
+        config.ramp > 0 ? (double)rand() / RAND_MAX * config.ramp : 0;
+    device->next_report = seconds_from_now(offset);
+  }
+
+  coap_tick_t end = seconds_from_now(config.duration);
+  coap_tick_t now;
+  coap_ticks(&now);
+  while (now < end) {
+    unsigned int wait = MAX_LOOP_WAIT_MS;
+    for (int i = 0; i < worker->num_devices; i++) {
+      unsigned int timeout = step_device(&worker->devices[i], now);
+      if (timeout < wait) {
+        wait = timeout;
+      }
+    }
+    coap_run_once(worker->ctx, wait > 0 ? wait : 1);
+    coap_ticks(&now);
+  }
+
+  for (int i = 0; i < worker->num_devices; i++) {
+    device_t *device = &worker->devices[i];
+    if (device->download) {
+      finish_download(device);
+    }
+    coap_disconnect(&device->state);
+  }
+  coap_free_context(worker->ctx);
+  return NULL;
+}
+
+static void merge_samples(samples_t *dst, const samples_t *src) {
+  for (size_t i = 0; i < src->count; i++) {
+    add_sample(dst, src->values[i]);
+  }
+}
+
+static void print_latency(const char *name, samples_t *samples) {
+  qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+  printf("%-18s n=%-8zu p50=%.1f ms p90=%.1f ms p99=%.1f ms max=%.1f ms\n",
+         name, samples->count, percentile(samples, 50),
+         percentile(samples, 90), percentile(samples, 99),
+         percentile(samples, 100));
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [options]\n", name);
+  printf("  -n devices   Number of virtual devices (default %d)\n",
+         DEFAULT_DEVICES);
+  printf("  -t threads   Number of worker threads (default %d)\n",
+         DEFAULT_THREADS);
+  printf("  -d seconds   Duration of the run (default %d)\n",
+         DEFAULT_DURATION_SECONDS);
+  printf("  -i seconds   Report interval per device (default %d)\n",
+         DEFAULT_INTERVAL_SECONDS);
+  printf("  -r seconds   Spread the first reports over this period\n");
+  printf("  -H host      Server host (default %s)\n", DEFAULT_HOST);
+  printf("  -P port      Server port (default %d)\n", DEFAULT_PORT);
+  printf("  -m model     Model reported by the devices\n");
+  printf("  -v version   Firmware version reported by the devices\n");
+  printf("  -D           Download images when an update is offered\n");
+  printf("  -w window    Download window (default %u)\n", config.window);
+  printf("  -b bytes     Preferred download block size (default %zu)\n",
+         config.block_size);
+  printf("  -T           Use CoAP over TLS (TCP) instead of DTLS\n");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:d:i:r:H:P:m:v:Dw:b:T")) != -1) {
+    switch (opt) {
+    case 'n':
+      config.devices = atoi(optarg);
+      break;
+    case 't':
+      config.threads = atoi(optarg);
+      break;
+    case 'd':
+      config.duration = atoi(optarg);
+      break;
+    case 'i':
+      config.interval = atoi(optarg);
+      break;
+    case 'r':
+      config.ramp = atoi(optarg);
+      break;
+    case 'H':
+      config.host = optarg;
+      break;
+    case 'P':
+      config.port = atoi(optarg);
+      break;
+    case 'm':
+      config.model = optarg;
+      break;
+    case 'v':
+      config.version = optarg;
+      break;
+    case 'D':
+      config.download = true;
+      break;
+    case 'w':
+      config.window = atoi(optarg);
+      break;
+    case 'b':
+      config.block_size = atoi(optarg);
+      break;
+    case 'T':
+      config.proto = COAP_PROTO_TLS;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (config.devices < 1 || config.threads < 1 || config.duration < 1 ||
+      config.interval < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (config.threads > config.devices) {
+    config.threads = config.devices;
+  }
+
+  coap_startup();
+  coap_dtls_set_log_level(LOG_WARNING);
+  coap_set_log_level(LOG_WARNING);
+
+  device_t *devices = calloc(config.devices, sizeof(device_t));
+  worker_t *workers = calloc(config.threads, sizeof(worker_t));
+  if (!devices || !workers) {
+    printf("Could not allocate %d devices\n", config.devices);
+    return 1;
+  }
+
+  printf("Simulating %d devices on %d threads for %d seconds against %s:%d\n",
+         config.devices, config.threads, config.duration, config.host,
+         config.port);
+
+  int per_worker = config.devices / config.threads;
+  int extra = config.devices % config.threads;
+  device_t *next = devices;
+  for (int i = 0; i < config.threads; i++) {
+    worker_t *worker = &workers[i];
+    worker->devices = next;
+    worker->num_devices = per_worker + (i < extra ? 1 : 0);
+    next += worker->num_devices;
+    for (int j = 0; j < worker->num_devices; j++) {
+      device_t *device = &worker->devices[j];
+      int id = (int)(device - devices);
+      snprintf(device->serial, sizeof(device->serial), "sim-%06d", id);
+      device->report.manufacturer = (uint8_t *)"Lab5e Demo Corp";
+      device->report.model = (uint8_t *)config.model;
+      device->report.serial = (uint8_t *)device->serial;
+      device->report.version = (uint8_t *)config.version;
+      device->worker = worker;
+    }
+    if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+      printf("Could not start worker thread %d\n", i);
+      return 1;
+    }
+  }
+
+  worker_t total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < config.threads; i++) {
+    worker_t *worker = &workers[i];
+    pthread_join(worker->thread, NULL);
+    total.reports_sent += worker->reports_sent;
+    total.reports_ok += worker->reports_ok;
+    total.report_failures += worker->report_failures;
+    total.updates_offered += worker->updates_offered;
+    total.downloads_ok += worker->downloads_ok;
+    total.download_failures += worker->download_failures;
+    total.connect_failures += worker->connect_failures;
+    total.bytes_downloaded += worker->bytes_downloaded;
+    merge_samples(&total.report_latency, &worker->report_latency);
+    merge_samples(&total.download_time, &worker->download_time);
+    free(worker->report_latency.values);
+    free(worker->download_time.values);
+  }
+
+  printf("Reports:   sent=%" PRIu64 " ok=%" PRIu64 " failed=%" PRIu64
+         " (%.1f reports/s)\n",
+         total.reports_sent, total.reports_ok, total.report_failures,
+         (double)total.reports_ok / config.duration);
+  printf("Updates:   offered=%" PRIu64 " downloaded=%" PRIu64
+         " failed=%" PRIu64 " (%.1f KiB/s)\n",
+         total.updates_offered, total.downloads_ok, total.download_failures,
+         (double)total.bytes_downloaded / 1024.0 / config.duration);
+  printf("Connects:  failed=%" PRIu64 "\n", total.connect_failures);
+  print_latency("Report latency", &total.report_latency);
+  print_latency("Download time", &total.download_time);
+
+  free(total.report_latency.values);
+  free(total.download_time.values);
+  free(devices);
+  free(workers);
+  coap_cleanup();
+  return 0;
+}
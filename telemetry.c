@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+
+#define TELEMETRY_MAGIC 0x464f5454 // "FOTT"
+#define TELEMETRY_VERSION 1
+#define TMP_SUFFIX ".tmp"
+
+void telemetry_init(telemetry_t *telemetry) {
+  memset(telemetry, 0, sizeof(*telemetry));
+}
+
+// Find a record of the type that isn't part of the report in flight
+static telemetry_record_t *find_record(telemetry_t *telemetry,
+                                       telemetry_type_t type) {
+  for (size_t i = telemetry->in_flight; i < telemetry->count; i++) {
+    if (telemetry->records[i].type == type) {
+      return &telemetry->records[i];
+    }
+  }
+  return NULL;
+}
+
+static telemetry_record_t *new_record(telemetry_t *telemetry,
+                                      telemetry_type_t type) {
+  if (telemetry->count == TELEMETRY_MAX_RECORDS) {
+    // Drop the oldest record
+    memmove(&telemetry->records[0], &telemetry->records[1],
+            (TELEMETRY_MAX_RECORDS - 1) * sizeof(telemetry_record_t));
+    telemetry->count--;
+    if (telemetry->in_flight > 0) {
+      telemetry->in_flight--;
+    }
+  }
+  telemetry_record_t *record = &telemetry->records[telemetry->count++];
+  memset(record, 0, sizeof(*record));
+  record->type = type;
+  return record;
+}
+
+static void store_uint32(telemetry_record_t *record, uint32_t value) {
+  record->len = 4;
+  record->value[0] = value >> 24;
+  record->value[1] = value >> 16;
+  record->value[2] = value >> 8;
+  record->value[3] = value;
+}
+
+static uint32_t load_uint32(const telemetry_record_t *record) {
+  return ((uint32_t)record->value[0] << 24) |
+         ((uint32_t)record->value[1] << 16) |
+         ((uint32_t)record->value[2] << 8) | record->value[3];
+}
+
+void telemetry_set_uint32(telemetry_t *telemetry, telemetry_type_t type,
+                          uint32_t value) {
+  telemetry_record_t *record = find_record(telemetry, type);
+  if (!record) {
+    record = new_record(telemetry, type);
+  }
+  store_uint32(record, value);
+}
+
+void telemetry_add_uint32(telemetry_t *telemetry, telemetry_type_t type,
+                          uint32_t value) {
+  telemetry_record_t *record = find_record(telemetry, type);
+  if (!record) {
+    record = new_record(telemetry, type);
+    store_uint32(record, 0);
+  }
+  store_uint32(record, load_uint32(record) + value);
+}
+
+void telemetry_set_string(telemetry_t *telemetry, telemetry_type_t type,
+                          const char *value) {
+  telemetry_record_t *record = find_record(telemetry, type);
+  if (!record) {
+    record = new_record(telemetry, type);
+  }
+  size_t len = strnlen(value, TELEMETRY_MAX_VALUE);
+  memcpy(record->value, value, len);
+  record->len = len;
+}
+
+void telemetry_flush(telemetry_t *telemetry) {
+  size_t sent = telemetry->in_flight;
+  memmove(&telemetry->records[0], &telemetry->records[sent],
+          (telemetry->count - sent) * sizeof(telemetry_record_t));
+  telemetry->count -= sent;
+  telemetry->in_flight = 0;
+}
+
+// Counters are added to a newer record instead of being replaced by it
+static bool is_counter(uint8_t type) { return type == TELEMETRY_RETRANSMITS; }
+
+void telemetry_requeue(telemetry_t *telemetry) {
+  size_t sent = telemetry->in_flight;
+  telemetry->in_flight = 0;
+  size_t count = 0;
+  for (size_t i = 0; i < telemetry->count; i++) {
+    telemetry_record_t *record = &telemetry->records[i];
+    // A record set while the report was in flight has the newer value
+    telemetry_record_t *newer = NULL;
+    for (size_t j = sent; i < sent && !newer && j < telemetry->count; j++) {
+      if (telemetry->records[j].type == record->type) {
+        newer = &telemetry->records[j];
+      }
+    }
+    if (!newer) {
+      telemetry->records[count++] = *record;
+    } else if (is_counter(record->type)) {
+      store_uint32(newer, load_uint32(newer) + load_uint32(record));
+    }
+  }
+  telemetry->count = count;
+}
+
+bool telemetry_load(telemetry_t *telemetry, const char *file) {
+  telemetry_init(telemetry);
+  FILE *fp = fopen(file, "rb");
+  if (!fp) {
+    return false;
+  }
+  uint32_t magic = 0;
+  uint8_t version = 0;
+  uint8_t count = 0;
+  uint8_t in_flight = 0;
+  bool ok = fread(&magic, sizeof(magic), 1, fp) == 1 &&
+            magic == TELEMETRY_MAGIC &&
+            fread(&version, sizeof(version), 1, fp) == 1 &&
+            version == TELEMETRY_VERSION &&
+            fread(&count, sizeof(count), 1, fp) == 1 &&
+            count <= TELEMETRY_MAX_RECORDS &&
+            fread(&in_flight, sizeof(in_flight), 1, fp) == 1 &&
+            in_flight <= count &&
+            fread(telemetry->records, sizeof(telemetry_record_t), count, fp) ==
+                count;
+  fclose(fp);
+  for (size_t i = 0; ok && i < count; i++) {
+    ok = telemetry->records[i].len <= TELEMETRY_MAX_VALUE;
+  }
+  if (!ok) {
+    printf("Ignoring invalid telemetry %s\n", file);
+    telemetry_init(telemetry);
+    return false;
+  }
+  telemetry->count = count;
+  // The process ended before the server acknowledged the report
+  telemetry->in_flight = in_flight;
+  telemetry_requeue(telemetry);
+  return true;
+}
+
+bool telemetry_save(const telemetry_t *telemetry, const char *file) {
+  if (telemetry->count == 0) {
+    unlink(file);
+    return true;
+  }
+  char tmp[256];
+  snprintf(tmp, sizeof(tmp), "%s%s", file, TMP_SUFFIX);
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) {
+    printf("**** Error opening telemetry %s: %s\n", tmp, strerror(errno));
+    return false;
+  }
+  uint32_t magic = TELEMETRY_MAGIC;
+  uint8_t version = TELEMETRY_VERSION;
+  uint8_t count = telemetry->count;
+  uint8_t in_flight = telemetry->in_flight;
+  bool ok = fwrite(&magic, sizeof(magic), 1, fp) == 1 &&
+            fwrite(&version, sizeof(version), 1, fp) == 1 &&
+            fwrite(&count, sizeof(count), 1, fp) == 1 &&
+            fwrite(&in_flight, sizeof(in_flight), 1, fp) == 1 &&
+            fwrite(telemetry->records, sizeof(telemetry_record_t), count,
+                   fp) == count;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp, file) != 0) {
+    printf("**** Error writing telemetry %s\n", file);
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of telemetry records held between reports. The oldest record
+ * is dropped when a new record doesn't fit.
+ */
+#define TELEMETRY_MAX_RECORDS 16
+
+/**
+ * Longest value in a record.
+ */
+#define TELEMETRY_MAX_VALUE 48
+
+/**
+ * Record types. These are the TLV IDs used in the report.
+ */
+typedef enum {
+  TELEMETRY_UPTIME = 16,         // Seconds since the client started
+  TELEMETRY_DOWNLOAD_TIME = 17,  // Duration of the last download in ms
+  TELEMETRY_DOWNLOAD_BYTES = 18, // Bytes received in the last download
+  TELEMETRY_RETRANSMITS = 19,    // Requests sent again since the last report
+  TELEMETRY_LAST_ERROR = 20,     // Description of the last error
+  TELEMETRY_RTO = 21,            // Retransmission timeout in ms
+  TELEMETRY_SRTT = 22,           // Smoothed round trip time in ms
+  TELEMETRY_DOWNLOAD_RATE = 23,  // Achieved rate of the last paced download
+} telemetry_type_t;
+
+typedef struct {
+  uint8_t type;
+  uint8_t len;
+  uint8_t value[TELEMETRY_MAX_VALUE];
+} telemetry_record_t;
+
+/**
+ * Telemetry records collected between reports. The records are sent with the
+ * next report and removed when the server acknowledges it. The records are
+ * saved to a file so records from a run that ended before they were reported
+ * are sent by the next run.
+ */
+typedef struct {
+  telemetry_record_t records[TELEMETRY_MAX_RECORDS];
+  size_t count;
+  size_t in_flight; // Records sent in the report waiting for a response
+} telemetry_t;
+
+/**
+ * Initialise an empty set of records.
+ */
+void telemetry_init(telemetry_t *telemetry);
+
+/**
+ * Set a value. A record of the same type that hasn't been sent is replaced.
+ */
+void telemetry_set_uint32(telemetry_t *telemetry, telemetry_type_t type,
+                          uint32_t value);
+
+/**
+ * Add to a counter. The value is added to a record of the same type that
+ * hasn't been sent.
+ */
+void telemetry_add_uint32(telemetry_t *telemetry, telemetry_type_t type,
+                          uint32_t value);
+
+/**
+ * Set a string value. Long strings are truncated.
+ */
+void telemetry_set_string(telemetry_t *telemetry, telemetry_type_t type,
+                          const char *value);
+
+/**
+ * Remove the records that were sent in the last report. This is called when
+ * the report is acknowledged.
+ */
+void telemetry_flush(telemetry_t *telemetry);
+
+/**
+ * Keep the records that were sent in a report that failed so they are sent
+ * again with the next report. Records that were set while the report was in
+ * flight replace the ones that were sent, and counters are added together.
+ */
+void telemetry_requeue(telemetry_t *telemetry);
+
+/**
+ * Load the records saved by an earlier run. Records that were in flight when
+ * they were saved are sent again. Returns false if there are no saved records.
+ */
+bool telemetry_load(telemetry_t *telemetry, const char *file);
+
+/**
+ * Save the records so the next run can report them. The file is removed when
+ * there are no records.
+ */
+bool telemetry_save(const telemetry_t *telemetry, const char *file);
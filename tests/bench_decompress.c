@@ -0,0 +1,132 @@
+// Decompression throughput with the compressed image fed in block sized
+// pieces, the way the download passes it on. Run with make bench.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "decompress.h"
+
+#define IMAGE_SIZE (10 * 1024 * 1024)
+
+typedef struct {
+  const uint8_t *image;
+  size_t offset;
+  bool corrupt;
+} bench_decompress_t;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool check_output(void *user_data, const uint8_t *buf, size_t len) {
+  bench_decompress_t *bench = user_data;
+  if (bench->offset + len > IMAGE_SIZE ||
+      memcmp(bench->image + bench->offset, buf, len) != 0) {
+    bench->corrupt = true;
+    return false;
+  }
+  bench->offset += len;
+  return true;
+}
+
+// Firmware-like content that compresses about 2-3x: runs copied from
+// recently seen data mixed with literal bytes
+static void fill_image(uint8_t *image) {
+  srand(1);
+  for (size_t i = 0; i < IMAGE_SIZE; i += 16) {
+    size_t distance = 16 + rand() % 2048;
+    bool repeat = i >= distance && rand() % 4 != 0;
+    for (size_t j = i; j < i + 16; j++) {
+      image[j] = repeat ? image[j - distance] : rand();
+    }
+  }
+}
+
+// Compress the image the way the server must: a zlib stream with a window
+// the client accepts
+static uint8_t *compress_image(const uint8_t *image, size_t *len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+                   DECOMPRESS_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+  size_t size = deflateBound(&stream, IMAGE_SIZE);
+  uint8_t *out = malloc(size);
+  if (!out) {
+    deflateEnd(&stream);
+    return NULL;
+  }
+  stream.next_in = (uint8_t *)image;
+  stream.avail_in = IMAGE_SIZE;
+  stream.next_out = out;
+  stream.avail_out = size;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&stream);
+    free(out);
+    return NULL;
+  }
+  *len = stream.total_out;
+  deflateEnd(&stream);
+  return out;
+}
+
+static bool run(const uint8_t *image, const uint8_t *compressed, size_t len,
+                size_t block_size) {
+  decompress_t dc;
+  bench_decompress_t bench = {.image = image};
+  double start = now_s();
+  if (!decompress_init(&dc, check_output, &bench)) {
+    return false;
+  }
+  for (size_t offset = 0; offset < len; offset += block_size) {
+    size_t n = len - offset < block_size ? len - offset : block_size;
+    if (!decompress_write(&dc, compressed + offset, n)) {
+      break;
+    }
+  }
+  bool ok = decompress_is_complete(&dc) && !bench.corrupt &&
+            bench.offset == IMAGE_SIZE;
+  decompress_end(&dc);
+  double elapsed = now_s() - start;
+  if (!ok) {
+    printf("**** Decompression with %zu byte blocks failed at %zu\n",
+           block_size, bench.offset);
+    return false;
+  }
+  printf("%5zu byte blocks: %7.1f MiB/s out  %6.2f us per block\n",
+         block_size, IMAGE_SIZE / elapsed / (1024 * 1024),
+         elapsed * 1e6 / ((len + block_size - 1) / block_size));
+  return true;
+}
+
+int main(void) {
+  uint8_t *image = malloc(IMAGE_SIZE);
+  if (!image) {
+    return 1;
+  }
+  fill_image(image);
+  size_t len;
+  uint8_t *compressed = compress_image(image, &len);
+  if (!compressed) {
+    printf("**** Could not compress the image\n");
+    free(image);
+    return 1;
+  }
+  printf("Decompressing %d MiB from %zu bytes (%.1fx)\n",
+         IMAGE_SIZE / (1024 * 1024), len, (double)IMAGE_SIZE / len);
+
+  // Block sizes used over DTLS and the largest BERT block
+  static const size_t block_sizes[] = {64, 256, 1024, 8192};
+  bool ok = true;
+  for (size_t i = 0; ok && i < sizeof(block_sizes) / sizeof(block_sizes[0]);
+       i++) {
+    ok = run(image, compressed, len, block_sizes[i]);
+  }
+  free(compressed);
+  free(image);
+  return ok ? 0 : 1;
+}
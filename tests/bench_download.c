@@ -0,0 +1,102 @@
+// Download throughput over TLS (BERT blocks) against DTLS from a server on
+// the loopback interface. Run with make bench. Both transports use the same
+// window and preferred block size so only the transport differs.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coap.h"
+#include "download.h"
+#include "local_server.h"
+
+#define IMAGE_SIZE (10 * 1024 * 1024)
+#define IMAGE_PATH "/bench/image.bin"
+#define WINDOW 8
+
+typedef struct {
+  const uint8_t *image;
+  size_t received;
+  bool corrupt;
+} bench_download_t;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool check_block(void *user_data, int block_num, size_t block_size,
+                        uint8_t *buf, size_t len, uint32_t max_size) {
+  bench_download_t *bench = user_data;
+  size_t offset = (size_t)block_num * block_size;
+  if (offset + len > IMAGE_SIZE ||
+      memcmp(bench->image + offset, buf, len) != 0) {
+    bench->corrupt = true;
+    return false;
+  }
+  bench->received = offset + len;
+  return true;
+}
+
+static bool run(const char *name, coap_proto_t proto, const uint8_t *image) {
+  download_config_t config;
+  coap_download_config_init(&config);
+  coap_set_download_transport(&config, proto);
+  coap_set_download_window(&config, WINDOW);
+  coap_set_download_block_size(&config, DOWNLOAD_MAX_BERT_SIZE);
+  download_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  coap_set_download_stats(&config, &stats);
+
+  coap_state_t state;
+  memset(&state, 0, sizeof(state));
+  coap_set_download_config(&state, &config);
+  bench_download_t bench = {.image = image};
+
+  double start = now_s();
+  bool ok = coap_download_firmware(&state, "127.0.0.1", LOCAL_SERVER_PORT,
+                                   IMAGE_PATH, check_block, &bench,
+                                   LOCAL_SERVER_CERT_FILE,
+                                   LOCAL_SERVER_KEY_FILE);
+  double elapsed = now_s() - start;
+  if (!ok || bench.corrupt || bench.received != IMAGE_SIZE) {
+    printf("**** %s download failed after %zu bytes%s\n", name,
+           bench.received, bench.corrupt ? " (corrupt block)" : "");
+    return false;
+  }
+  printf("%-5s %6.1f MiB/s  %.2f s  %u retries\n", name,
+         IMAGE_SIZE / elapsed / (1024 * 1024), elapsed, stats.retries);
+  return true;
+}
+
+int main(void) {
+  uint8_t *image = malloc(IMAGE_SIZE);
+  if (!image) {
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < IMAGE_SIZE; i++) {
+    image[i] = rand();
+  }
+
+  coap_startup();
+  coap_dtls_set_log_level(LOG_WARNING);
+  coap_set_log_level(LOG_WARNING);
+  local_server_t server;
+  memset(&server, 0, sizeof(server));
+  if (!local_server_add_image(&server, IMAGE_PATH, image, IMAGE_SIZE) ||
+      !local_server_start(&server)) {
+    return 1;
+  }
+
+  printf("Downloading %d MiB from 127.0.0.1:%d\n", IMAGE_SIZE / (1024 * 1024),
+         LOCAL_SERVER_PORT);
+  bool ok = run("TLS", COAP_PROTO_TLS, image) &&
+            run("DTLS", COAP_PROTO_DTLS, image);
+
+  local_server_stop(&server);
+  coap_cleanup();
+  free(image);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+// Throughput of the image sink against the old per-block open, append and
+// close. Run with make bench [BENCH_DIR=dir] to measure a particular file
+// system.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image_sink.h"
+
+#define IMAGE_SIZE (16 * 1024 * 1024)
+#define BLOCK_SIZE 1024
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The write path before the sink: the file is opened for every block
+static bool write_per_block(const char *path, const uint8_t *image) {
+  unlink(path);
+  for (size_t offset = 0; offset < IMAGE_SIZE; offset += BLOCK_SIZE) {
+    int fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0600);
+    if (fd < 0 || write(fd, image + offset, BLOCK_SIZE) != BLOCK_SIZE) {
+      printf("**** Error writing %s\n", path);
+      return false;
+    }
+    close(fd);
+  }
+  // The sink syncs the image when it is closed, so this does too
+  int fd = open(path, O_WRONLY);
+  bool ok = fd >= 0 && fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+static bool write_sink(const char *path, const uint8_t *image, bool writer) {
+  image_sink_t sink;
+  image_sink_init(&sink, path);
+  image_sink_set_writer_thread(&sink, writer);
+  if (!image_sink_open(&sink, IMAGE_SIZE, 0600, false)) {
+    return false;
+  }
+  for (size_t offset = 0; offset < IMAGE_SIZE; offset += BLOCK_SIZE) {
+    if (!image_sink_write(&sink, offset, image + offset, BLOCK_SIZE)) {
+      image_sink_abort(&sink);
+      return false;
+    }
+  }
+  return image_sink_close(&sink);
+}
+
+static void report(const char *name, double seconds) {
+  printf("%-24s %8.3f s %8.1f MiB/s\n", name, seconds,
+         IMAGE_SIZE / seconds / (1024 * 1024));
+}
+
+int main(int argc, char **argv) {
+  const char *dir = argc > 1 ? argv[1] : ".";
+  char path[256];
+  snprintf(path, sizeof(path), "%s/bench_image.bin", dir);
+
+  uint8_t *image = malloc(IMAGE_SIZE);
+  if (!image) {
+    return 1;
+  }
+  for (size_t i = 0; i < IMAGE_SIZE; i++) {
+    image[i] = rand();
+  }
+  printf("Writing %d MiB in %d byte blocks to %s\n",
+         IMAGE_SIZE / (1024 * 1024), BLOCK_SIZE, dir);
+
+  double start = now_s();
+  if (!write_per_block(path, image)) {
+    return 1;
+  }
+  report("open/write/close", now_s() - start);
+
+  start = now_s();
+  if (!write_sink(path, image, false)) {
+    return 1;
+  }
+  report("image sink", now_s() - start);
+
+  start = now_s();
+  if (!write_sink(path, image, true)) {
+    return 1;
+  }
+  report("image sink with writer", now_s() - start);
+
+  unlink(path);
+  free(image);
+  return 0;
+}
@@ -0,0 +1,119 @@
+// Encode and decode rates for the report codec. Run with make bench.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "image_hash.h"
+#include "reporting.h"
+
+#define ITERATIONS 1000000
+
+// Field IDs in responses (see reporting.c)
+#define HOST_ID 1
+#define PORT_ID 2
+#define PATH_ID 3
+#define AVAILABLE_ID 4
+#define PATCH_PATH_ID 5
+#define NEW_IMAGE_HASH_ID 7
+#define MANIFEST_PATH_ID 8
+#define MIRROR_ID 9
+
+static volatile size_t sink;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_field(uint8_t *buf, size_t *len, uint8_t id,
+                      const void *value, size_t value_len) {
+  buf[(*len)++] = id;
+  buf[(*len)++] = value_len;
+  memcpy(buf + *len, value, value_len);
+  *len += value_len;
+}
+
+static void add_string(uint8_t *buf, size_t *len, uint8_t id,
+                       const char *value) {
+  add_field(buf, len, id, value, strlen(value));
+}
+
+// A response with every field set, as large as a real one gets
+static size_t build_response(uint8_t *buf) {
+  size_t len = 0;
+  uint8_t available = 1;
+  uint8_t port[4] = {0, 0, 0x16, 0x34};
+  uint8_t hash[IMAGE_HASH_SIZE];
+  memset(hash, 0xab, sizeof(hash));
+  add_field(buf, &len, AVAILABLE_ID, &available, 1);
+  add_string(buf, &len, HOST_ID, "fota.example.com");
+  add_field(buf, &len, PORT_ID, port, sizeof(port));
+  add_string(buf, &len, PATH_ID, "/fw/2.1");
+  add_string(buf, &len, PATCH_PATH_ID, "/fw/patch/2.0-2.1");
+  add_field(buf, &len, NEW_IMAGE_HASH_ID, hash, sizeof(hash));
+  add_string(buf, &len, MANIFEST_PATH_ID, "/fw/manifest/2.1");
+  add_string(buf, &len, MIRROR_ID, "mirror1.example.com:5684");
+  add_string(buf, &len, MIRROR_ID, "mirror2.example.com");
+  return len;
+}
+
+static void report_rate(const char *name, double start, size_t bytes) {
+  double elapsed = now_s() - start;
+  printf("%-16s %7.0f ns/op  %7.1f MiB/s\n", name, elapsed * 1e9 / ITERATIONS,
+         bytes * (double)ITERATIONS / elapsed / (1024 * 1024));
+}
+
+int main(void) {
+  uint8_t hash[IMAGE_HASH_SIZE];
+  memset(hash, 0x5a, sizeof(hash));
+  fota_report_t report = {
+      .version = (uint8_t *)"2.0.13-rc4",
+      .manufacturer = (uint8_t *)"Example Devices Ltd",
+      .serial = (uint8_t *)"SN-0000-1234-5678-9abc",
+      .model = (uint8_t *)"sensor-gateway-v3",
+      .image_hash = hash,
+      .delta_support = true,
+  };
+  uint8_t buf[512];
+  size_t len = 0;
+
+  double start = now_s();
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (!fota_encode_report(&report, buf, sizeof(buf), &len)) {
+      printf("**** Could not encode the report\n");
+      return 1;
+    }
+    sink += buf[len - 1];
+  }
+  report_rate("encode report", start, len);
+
+  uint8_t response[512];
+  size_t response_len = build_response(response);
+  fota_response_view_t view;
+  start = now_s();
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (!fota_decode_response_view(response, response_len, &view)) {
+      printf("**** Could not decode the response\n");
+      return 1;
+    }
+    sink += view.mirrors.count;
+  }
+  report_rate("decode view", start, response_len);
+
+  fota_response_t resp;
+  start = now_s();
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (!fota_decode_response(response, response_len, &resp)) {
+      printf("**** Could not decode the response\n");
+      return 1;
+    }
+    sink += resp.mirror_count;
+  }
+  report_rate("decode response", start, response_len);
+  if (!resp.has_new_version || resp.port != 5684 || resp.mirror_count != 2) {
+    printf("**** The response was decoded wrong\n");
+    return 1;
+  }
+  return 0;
+}
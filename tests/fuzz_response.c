@@ -0,0 +1,56 @@
+// libFuzzer harness for the report response decoder. Run with make fuzz.
+// Build with -DFUZZ_STANDALONE to replay saved inputs without libFuzzer.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reporting.h"
+
+// The decoded strings are used as C strings so they must be terminated
+static void check_string(const uint8_t *s, size_t size) {
+  if (!memchr(s, '\0', size)) {
+    abort();
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  fota_response_t resp;
+  if (!fota_decode_response(data, size, &resp)) {
+    return 0;
+  }
+  check_string(resp.hostname, sizeof(resp.hostname));
+  check_string(resp.path, sizeof(resp.path));
+  check_string(resp.patch_path, sizeof(resp.patch_path));
+  check_string(resp.manifest_path, sizeof(resp.manifest_path));
+  if (resp.mirror_count > FOTA_MAX_MIRRORS) {
+    abort();
+  }
+  for (size_t i = 0; i < resp.mirror_count; i++) {
+    check_string(resp.mirrors[i].hostname, sizeof(resp.mirrors[i].hostname));
+    // A port in the mirror must be valid. Without one the response port is
+    // used as it is.
+    if (resp.mirrors[i].port != resp.port &&
+        (resp.mirrors[i].port == 0 || resp.mirrors[i].port > 65535)) {
+      abort();
+    }
+  }
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv) {
+  static uint8_t buf[65536];
+  for (int i = 1; i < argc; i++) {
+    FILE *fp = fopen(argv[i], "rb");
+    if (!fp) {
+      printf("**** Could not open %s\n", argv[i]);
+      return 1;
+    }
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    LLVMFuzzerTestOneInput(buf, len);
+  }
+  return 0;
+}
+#endif
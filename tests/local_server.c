@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "local_server.h"
+
+// Largest block size for DTLS (SZX 6, 1024 bytes)
+#define MAX_SZX 6
+// SZX 7 asks for BERT blocks over TCP in units of 1024 bytes
+#define BERT_SZX 7
+#define BERT_UNIT 1024
+#define MAX_BERT_SIZE 8192
+// Room in a response for the header and options
+#define PDU_OVERHEAD 64
+#define LOOP_WAIT_MS 100
+
+static size_t szx_size(unsigned int szx) { return 1 << (szx + 4); }
+
+// Largest BERT payload that fits in a response on the session
+static size_t bert_size(coap_session_t *session) {
+  size_t size = coap_session_max_pdu_size(session);
+  size = size > PDU_OVERHEAD ? size - PDU_OVERHEAD : 0;
+  if (size > MAX_BERT_SIZE) {
+    size = MAX_BERT_SIZE;
+  }
+  size -= size % BERT_UNIT;
+  return size > BERT_UNIT ? size : BERT_UNIT;
+}
+
+static void image_handler(coap_context_t *ctx, coap_resource_t *resource,
+                          coap_session_t *session, coap_pdu_t *request,
+                          coap_binary_t *token, coap_string_t *query,
+                          coap_pdu_t *response) {
+  const local_image_t *image = coap_resource_get_userdata(resource);
+  coap_block_t block;
+  if (!coap_get_block(request, COAP_OPTION_BLOCK2, &block)) {
+    block.num = 0;
+    block.szx = MAX_SZX;
+  }
+  if (block.szx == BERT_SZX && !COAP_PROTO_RELIABLE(session->proto)) {
+    block.szx = MAX_SZX;
+  }
+  size_t unit = block.szx == BERT_SZX ? BERT_UNIT : szx_size(block.szx);
+  size_t size = block.szx == BERT_SZX ? bert_size(session) : unit;
+  size_t offset = (size_t)block.num * unit;
+  if (offset >= image->size) {
+    response->code = COAP_RESPONSE_CODE(402);
+    return;
+  }
+  size_t n = image->size - offset < size ? image->size - offset : size;
+  bool more = offset + n < image->size;
+
+  response->code = COAP_RESPONSE_CODE(205);
+  coap_add_option(response, COAP_OPTION_ETAG, sizeof(image->etag),
+                  image->etag);
+  uint8_t opt[4];
+  size_t opt_len = coap_encode_var_safe(
+      opt, sizeof(opt), (block.num << 4) | (more ? 0x08 : 0) | block.szx);
+  coap_add_option(response, COAP_OPTION_BLOCK2, opt_len, opt);
+  opt_len = coap_encode_var_safe(opt, sizeof(opt), image->size);
+  coap_add_option(response, COAP_OPTION_SIZE2, opt_len, opt);
+  coap_add_data(response, n, image->data + offset);
+}
+
+bool local_server_add_image(local_server_t *server, const char *path,
+                            const uint8_t *data, size_t size) {
+  if (server->image_count == LOCAL_SERVER_MAX_IMAGES ||
+      strlen(path) >= LOCAL_SERVER_MAX_PATH) {
+    printf("**** Can't serve %s\n", path);
+    return false;
+  }
+  local_image_t *image = &server->images[server->image_count];
+  // libcoap matches resources on the path without the leading slash
+  strcpy(image->path, path[0] == '/' ? path + 1 : path);
+  image->data = data;
+  image->size = size;
+  // Images with different content get different ETags
+  uint32_t etag = server->image_count + 1;
+  for (size_t i = 0; i < size; i += 4096) {
+    etag = etag * 31 + data[i];
+  }
+  memcpy(image->etag, &etag, sizeof(image->etag));
+  server->image_count++;
+  return true;
+}
+
+static bool listen_on(coap_context_t *ctx, coap_proto_t proto) {
+  coap_address_t addr;
+  coap_address_init(&addr);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = htons(LOCAL_SERVER_PORT);
+  addr.size = sizeof(addr.addr.sin);
+  if (!coap_new_endpoint(ctx, &addr, proto)) {
+    printf("**** Could not listen on port %d\n", LOCAL_SERVER_PORT);
+    return false;
+  }
+  return true;
+}
+
+static void *serve(void *arg) {
+  local_server_t *server = arg;
+  while (!atomic_load(&server->stop)) {
+    coap_run_once(server->ctx, LOOP_WAIT_MS);
+  }
+  return NULL;
+}
+
+bool local_server_start(local_server_t *server) {
+  server->ctx = coap_new_context(NULL);
+  if (!server->ctx) {
+    printf("**** Could not create the server context\n");
+    return false;
+  }
+
+  // The clients use the same self-signed certificate
+  coap_dtls_pki_t pki;
+  memset(&pki, 0, sizeof(pki));
+  pki.version = COAP_DTLS_PKI_SETUP_VERSION;
+  pki.verify_peer_cert = 1;
+  pki.require_peer_cert = 1;
+  pki.allow_self_signed = 1;
+  pki.cert_chain_validation = 1;
+  pki.cert_chain_verify_depth = 2;
+  pki.pki_key.key_type = COAP_PKI_KEY_PEM;
+  pki.pki_key.key.pem.public_cert = LOCAL_SERVER_CERT_FILE;
+  pki.pki_key.key.pem.private_key = LOCAL_SERVER_KEY_FILE;
+  pki.pki_key.key.pem.ca_file = LOCAL_SERVER_CERT_FILE;
+  if (!coap_context_set_pki(server->ctx, &pki)) {
+    printf("**** Could not set up the server certificate\n");
+    local_server_stop(server);
+    return false;
+  }
+  if (!listen_on(server->ctx, COAP_PROTO_DTLS) ||
+      !listen_on(server->ctx, COAP_PROTO_TLS)) {
+    local_server_stop(server);
+    return false;
+  }
+
+  for (size_t i = 0; i < server->image_count; i++) {
+    local_image_t *image = &server->images[i];
+    coap_str_const_t *path = coap_new_str_const(
+        (const uint8_t *)image->path, strlen(image->path));
+    coap_resource_t *resource =
+        path ? coap_resource_init(path, COAP_RESOURCE_FLAGS_RELEASE_URI)
+             : NULL;
+    if (!resource) {
+      local_server_stop(server);
+      return false;
+    }
+    coap_resource_set_userdata(resource, image);
+    coap_register_handler(resource, COAP_REQUEST_GET, image_handler);
+    coap_add_resource(server->ctx, resource);
+  }
+
+  atomic_store(&server->stop, false);
+  if (pthread_create(&server->thread, NULL, serve, server) != 0) {
+    printf("**** Could not start the server thread\n");
+    local_server_stop(server);
+    return false;
+  }
+  server->running = true;
+  return true;
+}
+
+void local_server_stop(local_server_t *server) {
+  if (!server->ctx) {
+    return;
+  }
+  if (server->running) {
+    atomic_store(&server->stop, true);
+    pthread_join(server->thread, NULL);
+    server->running = false;
+  }
+  coap_free_context(server->ctx);
+  server->ctx = NULL;
+}
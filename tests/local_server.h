@@ -0,0 +1,64 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <coap2/coap.h>
+
+/**
+ * Port the test server listens on for both DTLS and TLS
+ */
+#define LOCAL_SERVER_PORT 15684
+
+/**
+ * Self-signed identity used by the server and the clients. The Makefile
+ * generates it.
+ */
+#define LOCAL_SERVER_CERT_FILE "tests/local.crt"
+#define LOCAL_SERVER_KEY_FILE "tests/local.key"
+
+#define LOCAL_SERVER_MAX_IMAGES 16
+#define LOCAL_SERVER_MAX_PATH 64
+
+typedef struct {
+  char path[LOCAL_SERVER_MAX_PATH];
+  const uint8_t *data;
+  size_t size;
+  uint8_t etag[4];
+} local_image_t;
+
+/**
+ * A CoAP server on 127.0.0.1 for tests and benchmarks. It serves images from
+ * memory with Block2 (BERT blocks over TLS) on its own thread and context so
+ * the client under test runs unchanged on the calling thread. Zero the
+ * server before adding images.
+ */
+typedef struct {
+  coap_context_t *ctx;
+  pthread_t thread;
+  bool running;
+  atomic_bool stop;
+  local_image_t images[LOCAL_SERVER_MAX_IMAGES];
+  size_t image_count;
+} local_server_t;
+
+/**
+ * Serve the data at the path. The data isn't copied and must outlive the
+ * server. Images are added before the server is started.
+ */
+bool local_server_add_image(local_server_t *server, const char *path,
+                            const uint8_t *data, size_t size);
+
+/**
+ * Listen for DTLS and TLS on LOCAL_SERVER_PORT and start serving. Call
+ * coap_startup first.
+ */
+bool local_server_start(local_server_t *server);
+
+/**
+ * Stop the server thread and free the context.
+ */
+void local_server_stop(local_server_t *server);
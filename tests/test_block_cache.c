@@ -0,0 +1,195 @@
+// Tests for the on-disk block cache. Run with make test.
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_cache.h"
+
+#define IMAGE_SIZE (3 * BLOCK_CACHE_UNIT_SIZE + 100)
+
+static int failures = 0;
+static char dir[] = "/tmp/fota-cache-XXXXXX";
+
+static void check(const char *name, bool ok) {
+  if (!ok) {
+    printf("FAIL %s\n", name);
+    failures++;
+  }
+}
+
+static const uint8_t etag[] = {1, 2, 3, 4};
+
+// Unit files in the cache directory, not counting indexes
+static int unit_files(void) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return -1;
+  }
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    if (strlen(entry->d_name) == 2 * IMAGE_HASH_SIZE) {
+      count++;
+    }
+  }
+  closedir(d);
+  return count;
+}
+
+static void fill(uint8_t *unit, uint8_t value) {
+  memset(unit, value, BLOCK_CACHE_UNIT_SIZE);
+}
+
+static bool unit_is(block_cache_t *cache, size_t unit, uint8_t value,
+                    size_t len) {
+  uint8_t buf[BLOCK_CACHE_UNIT_SIZE];
+  size_t got = 0;
+  if (!block_cache_get(cache, unit, buf, &got) || got != len) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (buf[i] != value) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_put_get(void) {
+  block_cache_t cache;
+  uint8_t unit[BLOCK_CACHE_UNIT_SIZE];
+  check("open", block_cache_open(&cache, dir, "coaps://host/fw/1"));
+  check("no index", !block_cache_same_image(&cache, IMAGE_SIZE, etag, 4));
+  check("reset", block_cache_reset(&cache, IMAGE_SIZE, etag, sizeof(etag)));
+  check("unit count", cache.unit_count == 4);
+  check("empty", block_cache_first_missing(&cache) == 0 &&
+                     !block_cache_has(&cache, 0));
+
+  fill(unit, 'a');
+  check("put 0", block_cache_put(&cache, 0, unit, BLOCK_CACHE_UNIT_SIZE));
+  fill(unit, 'b');
+  check("put 1", block_cache_put(&cache, 1, unit, BLOCK_CACHE_UNIT_SIZE));
+  check("put last", block_cache_put(&cache, 3, unit, 100));
+  check("put past end",
+        !block_cache_put(&cache, 4, unit, BLOCK_CACHE_UNIT_SIZE));
+  check("put too long",
+        !block_cache_put(&cache, 2, unit, BLOCK_CACHE_UNIT_SIZE + 1));
+  check("first missing", block_cache_first_missing(&cache) == 2);
+  check("get 0", unit_is(&cache, 0, 'a', BLOCK_CACHE_UNIT_SIZE));
+  check("get 1", unit_is(&cache, 1, 'b', BLOCK_CACHE_UNIT_SIZE));
+  check("get last", unit_is(&cache, 3, 'b', 100));
+  check("get missing", !unit_is(&cache, 2, 0, 0));
+  block_cache_close(&cache);
+
+  // The index is loaded when the image is opened again
+  check("reopen", block_cache_open(&cache, dir, "coaps://host/fw/1"));
+  check("same image", block_cache_same_image(&cache, IMAGE_SIZE, etag, 4));
+  check("other etag", !block_cache_same_image(&cache, IMAGE_SIZE, etag, 3));
+  check("other size", !block_cache_same_image(&cache, IMAGE_SIZE + 1, etag, 4));
+  check("reloaded", block_cache_has(&cache, 0) && block_cache_has(&cache, 3) &&
+                        !block_cache_has(&cache, 2));
+  check("get reloaded", unit_is(&cache, 1, 'b', BLOCK_CACHE_UNIT_SIZE));
+  block_cache_close(&cache);
+}
+
+// Units with the same content are stored once, within an image and across
+// images
+static void test_dedup(void) {
+  block_cache_t cache;
+  uint8_t unit[BLOCK_CACHE_UNIT_SIZE];
+  int before = unit_files();
+
+  block_cache_open(&cache, dir, "coaps://host/fw/2");
+  block_cache_reset(&cache, IMAGE_SIZE, NULL, 0);
+  fill(unit, 'a');
+  check("put shared", block_cache_put(&cache, 0, unit, BLOCK_CACHE_UNIT_SIZE));
+  check("put repeated",
+        block_cache_put(&cache, 1, unit, BLOCK_CACHE_UNIT_SIZE));
+  check("no new files", unit_files() == before);
+  fill(unit, 'c');
+  check("put new", block_cache_put(&cache, 2, unit, BLOCK_CACHE_UNIT_SIZE));
+  check("one new file", unit_files() == before + 1);
+  check("get shared", unit_is(&cache, 1, 'a', BLOCK_CACHE_UNIT_SIZE));
+
+  // A new version of the image starts a new index
+  check("reset", block_cache_reset(&cache, IMAGE_SIZE, etag, sizeof(etag)));
+  check("reset index", block_cache_first_missing(&cache) == 0);
+  check("units kept", unit_files() == before + 1);
+  block_cache_close(&cache);
+}
+
+// A unit file that is missing or corrupt is dropped from the index
+static void test_damaged(void) {
+  block_cache_t cache;
+  uint8_t unit[BLOCK_CACHE_UNIT_SIZE];
+  block_cache_open(&cache, dir, "coaps://host/fw/3");
+  block_cache_reset(&cache, IMAGE_SIZE, etag, sizeof(etag));
+  fill(unit, 'x');
+  block_cache_put(&cache, 0, unit, BLOCK_CACHE_UNIT_SIZE);
+  fill(unit, 'y');
+  block_cache_put(&cache, 1, unit, BLOCK_CACHE_UNIT_SIZE);
+
+  char path[BLOCK_CACHE_MAX_FILE];
+  char name[2 * IMAGE_HASH_SIZE + 1];
+  for (size_t i = 0; i < IMAGE_HASH_SIZE; i++) {
+    sprintf(name + 2 * i, "%02x", cache.hashes[0][i]);
+  }
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE *fp = fopen(path, "r+b");
+  if (fp) {
+    fputc('z', fp);
+    fclose(fp);
+  }
+  check("corrupt", !unit_is(&cache, 0, 'x', BLOCK_CACHE_UNIT_SIZE));
+  check("corrupt dropped", !block_cache_has(&cache, 0));
+
+  for (size_t i = 0; i < IMAGE_HASH_SIZE; i++) {
+    sprintf(name + 2 * i, "%02x", cache.hashes[1][i]);
+  }
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  unlink(path);
+  check("missing", !unit_is(&cache, 1, 'y', BLOCK_CACHE_UNIT_SIZE));
+  check("missing dropped", !block_cache_has(&cache, 1));
+  block_cache_close(&cache);
+
+  block_cache_open(&cache, dir, "coaps://host/fw/3");
+  check("drop saved", block_cache_same_image(&cache, IMAGE_SIZE, etag, 4) &&
+                          block_cache_first_missing(&cache) == 0);
+  block_cache_close(&cache);
+}
+
+static void remove_dir(void) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    if (entry->d_name[0] != '.') {
+      char path[BLOCK_CACHE_MAX_FILE];
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+int main(void) {
+  if (!mkdtemp(dir)) {
+    printf("**** Could not create a temporary directory\n");
+    return 1;
+  }
+  test_put_get();
+  test_dedup();
+  test_damaged();
+  remove_dir();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
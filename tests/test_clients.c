@@ -0,0 +1,142 @@
+// Stress test for running many clients in one process. Each thread has its
+// own state and download settings and downloads its own image from the
+// local server at the same time as the others. Every block must reach the
+// client that asked for it with that client's data. Run with make test.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap.h"
+#include "download.h"
+#include "local_server.h"
+
+#define CLIENTS 8
+#define ROUNDS 3
+#define BASE_SIZE (256 * 1024)
+
+typedef struct {
+  char path[LOCAL_SERVER_MAX_PATH];
+  uint8_t *image;
+  size_t size;
+  coap_state_t state;
+  download_config_t config;
+  download_stats_t stats;
+  size_t received;
+  int foreign_blocks; // Blocks from another client's image
+  int corrupt_blocks;
+  int completed;
+} test_client_t;
+
+static test_client_t clients[CLIENTS];
+
+static bool check_block(void *user_data, int block_num, size_t block_size,
+                        uint8_t *buf, size_t len, uint32_t max_size) {
+  test_client_t *client = user_data;
+  size_t offset = (size_t)block_num * block_size;
+  // Every image has a different size
+  if (max_size != client->size) {
+    client->foreign_blocks++;
+    return false;
+  }
+  if (offset + len > client->size ||
+      memcmp(client->image + offset, buf, len) != 0) {
+    client->corrupt_blocks++;
+    return false;
+  }
+  client->received = offset + len;
+  return true;
+}
+
+static void *run_client(void *arg) {
+  test_client_t *client = arg;
+  for (int round = 0; round < ROUNDS; round++) {
+    client->received = 0;
+    memset(&client->state, 0, sizeof(client->state));
+    coap_set_download_config(&client->state, &client->config);
+    if (coap_download_firmware(&client->state, "127.0.0.1",
+                               LOCAL_SERVER_PORT, client->path, check_block,
+                               client, LOCAL_SERVER_CERT_FILE,
+                               LOCAL_SERVER_KEY_FILE) &&
+        client->received == client->size) {
+      client->completed++;
+    }
+  }
+  return NULL;
+}
+
+// Clients differ in transport, window and block size, and their images
+// differ in size and content so a block delivered to the wrong client shows
+static bool setup_client(test_client_t *client, int index) {
+  client->size = BASE_SIZE + index * 12345;
+  client->image = malloc(client->size);
+  if (!client->image) {
+    return false;
+  }
+  for (size_t i = 0; i < client->size; i++) {
+    client->image[i] = (i * (index * 2 + 3)) ^ (i >> 9) ^ index;
+  }
+  snprintf(client->path, sizeof(client->path), "/images/client%d.bin", index);
+
+  coap_download_config_init(&client->config);
+  coap_set_download_transport(&client->config,
+                              index % 2 ? COAP_PROTO_DTLS : COAP_PROTO_TLS);
+  coap_set_download_window(&client->config, 1 + index % DOWNLOAD_MAX_WINDOW);
+  coap_set_download_block_size(&client->config, 256 << (index % 6));
+  coap_set_download_stats(&client->config, &client->stats);
+  return true;
+}
+
+int main(void) {
+  coap_startup();
+  coap_dtls_set_log_level(LOG_WARNING);
+  coap_set_log_level(LOG_WARNING);
+
+  local_server_t server;
+  memset(&server, 0, sizeof(server));
+  for (int i = 0; i < CLIENTS; i++) {
+    if (!setup_client(&clients[i], i) ||
+        !local_server_add_image(&server, clients[i].path, clients[i].image,
+                                clients[i].size)) {
+      return 1;
+    }
+  }
+  if (!local_server_start(&server)) {
+    return 1;
+  }
+
+  pthread_t threads[CLIENTS];
+  for (int i = 0; i < CLIENTS; i++) {
+    if (pthread_create(&threads[i], NULL, run_client, &clients[i]) != 0) {
+      printf("**** Could not start client %d\n", i);
+      return 1;
+    }
+  }
+  for (int i = 0; i < CLIENTS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  local_server_stop(&server);
+
+  int failures = 0;
+  for (int i = 0; i < CLIENTS; i++) {
+    test_client_t *client = &clients[i];
+    if (client->completed != ROUNDS || client->foreign_blocks > 0 ||
+        client->corrupt_blocks > 0 ||
+        client->stats.bytes < ROUNDS * client->size ||
+        client->state.download || client->state.session) {
+      printf("FAIL client %d: %d of %d downloads, %d foreign and %d corrupt "
+             "blocks, %u bytes\n",
+             i, client->completed, ROUNDS, client->foreign_blocks,
+             client->corrupt_blocks, client->stats.bytes);
+      failures++;
+    }
+    free(client->image);
+  }
+  coap_cleanup();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
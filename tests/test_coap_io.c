@@ -0,0 +1,207 @@
+// Tests for running a download from an external event loop with coap_io.
+// The download is driven with poll() on coap_io_fd and the coap_io deadline
+// against the local server, and must deliver the same image as a download
+// driven by coap_run_once. Run with make test.
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap.h"
+#include "coap_io.h"
+#include "download.h"
+#include "local_server.h"
+
+#define IMAGE_SIZE (512 * 1024 + 123)
+#define IMAGE_PATH "/images/io.bin"
+#define WINDOW 4
+// poll may return a little after the timeout
+#define TIMEOUT_SLACK_MS 50
+#define TEST_TIMEOUT_S 60
+
+typedef struct {
+  uint8_t *data;
+  size_t received;
+  bool done;
+  bool ok;
+} received_image_t;
+
+static const uint8_t *image;
+static int failures = 0;
+
+static void fail(const char *name, const char *what) {
+  printf("FAIL %s: %s\n", name, what);
+  failures++;
+}
+
+static bool store_block(void *user_data, int block_num, size_t block_size,
+                        uint8_t *buf, size_t len, uint32_t max_size) {
+  received_image_t *received = user_data;
+  size_t offset = (size_t)block_num * block_size;
+  if (offset + len > IMAGE_SIZE) {
+    return false;
+  }
+  memcpy(received->data + offset, buf, len);
+  received->received = offset + len;
+  return true;
+}
+
+static void download_done(void *user_data, bool ok) {
+  received_image_t *received = user_data;
+  received->done = true;
+  received->ok = ok;
+}
+
+static double now_ms(void) {
+  coap_tick_t now;
+  coap_ticks(&now);
+  return now * 1000.0 / COAP_TICKS_PER_SECOND;
+}
+
+// Run the download with poll() the way an application's event loop would
+static void download_with_poll(const char *name, coap_proto_t proto,
+                               const download_config_t *config,
+                               received_image_t *received) {
+  coap_context_t *ctx = coap_new_context(NULL);
+  coap_state_t state;
+  memset(&state, 0, sizeof(state));
+  if (!ctx || !coap_connect_context(&state, ctx, "127.0.0.1",
+                                    LOCAL_SERVER_PORT, proto,
+                                    LOCAL_SERVER_CERT_FILE,
+                                    LOCAL_SERVER_KEY_FILE)) {
+    fail(name, "could not connect");
+    if (ctx) {
+      coap_free_context(ctx);
+    }
+    return;
+  }
+  coap_register_handlers(&state);
+  coap_set_download_config(&state, config);
+  download_options_t options;
+  coap_download_default_options(&state, &options, store_block, received);
+  options.done_callback = download_done;
+  download_t *dl = coap_download_start(&state, IMAGE_PATH, &options);
+  if (!dl) {
+    fail(name, "could not start the download");
+  } else {
+    coap_io_advance(&state);
+  }
+
+  double end = now_ms() + TEST_TIMEOUT_S * 1000;
+  while (dl && !received->done && now_ms() < end) {
+    int fd = coap_io_fd(&state);
+    int timeout = coap_io_timeout_ms(&state);
+    if (fd < 0) {
+      fail(name, "no socket to watch");
+      break;
+    }
+    // A running download always has a deadline for its timeouts
+    if (timeout < 0) {
+      fail(name, "no deadline while the download runs");
+      break;
+    }
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN | (coap_io_wants_write(&state) ? POLLOUT : 0),
+    };
+    double start = now_ms();
+    int n = poll(&pfd, 1, timeout);
+    if (n < 0) {
+      fail(name, "poll failed");
+      break;
+    }
+    if (n == 0) {
+      if (now_ms() - start > timeout + TIMEOUT_SLACK_MS) {
+        fail(name, "poll overran the deadline");
+      }
+      coap_io_advance(&state);
+    } else {
+      coap_io_process(&state, pfd.revents & (POLLIN | POLLERR | POLLHUP),
+                      pfd.revents & POLLOUT);
+    }
+  }
+  if (!received->done) {
+    fail(name, "download did not finish");
+  }
+  if (dl) {
+    coap_download_free(dl);
+  }
+  coap_disconnect(&state);
+  coap_free_context(ctx);
+}
+
+// The same download with libcoap's own loop
+static void download_with_run_once(const char *name, coap_proto_t proto,
+                                   const download_config_t *config,
+                                   received_image_t *received) {
+  coap_state_t state;
+  memset(&state, 0, sizeof(state));
+  coap_set_download_config(&state, config);
+  received->ok = coap_download_firmware(
+      &state, "127.0.0.1", LOCAL_SERVER_PORT, IMAGE_PATH, store_block,
+      received, LOCAL_SERVER_CERT_FILE, LOCAL_SERVER_KEY_FILE);
+  received->done = true;
+  if (!received->ok) {
+    fail(name, "coap_run_once download failed");
+  }
+}
+
+static void check_transport(const char *name, coap_proto_t proto) {
+  download_config_t config;
+  coap_download_config_init(&config);
+  coap_set_download_transport(&config, proto);
+  coap_set_download_window(&config, WINDOW);
+
+  received_image_t polled = {.data = calloc(1, IMAGE_SIZE)};
+  received_image_t run_once = {.data = calloc(1, IMAGE_SIZE)};
+  if (!polled.data || !run_once.data) {
+    fail(name, "out of memory");
+  } else {
+    download_with_poll(name, proto, &config, &polled);
+    download_with_run_once(name, proto, &config, &run_once);
+    if (!polled.ok || polled.received != IMAGE_SIZE ||
+        memcmp(polled.data, image, IMAGE_SIZE) != 0) {
+      fail(name, "poll download delivered the wrong image");
+    }
+    if (run_once.received != polled.received ||
+        memcmp(run_once.data, polled.data, IMAGE_SIZE) != 0) {
+      fail(name, "poll and coap_run_once downloads differ");
+    }
+  }
+  free(polled.data);
+  free(run_once.data);
+}
+
+int main(void) {
+  uint8_t *data = malloc(IMAGE_SIZE);
+  if (!data) {
+    return 1;
+  }
+  for (size_t i = 0; i < IMAGE_SIZE; i++) {
+    data[i] = (i * 7) ^ (i >> 11);
+  }
+  image = data;
+
+  coap_startup();
+  coap_dtls_set_log_level(LOG_WARNING);
+  coap_set_log_level(LOG_WARNING);
+  local_server_t server;
+  memset(&server, 0, sizeof(server));
+  if (!local_server_add_image(&server, IMAGE_PATH, data, IMAGE_SIZE) ||
+      !local_server_start(&server)) {
+    return 1;
+  }
+
+  check_transport("DTLS", COAP_PROTO_DTLS);
+  check_transport("TLS", COAP_PROTO_TLS);
+
+  local_server_stop(&server);
+  coap_cleanup();
+  free(data);
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,37 @@
+// Tests for the CoAP helpers. Run with make test.
+#include <stdio.h>
+
+#include "coap_util.h"
+
+static int failures = 0;
+
+static void check_uint(const char *name, const uint8_t *data, size_t len,
+                       uint32_t expected) {
+  uint32_t value = uint_opt_value(data, len);
+  if (value != expected) {
+    printf("FAIL %s: got %u, expected %u\n", name, value, expected);
+    failures++;
+  }
+}
+
+// Size2 values of every length the option can have
+static void test_size2(void) {
+  check_uint("empty", NULL, 0, 0);
+  check_uint("1 byte", (const uint8_t[]){0xc8}, 1, 200);
+  check_uint("2 bytes", (const uint8_t[]){0x04, 0x00}, 2, 1024);
+  check_uint("3 bytes", (const uint8_t[]){0x0f, 0x42, 0x40}, 3, 1000000);
+  check_uint("4 bytes", (const uint8_t[]){0x01, 0x00, 0x00, 0x05}, 4,
+             16777221);
+  check_uint("max", (const uint8_t[]){0xff, 0xff, 0xff, 0xff}, 4, 0xffffffff);
+  check_uint("too long", (const uint8_t[]){1, 2, 3, 4, 5}, 5, 0);
+}
+
+int main(void) {
+  test_size2();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
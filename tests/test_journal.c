@@ -0,0 +1,148 @@
+// Tests for the download journal. Run with make test.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+// Layout of the journal file (see journal.c)
+#define PATH_OFFSET 5
+#define SZX_OFFSET (PATH_OFFSET + JOURNAL_MAX_PATH + 4)
+#define BLOCK_COUNT_OFFSET (SZX_OFFSET + 2 + JOURNAL_MAX_ETAG)
+
+static int failures = 0;
+static char file[] = "/tmp/fota-journal-XXXXXX";
+
+static void check(const char *name, bool ok) {
+  if (!ok) {
+    printf("FAIL %s\n", name);
+    failures++;
+  }
+}
+
+static const uint8_t etag[] = {0xde, 0xad, 0xbe, 0xef};
+
+static void save_sample(download_journal_t *journal) {
+  journal_init(journal, file);
+  journal_reset(journal, "/fw/2.1", 100000, 6, etag, sizeof(etag));
+  for (unsigned int i = 0; i < 40; i++) {
+    journal_mark_block(journal, i);
+  }
+  journal_mark_block(journal, 42);
+  check("save", journal_save(journal));
+}
+
+// Overwrite bytes of the saved journal
+static void patch_file(long offset, const void *data, size_t len) {
+  FILE *fp = fopen(file, "r+b");
+  if (!fp) {
+    check("open journal", false);
+    return;
+  }
+  fseek(fp, offset, SEEK_SET);
+  fwrite(data, 1, len, fp);
+  fclose(fp);
+}
+
+static void test_round_trip(void) {
+  download_journal_t saved;
+  save_sample(&saved);
+  download_journal_t loaded;
+  journal_init(&loaded, file);
+  check("load", journal_load(&loaded));
+  check("valid", loaded.valid);
+  check("path", strcmp(loaded.path, "/fw/2.1") == 0);
+  check("size and szx", loaded.size == 100000 && loaded.szx == 6);
+  check("block count", loaded.block_count == 43);
+  check("blocks", memcmp(loaded.blocks, saved.blocks, 6) == 0);
+  check("first missing", journal_first_missing(&loaded) == 40);
+  check("matches",
+        journal_matches(&loaded, "/fw/2.1", 100000, etag, sizeof(etag)));
+  check("other path",
+        !journal_matches(&loaded, "/fw/2.2", 100000, etag, sizeof(etag)));
+  check("other size",
+        !journal_matches(&loaded, "/fw/2.1", 100001, etag, sizeof(etag)));
+  check("other etag", !journal_matches(&loaded, "/fw/2.1", 100000, etag, 3));
+
+  // Saved before the first block arrived
+  journal_reset(&saved, "/fw/2.1", 100000, 4, NULL, 0);
+  check("save empty", journal_save(&saved));
+  check("load empty", journal_load(&loaded) && loaded.block_count == 0 &&
+                          loaded.etag_len == 0 && loaded.szx == 4);
+  check("empty first missing", journal_first_missing(&loaded) == 0);
+
+  journal_remove(&loaded);
+  check("removed", access(file, F_OK) != 0 && !loaded.valid);
+  check("nothing to load", !journal_load(&loaded));
+}
+
+static void test_marking(void) {
+  download_journal_t journal;
+  journal_init(&journal, file);
+  journal_reset(&journal, "/fw", 0, 6, NULL, 0);
+  journal_mark_block(&journal, 1);
+  check("gap at start", journal_first_missing(&journal) == 0);
+  journal_mark_block(&journal, 0);
+  check("gap filled", journal_first_missing(&journal) == 2);
+  journal_mark_block(&journal, JOURNAL_MAX_BLOCKS);
+  check("out of range ignored", journal.block_count == 2);
+  journal_mark_block(&journal, JOURNAL_MAX_BLOCKS - 1);
+  check("last block", journal.block_count == JOURNAL_MAX_BLOCKS);
+
+  char long_path[JOURNAL_MAX_PATH * 2];
+  memset(long_path, 'p', sizeof(long_path) - 1);
+  long_path[sizeof(long_path) - 1] = 0;
+  journal_reset(&journal, long_path, 0, 6, NULL, 0);
+  check("long path terminated",
+        strlen(journal.path) == JOURNAL_MAX_PATH - 1);
+}
+
+// Corrupt journals are ignored and leave the journal invalid
+static void test_invalid(void) {
+  download_journal_t journal;
+
+  save_sample(&journal);
+  uint8_t szx = JOURNAL_MAX_SZX + 1;
+  patch_file(SZX_OFFSET, &szx, 1);
+  check("reject szx", !journal_load(&journal) && !journal.valid);
+
+  save_sample(&journal);
+  char path[JOURNAL_MAX_PATH];
+  memset(path, 'x', sizeof(path));
+  patch_file(PATH_OFFSET, path, sizeof(path));
+  check("reject unterminated path", !journal_load(&journal));
+
+  save_sample(&journal);
+  uint32_t block_count = JOURNAL_MAX_BLOCKS + 1;
+  patch_file(BLOCK_COUNT_OFFSET, &block_count, sizeof(block_count));
+  check("reject block count", !journal_load(&journal));
+
+  save_sample(&journal);
+  check("truncate", truncate(file, BLOCK_COUNT_OFFSET + 5) == 0);
+  check("reject short bitmap", !journal_load(&journal));
+
+  save_sample(&journal);
+  patch_file(0, "XXXX", 4);
+  check("reject magic", !journal_load(&journal));
+  unlink(file);
+}
+
+int main(void) {
+  int fd = mkstemp(file);
+  if (fd < 0) {
+    printf("**** Could not create a temporary file\n");
+    return 1;
+  }
+  close(fd);
+  test_round_trip();
+  test_marking();
+  test_invalid();
+  unlink(file);
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,123 @@
+// Tests for the mirrors in report responses. Run with make test.
+#include <stdio.h>
+#include <string.h>
+
+#include "reporting.h"
+
+// Field IDs in responses (see reporting.c)
+#define HOST_ID 1
+#define PORT_ID 2
+#define MIRROR_ID 9
+
+#define RESPONSE_PORT 5684
+
+static int failures = 0;
+
+static void add_field(uint8_t *buf, size_t *len, uint8_t id,
+                      const void *value, size_t value_len) {
+  buf[(*len)++] = id;
+  buf[(*len)++] = value_len;
+  memcpy(buf + *len, value, value_len);
+  *len += value_len;
+}
+
+// A response from fota.example.com on the response port with the mirrors
+static bool decode_mirrors(const char *const *mirrors, size_t count,
+                           fota_response_t *resp) {
+  uint8_t buf[512];
+  size_t len = 0;
+  uint8_t port[4] = {0, 0, RESPONSE_PORT >> 8, RESPONSE_PORT & 0xff};
+  add_field(buf, &len, HOST_ID, "fota.example.com", 16);
+  add_field(buf, &len, PORT_ID, port, sizeof(port));
+  for (size_t i = 0; i < count; i++) {
+    add_field(buf, &len, MIRROR_ID, mirrors[i], strlen(mirrors[i]));
+  }
+  return fota_decode_response(buf, len, resp);
+}
+
+// A single mirror parses to the host and port, or is dropped when the host
+// is NULL
+static void check_mirror(const char *mirror, const char *host,
+                         uint32_t port) {
+  fota_response_t resp;
+  if (!decode_mirrors(&mirror, 1, &resp)) {
+    printf("FAIL %s: response rejected\n", mirror);
+    failures++;
+  } else if (!host) {
+    if (resp.mirror_count != 0) {
+      printf("FAIL %s: should be dropped\n", mirror);
+      failures++;
+    }
+  } else if (resp.mirror_count != 1 ||
+             strcmp((const char *)resp.mirrors[0].hostname, host) != 0 ||
+             resp.mirrors[0].port != port) {
+    printf("FAIL %s: got %zu mirror(s), %s port %u\n", mirror,
+           resp.mirror_count,
+           resp.mirror_count ? (const char *)resp.mirrors[0].hostname : "",
+           resp.mirror_count ? resp.mirrors[0].port : 0);
+    failures++;
+  }
+}
+
+static void test_hosts(void) {
+  check_mirror("mirror.example.com:5685", "mirror.example.com", 5685);
+  check_mirror("mirror.example.com", "mirror.example.com", RESPONSE_PORT);
+  check_mirror("10.0.0.1:1", "10.0.0.1", 1);
+  check_mirror("10.0.0.1:65535", "10.0.0.1", 65535);
+  check_mirror("[2001:db8::1]:5690", "2001:db8::1", 5690);
+  check_mirror("[2001:db8::1]", "2001:db8::1", RESPONSE_PORT);
+  // Without brackets an IPv6 address has no port
+  check_mirror("2001:db8::1", "2001:db8::1", RESPONSE_PORT);
+}
+
+static void test_bad_mirrors(void) {
+  check_mirror("mirror.example.com:0", NULL, 0);
+  check_mirror("mirror.example.com:65536", NULL, 0);
+  check_mirror("mirror.example.com:99999999999", NULL, 0);
+  check_mirror("mirror.example.com:", NULL, 0);
+  check_mirror("mirror.example.com:56a", NULL, 0);
+  check_mirror("[2001:db8::1", NULL, 0);
+  check_mirror("[2001:db8::1]5690", NULL, 0);
+  check_mirror("", NULL, 0);
+  // The host doesn't fit in the response even though the field does
+  check_mirror("mirror-0123456789-abcdefghij.com", NULL, 0);
+
+  // A field longer than a host and port makes the response invalid
+  const char *mirror = "a-host-name-that-is-far-too-long.example.com";
+  fota_response_t resp;
+  if (decode_mirrors(&mirror, 1, &resp)) {
+    printf("FAIL %s: response accepted\n", mirror);
+    failures++;
+  }
+}
+
+// Mirrors past the first FOTA_MAX_MIRRORS fields are ignored. A mirror that
+// is dropped leaves no gap in the parsed mirrors.
+static void test_count(void) {
+  const char *mirrors[] = {"m1", "bad:0", "m2", "m3", "m4", "m5"};
+  fota_response_t resp;
+  if (!decode_mirrors(mirrors, 6, &resp) || resp.mirror_count != 3 ||
+      strcmp((const char *)resp.mirrors[1].hostname, "m2") != 0 ||
+      strcmp((const char *)resp.mirrors[2].hostname, "m3") != 0) {
+    printf("FAIL mirror count: got %zu\n", resp.mirror_count);
+    failures++;
+  }
+  const char *too_many[] = {"m1", "m2", "m3", "m4", "m5", "m6"};
+  if (!decode_mirrors(too_many, 6, &resp) ||
+      resp.mirror_count != FOTA_MAX_MIRRORS) {
+    printf("FAIL too many mirrors: got %zu\n", resp.mirror_count);
+    failures++;
+  }
+}
+
+int main(void) {
+  test_hosts();
+  test_bad_mirrors();
+  test_count();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,144 @@
+// Tests for the download pacer. Run with make test.
+//
+// The pacer reads the clock itself. Time passing is simulated by moving the
+// last refill and start times back, and windows are placed around the
+// current time of day.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pacer.h"
+
+static int failures = 0;
+
+static void check(const char *name, bool ok) {
+  if (!ok) {
+    printf("FAIL %s\n", name);
+    failures++;
+  }
+}
+
+static void check_range(const char *name, uint64_t value, uint64_t min,
+                        uint64_t max) {
+  if (value < min || value > max) {
+    printf("FAIL %s: got %llu, expected %llu to %llu\n", name,
+           (unsigned long long)value, (unsigned long long)min,
+           (unsigned long long)max);
+    failures++;
+  }
+}
+
+static void elapse(pacer_t *pacer, uint64_t ms) {
+  pacer->last_ms -= ms;
+  if (pacer->start_ms > 0) {
+    pacer->start_ms -= ms;
+  }
+}
+
+static uint32_t seconds_of_day(void) {
+  return time(NULL) % PACER_SECONDS_PER_DAY;
+}
+
+static void test_parse_window(void) {
+  pacer_window_t window;
+  check("parse day window", pacer_parse_window("08:30-17:45", &window) &&
+                                window.start == 30600 &&
+                                window.length == 33300);
+  check("parse night window", pacer_parse_window("22:00-02:00", &window) &&
+                                  window.start == 79200 &&
+                                  window.length == 14400);
+  check("parse all day", pacer_parse_window("10:00-10:00", &window) &&
+                             window.length == PACER_SECONDS_PER_DAY);
+  check("reject hour", !pacer_parse_window("24:00-01:00", &window));
+  check("reject minute", !pacer_parse_window("01:60-02:00", &window));
+  check("reject trailing", !pacer_parse_window("01:00-02:00x", &window));
+  check("reject text", !pacer_parse_window("night", &window));
+}
+
+// Requests go out while the bucket has tokens. Then the pacer waits for a
+// full bucket so the next requests go out as one burst.
+static void test_bucket(void) {
+  pacer_config_t config = {.rate = 1000, .burst = 4000};
+  pacer_t pacer;
+  pacer_init(&pacer, &config);
+  for (int i = 0; i < 3; i++) {
+    check("burst request", pacer_delay_ms(&pacer, 1024) == 0);
+    pacer_consume(&pacer, 1024);
+  }
+  check_range("wait for full bucket", pacer_delay_ms(&pacer, 1024), 3060,
+              3072);
+  elapse(&pacer, 1000);
+  check_range("still refilling", pacer_delay_ms(&pacer, 1024), 2060, 2072);
+  elapse(&pacer, 2100);
+  check("full bucket", pacer_delay_ms(&pacer, 1024) == 0);
+
+  pacer_stats_t stats;
+  pacer_get_stats(&pacer, &stats);
+  check("bursts", stats.bursts == 2);
+  check("bytes", stats.bytes == 3 * 1024);
+  check("configured rate", stats.configured_rate == 1000);
+  check_range("achieved rate", stats.achieved_rate, 980, 992);
+  check("no pauses", stats.pauses == 0 && stats.paused_ms == 0);
+}
+
+// A request larger than the bucket waits for a full bucket and leaves it in
+// debt. A burst of 0 is one second at the rate.
+static void test_large_request(void) {
+  pacer_config_t config = {.rate = 1000};
+  pacer_t pacer;
+  pacer_init(&pacer, &config);
+  check("default burst", pacer.config.burst == 1000);
+  check("large request", pacer_delay_ms(&pacer, 5000) == 0);
+  pacer_consume(&pacer, 5000);
+  check_range("debt", pacer_delay_ms(&pacer, 100), 4990, 5000);
+}
+
+static void test_unlimited(void) {
+  pacer_config_t config = {0};
+  pacer_t pacer;
+  pacer_init(&pacer, &config);
+  for (int i = 0; i < 100; i++) {
+    pacer_consume(&pacer, 1 << 20);
+  }
+  check("unlimited", pacer_delay_ms(&pacer, 1 << 20) == 0);
+}
+
+// Outside the windows nothing is sent until the next window opens
+static void test_windows(void) {
+  uint32_t now = seconds_of_day();
+  pacer_config_t config = {.window_count = 2};
+  // One window opens in an hour and another in two hours
+  config.windows[0] = (pacer_window_t){(now + 7200) % PACER_SECONDS_PER_DAY,
+                                       600};
+  config.windows[1] = (pacer_window_t){(now + 3600) % PACER_SECONDS_PER_DAY,
+                                       600};
+  pacer_t pacer;
+  pacer_init(&pacer, &config);
+  check_range("closed", pacer_delay_ms(&pacer, 1024), 3598000, 3600000);
+  check("paused", pacer_is_paused(&pacer));
+  pacer_delay_ms(&pacer, 1024);
+  check("one pause", pacer.pauses == 1);
+
+  // A window open now, running past midnight when now is late in the day
+  config.windows[1] =
+      (pacer_window_t){(now + PACER_SECONDS_PER_DAY - 60) %
+                           PACER_SECONDS_PER_DAY,
+                       120};
+  pacer_init(&pacer, &config);
+  check("open", pacer_delay_ms(&pacer, 1024) == 0);
+  check("not paused", !pacer_is_paused(&pacer));
+}
+
+int main(void) {
+  test_parse_window();
+  test_bucket();
+  test_large_request();
+  test_unlimited();
+  test_windows();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,197 @@
+// Tests for the report and response codec. Run with make test.
+#include <stdio.h>
+#include <string.h>
+
+#include "image_hash.h"
+#include "reporting.h"
+
+// Field IDs (see reporting.c)
+#define FIRMWARE_VER_ID 1
+#define MODEL_NUMBER_ID 2
+#define SERIAL_NUMBER_ID 3
+#define CLIENT_MANUFACTURER_ID 4
+#define IMAGE_HASH_ID 5
+#define DELTA_SUPPORT_ID 6
+
+#define HOST_ID 1
+#define PORT_ID 2
+#define PATH_ID 3
+#define AVAILABLE_ID 4
+#define PATCH_PATH_ID 5
+#define COMPRESSED_ID 6
+#define NEW_IMAGE_HASH_ID 7
+#define MANIFEST_PATH_ID 8
+
+#define HOSTNAME_SIZE sizeof(((fota_response_t *)0)->hostname)
+#define PATH_SIZE sizeof(((fota_response_t *)0)->path)
+
+static int failures = 0;
+
+static void check(const char *name, bool ok) {
+  if (!ok) {
+    printf("FAIL %s\n", name);
+    failures++;
+  }
+}
+
+static void add_field(uint8_t *buf, size_t *len, uint8_t id,
+                      const void *value, size_t value_len) {
+  buf[(*len)++] = id;
+  buf[(*len)++] = value_len;
+  memcpy(buf + *len, value, value_len);
+  *len += value_len;
+}
+
+static void add_string(uint8_t *buf, size_t *len, uint8_t id,
+                       const char *value) {
+  add_field(buf, len, id, value, strlen(value));
+}
+
+// Fields are encoded in schema order. Missing strings and false flags are
+// left out.
+static void test_encode(void) {
+  uint8_t hash[IMAGE_HASH_SIZE];
+  memset(hash, 0x42, sizeof(hash));
+  fota_report_t report = {
+      .version = (uint8_t *)"1.0",
+      .manufacturer = (uint8_t *)"acme",
+      .serial = (uint8_t *)"42",
+      .model = (uint8_t *)"m1",
+      .image_hash = hash,
+      .delta_support = true,
+  };
+  uint8_t expected[128];
+  size_t expected_len = 0;
+  add_string(expected, &expected_len, FIRMWARE_VER_ID, "1.0");
+  add_string(expected, &expected_len, CLIENT_MANUFACTURER_ID, "acme");
+  add_string(expected, &expected_len, SERIAL_NUMBER_ID, "42");
+  add_string(expected, &expected_len, MODEL_NUMBER_ID, "m1");
+  add_field(expected, &expected_len, IMAGE_HASH_ID, hash, sizeof(hash));
+  add_field(expected, &expected_len, DELTA_SUPPORT_ID, "\x01", 1);
+
+  uint8_t buf[128];
+  size_t len = 0;
+  check("encode", fota_encode_report(&report, buf, sizeof(buf), &len));
+  check("encoded bytes",
+        len == expected_len && memcmp(buf, expected, len) == 0);
+  check("exact fit", fota_encode_report(&report, buf, expected_len, &len) &&
+                         len == expected_len);
+  check("too small", !fota_encode_report(&report, buf, expected_len - 1, &len));
+
+  fota_report_t sparse = {.version = (uint8_t *)"1.0"};
+  check("sparse", fota_encode_report(&sparse, buf, sizeof(buf), &len) &&
+                      len == 5 && buf[0] == FIRMWARE_VER_ID);
+
+  char long_version[300];
+  memset(long_version, 'v', sizeof(long_version) - 1);
+  long_version[sizeof(long_version) - 1] = 0;
+  fota_report_t too_long = {.version = (uint8_t *)long_version};
+  uint8_t big[512];
+  check("string too long",
+        !fota_encode_report(&too_long, big, sizeof(big), &len));
+  long_version[255] = 0;
+  check("longest string",
+        fota_encode_report(&too_long, big, sizeof(big), &len) && len == 257);
+}
+
+static size_t full_response(uint8_t *buf, uint8_t *hash) {
+  size_t len = 0;
+  uint8_t port[4] = {0, 0, 0x16, 0x34};
+  memset(hash, 0xab, IMAGE_HASH_SIZE);
+  add_field(buf, &len, AVAILABLE_ID, "\x01", 1);
+  add_string(buf, &len, HOST_ID, "fota.example.com");
+  add_field(buf, &len, PORT_ID, port, sizeof(port));
+  add_string(buf, &len, PATH_ID, "/fw/2.1");
+  add_string(buf, &len, PATCH_PATH_ID, "/fw/patch");
+  add_field(buf, &len, COMPRESSED_ID, "\x01", 1);
+  add_field(buf, &len, NEW_IMAGE_HASH_ID, hash, IMAGE_HASH_SIZE);
+  add_string(buf, &len, MANIFEST_PATH_ID, "/fw/manifest");
+  return len;
+}
+
+// The view points into the buffer. The copy is NUL terminated.
+static void test_decode(void) {
+  uint8_t buf[256];
+  uint8_t hash[IMAGE_HASH_SIZE];
+  size_t len = full_response(buf, hash);
+
+  fota_response_view_t view;
+  check("decode view", fota_decode_response_view(buf, len, &view));
+  check("view flags", view.has_new_version && view.compressed);
+  check("view port", view.port == 5684);
+  check("view is zero copy", view.hostname.data == buf + 5 &&
+                                 view.hostname.len == 16);
+  check("view hash", view.image_hash.len == IMAGE_HASH_SIZE &&
+                         memcmp(view.image_hash.data, hash,
+                                IMAGE_HASH_SIZE) == 0);
+
+  fota_response_t resp;
+  check("decode", fota_decode_response(buf, len, &resp));
+  check("hostname", strcmp((char *)resp.hostname, "fota.example.com") == 0);
+  check("path", strcmp((char *)resp.path, "/fw/2.1") == 0);
+  check("patch", resp.has_patch &&
+                     strcmp((char *)resp.patch_path, "/fw/patch") == 0);
+  check("manifest", resp.has_manifest &&
+                        strcmp((char *)resp.manifest_path, "/fw/manifest") ==
+                            0);
+  check("hash", resp.has_image_hash &&
+                    memcmp(resp.image_hash, hash, IMAGE_HASH_SIZE) == 0);
+  check("no mirrors", resp.mirror_count == 0);
+
+  // Fields that aren't sent are empty
+  check("empty response", fota_decode_response(buf, 0, &resp));
+  check("empty fields", !resp.has_new_version && !resp.has_patch &&
+                            !resp.has_manifest && !resp.has_image_hash &&
+                            resp.hostname[0] == 0 && resp.port == 0);
+}
+
+static bool decodes(const uint8_t *buf, size_t len) {
+  fota_response_t resp;
+  return fota_decode_response(buf, len, &resp);
+}
+
+// Every field is checked against the schema before it is used
+static void test_decode_limits(void) {
+  uint8_t buf[256];
+  size_t len;
+  char text[64];
+  memset(text, 'h', sizeof(text));
+
+  len = 0;
+  add_field(buf, &len, HOST_ID, text, HOSTNAME_SIZE - 1);
+  check("longest hostname", decodes(buf, len));
+  len = 0;
+  add_field(buf, &len, HOST_ID, text, HOSTNAME_SIZE);
+  check("hostname too long", !decodes(buf, len));
+  len = 0;
+  add_field(buf, &len, PATH_ID, text, PATH_SIZE);
+  check("path too long", !decodes(buf, len));
+  len = 0;
+  add_field(buf, &len, PORT_ID, "\x16\x34", 2);
+  check("short port", !decodes(buf, len));
+  len = 0;
+  add_field(buf, &len, AVAILABLE_ID, "\x01\x01", 2);
+  check("long bool", !decodes(buf, len));
+  len = 0;
+  add_field(buf, &len, NEW_IMAGE_HASH_ID, text, IMAGE_HASH_SIZE - 1);
+  check("short hash", !decodes(buf, len));
+  len = 0;
+  add_field(buf, &len, 99, "x", 1);
+  check("unknown field", !decodes(buf, len));
+  len = 0;
+  add_string(buf, &len, HOST_ID, "host");
+  check("truncated value", !decodes(buf, len - 1));
+  check("truncated header", !decodes(buf, 1));
+}
+
+int main(void) {
+  test_encode();
+  test_decode();
+  test_decode_limits();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,119 @@
+// Tests for the block request template. Run with make test.
+//
+// malloc and friends are replaced for the whole process (libcoap included)
+// to count allocations. Building a request from the template must not
+// allocate anything once the PDU is allocated.
+#include <stdio.h>
+#include <string.h>
+
+#include "request_template.h"
+
+// glibc's allocator under the names it exports for this
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+static int allocations = 0;
+static int failures = 0;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+static void fail(const char *name, const char *what, unsigned int block) {
+  printf("FAIL %s block %u: %s\n", name, block, what);
+  failures++;
+}
+
+// The option numbers in the request in order
+static size_t option_numbers(coap_pdu_t *pdu, uint16_t *numbers, size_t max) {
+  coap_opt_iterator_t it;
+  coap_option_iterator_init(pdu, &it, COAP_OPT_ALL);
+  size_t count = 0;
+  while (count < max && coap_option_next(&it)) {
+    numbers[count++] = it.type;
+  }
+  return count;
+}
+
+static void check_requests(const char *name, const char *path,
+                           const char *proxy_uri, const uint16_t *expected,
+                           size_t expected_count) {
+  request_template_t request;
+  if (!request_template_init(&request, path, proxy_uri)) {
+    fail(name, "template not built", 0);
+    return;
+  }
+  uint8_t previous[REQUEST_TEMPLATE_TOKEN_SIZE] = {0};
+  for (unsigned int block = 0; block < 64; block++) {
+    coap_pdu_t *pdu = coap_pdu_init(COAP_MESSAGE_NON, COAP_REQUEST_GET, block,
+                                    request.pdu_size);
+    if (!pdu) {
+      fail(name, "no PDU", block);
+      return;
+    }
+    // The PDU is the one allocation per request. The first block warms up.
+    int before = allocations;
+    uint8_t token[REQUEST_TEMPLATE_TOKEN_SIZE];
+    request_template_next_token(&request, token);
+    request_template_apply(&request, pdu, token, block, 6);
+    if (block > 0 && allocations != before) {
+      fail(name, "allocated while building the request", block);
+    }
+
+    if (pdu->token_length != sizeof(token) ||
+        memcmp(pdu->token, token, sizeof(token)) != 0) {
+      fail(name, "wrong token", block);
+    }
+    if (memcmp(token, previous, sizeof(token)) == 0) {
+      fail(name, "token repeated", block);
+    }
+    memcpy(previous, token, sizeof(token));
+    coap_block_t block2;
+    if (!coap_get_block(pdu, COAP_OPTION_BLOCK2, &block2) ||
+        block2.num != block || block2.szx != 6) {
+      fail(name, "wrong Block2 option", block);
+    }
+    uint16_t numbers[REQUEST_TEMPLATE_MAX_OPTIONS + 1];
+    size_t count = option_numbers(pdu, numbers,
+                                  sizeof(numbers) / sizeof(numbers[0]));
+    if (count != expected_count ||
+        memcmp(numbers, expected, count * sizeof(uint16_t)) != 0) {
+      fail(name, "wrong options", block);
+    }
+    coap_delete_pdu(pdu);
+  }
+}
+
+int main(void) {
+  coap_startup();
+  check_requests("path", "/fw/images/device.bin", NULL,
+                 (const uint16_t[]){COAP_OPTION_URI_PATH, COAP_OPTION_URI_PATH,
+                                    COAP_OPTION_URI_PATH, COAP_OPTION_BLOCK2},
+                 4);
+  check_requests("proxy", "/fw/images/device.bin",
+                 "coaps://fota.example.com:5684/fw/images/device.bin",
+                 (const uint16_t[]){COAP_OPTION_BLOCK2, COAP_OPTION_PROXY_URI},
+                 2);
+  coap_cleanup();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,179 @@
+// Tests for the order of resolved addresses. Run with make test.
+//
+// Hosts are put in the disk cache with an expiry in the future so they are
+// never looked up in DNS.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resolve.h"
+
+static int failures = 0;
+static char dir[] = "/tmp/fota-resolve-XXXXXX";
+
+static void check(const char *name, bool ok) {
+  if (!ok) {
+    printf("FAIL %s\n", name);
+    failures++;
+  }
+}
+
+static void write_cache(const char *host, const char *const *addrs,
+                        size_t count) {
+  char file[256];
+  snprintf(file, sizeof(file), "%s/%s.dns", dir, host);
+  FILE *fp = fopen(file, "w");
+  if (!fp) {
+    check("write cache", false);
+    return;
+  }
+  fprintf(fp, "%lld\n", (long long)time(NULL) + 3600);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(fp, "%s\n", addrs[i]);
+  }
+  fclose(fp);
+}
+
+static void format(const struct sockaddr_storage *addr, char *str,
+                   size_t len) {
+  const void *src =
+      addr->ss_family == AF_INET6
+          ? (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr
+          : (const void *)&((const struct sockaddr_in *)addr)->sin_addr;
+  if (!inet_ntop(addr->ss_family, src, str, len)) {
+    str[0] = 0;
+  }
+}
+
+static int port_of(const struct sockaddr_storage *addr) {
+  return ntohs(addr->ss_family == AF_INET6
+                   ? ((const struct sockaddr_in6 *)addr)->sin6_port
+                   : ((const struct sockaddr_in *)addr)->sin_port);
+}
+
+// Resolve the host and compare the addresses in order
+static void check_order(const char *name, const char *host,
+                        const char *const *expected, size_t count) {
+  resolve_result_t result;
+  if (!resolve_host(host, 5684, &result)) {
+    printf("FAIL %s: not resolved\n", name);
+    failures++;
+    return;
+  }
+  bool ok = result.count == count;
+  for (size_t i = 0; ok && i < count; i++) {
+    char str[INET6_ADDRSTRLEN];
+    format(&result.addrs[i], str, sizeof(str));
+    ok = strcmp(str, expected[i]) == 0 && port_of(&result.addrs[i]) == 5684;
+  }
+  if (!ok) {
+    printf("FAIL %s: got", name);
+    for (size_t i = 0; i < result.count; i++) {
+      char str[INET6_ADDRSTRLEN];
+      format(&result.addrs[i], str, sizeof(str));
+      printf(" %s:%d", str, port_of(&result.addrs[i]));
+    }
+    printf("\n");
+    failures++;
+  }
+}
+
+static void prefer(const char *host, const char *addr) {
+  struct sockaddr_storage ss;
+  memset(&ss, 0, sizeof(ss));
+  if (inet_pton(AF_INET6, addr,
+                &((struct sockaddr_in6 *)&ss)->sin6_addr) == 1) {
+    ss.ss_family = AF_INET6;
+  } else {
+    inet_pton(AF_INET, addr, &((struct sockaddr_in *)&ss)->sin_addr);
+    ss.ss_family = AF_INET;
+  }
+  resolve_prefer(host, (struct sockaddr *)&ss);
+}
+
+// IPv6 comes first until IPv4 connects. The order sticks in the cache file.
+static void test_prefer(void) {
+  const char *addrs[] = {"2001:db8::1", "2001:db8::2", "192.0.2.1",
+                         "192.0.2.2"};
+  write_cache("dual.test", addrs, 4);
+  check_order("cached order", "dual.test", addrs, 4);
+
+  prefer("dual.test", "192.0.2.2");
+  const char *ipv4_first[] = {"192.0.2.1", "192.0.2.2", "2001:db8::1",
+                              "2001:db8::2"};
+  check_order("IPv4 preferred", "dual.test", ipv4_first, 4);
+
+  char file[256];
+  snprintf(file, sizeof(file), "%s/dual.test.dns", dir);
+  FILE *fp = fopen(file, "r");
+  char line[64] = "";
+  if (fp) {
+    fgets(line, sizeof(line), fp);
+    fgets(line, sizeof(line), fp);
+    fclose(fp);
+  }
+  check("preference saved", strcmp(line, "192.0.2.1\n") == 0);
+
+  prefer("dual.test", "2001:db8::2");
+  check_order("IPv6 preferred again", "dual.test", addrs, 4);
+}
+
+// The family listed first in the cache file is the preferred one
+static void test_loaded_preference(void) {
+  const char *addrs[] = {"192.0.2.9", "2001:db8::9"};
+  write_cache("ipv4.test", addrs, 2);
+  check_order("IPv4 first from cache", "ipv4.test", addrs, 2);
+}
+
+// Each family keeps room for the other so both can be raced
+static void test_family_cap(void) {
+  const char *many_ipv6[] = {"2001:db8::1", "2001:db8::2", "2001:db8::3",
+                             "2001:db8::4", "192.0.2.1"};
+  write_cache("ipv6.test", many_ipv6, 5);
+  const char *capped_ipv6[] = {"2001:db8::1", "2001:db8::2", "192.0.2.1"};
+  check_order("IPv6 capped", "ipv6.test", capped_ipv6, 3);
+
+  const char *many_ipv4[] = {"192.0.2.1", "192.0.2.2", "192.0.2.3",
+                             "2001:db8::1", "2001:db8::2", "2001:db8::3"};
+  write_cache("many.test", many_ipv4, 6);
+  const char *capped[] = {"192.0.2.1", "192.0.2.2", "2001:db8::1",
+                          "2001:db8::2"};
+  check_order("both capped", "many.test", capped, 4);
+}
+
+static void test_literals(void) {
+  const char *ipv6[] = {"2001:db8::5"};
+  check_order("IPv6 literal", "2001:db8::5", ipv6, 1);
+  const char *ipv4[] = {"192.0.2.5"};
+  check_order("IPv4 literal", "192.0.2.5", ipv4, 1);
+}
+
+int main(void) {
+  if (!mkdtemp(dir)) {
+    printf("**** Could not create a temporary directory\n");
+    return 1;
+  }
+  resolve_set_cache_dir(dir);
+  test_prefer();
+  test_loaded_preference();
+  test_family_cap();
+  test_literals();
+
+  const char *hosts[] = {"dual.test", "ipv4.test", "ipv6.test", "many.test"};
+  for (size_t i = 0; i < sizeof(hosts) / sizeof(hosts[0]); i++) {
+    char file[256];
+    snprintf(file, sizeof(file), "%s/%s.dns", dir, hosts[i]);
+    unlink(file);
+  }
+  rmdir(dir);
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
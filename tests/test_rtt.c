@@ -0,0 +1,117 @@
+// Tests for the RTT estimator. Run with make test.
+#include <stdio.h>
+
+#include "rtt.h"
+
+static int failures = 0;
+
+static void check(const char *name, uint32_t value, uint32_t expected) {
+  if (value != expected) {
+    printf("FAIL %s: got %u, expected %u\n", name, value, expected);
+    failures++;
+  }
+}
+
+// Strong samples follow RFC 6298 and pull the timeout halfway to their
+// estimate
+static void test_strong_samples(void) {
+  rtt_estimator_t rtt;
+  rtt_init(&rtt);
+  check("initial rto", rtt.rto_ms, RTT_INITIAL_RTO_MS);
+
+  rtt_update(&rtt, 100, 0);
+  check("first srtt", rtt.strong.srtt_ms, 100);
+  check("first rttvar", rtt.strong.rttvar_ms, 50);
+  check("first strong rto", rtt.strong.rto_ms, 300);
+  check("first rto", rtt.rto_ms, 1150);
+  check("last rtt", rtt.last_rtt_ms, 100);
+
+  rtt_update(&rtt, 100, 0);
+  check("second rttvar", rtt.strong.rttvar_ms, 37);
+  check("second strong rto", rtt.strong.rto_ms, 248);
+  check("second rto", rtt.rto_ms, 699);
+  check("strong samples", rtt.strong.samples, 2);
+  check("weak samples", rtt.weak.samples, 0);
+}
+
+// Weak samples have their own estimate and move the timeout a quarter of the
+// way. Samples after too many retransmits are dropped.
+static void test_weak_samples(void) {
+  rtt_estimator_t rtt;
+  rtt_init(&rtt);
+  rtt_update(&rtt, 400, 1);
+  check("weak srtt", rtt.weak.srtt_ms, 400);
+  check("weak rto", rtt.weak.rto_ms, 600);
+  check("rto after weak", rtt.rto_ms, 1650);
+  check("no strong samples", rtt.strong.samples, 0);
+
+  rtt_init(&rtt);
+  rtt_update(&rtt, 400, RTT_MAX_WEAK_RETRANSMITS + 1);
+  check("ambiguous rto", rtt.rto_ms, RTT_INITIAL_RTO_MS);
+  check("ambiguous last rtt", rtt.last_rtt_ms, 0);
+  check("ambiguous samples", rtt.weak.samples, 0);
+}
+
+static void test_limits(void) {
+  rtt_estimator_t rtt;
+  rtt_init(&rtt);
+  for (int i = 0; i < 32; i++) {
+    rtt_update(&rtt, 1, 0);
+  }
+  check("min strong rto", rtt.strong.rto_ms, RTT_MIN_RTO_MS);
+  check("min rto", rtt.rto_ms, RTT_MIN_RTO_MS);
+
+  rtt_init(&rtt);
+  rtt_update(&rtt, 60000, 0);
+  check("max strong rto", rtt.strong.rto_ms, RTT_MAX_RTO_MS);
+  check("rto toward max", rtt.rto_ms, 17000);
+}
+
+// Short timeouts back off by 3, long ones by 1.5 and the rest double
+static void test_backoff(void) {
+  rtt_estimator_t rtt;
+  rtt_init(&rtt);
+  check("default backoff", rtt_backoff_eighths(&rtt), 16);
+  check("timeout 0", rtt_timeout_ms(&rtt, 0), 2000);
+  check("timeout 1", rtt_timeout_ms(&rtt, 1), 4000);
+  check("timeout 2", rtt_timeout_ms(&rtt, 2), 8000);
+  check("timeout 4", rtt_timeout_ms(&rtt, 4), RTT_MAX_RTO_MS);
+  check("timeout 10", rtt_timeout_ms(&rtt, 10), RTT_MAX_RTO_MS);
+
+  rtt.rto_ms = 500;
+  check("short backoff", rtt_backoff_eighths(&rtt), 24);
+  check("short timeout 1", rtt_timeout_ms(&rtt, 1), 1500);
+  check("short timeout 2", rtt_timeout_ms(&rtt, 2), 4500);
+
+  rtt.rto_ms = 4000;
+  check("long backoff", rtt_backoff_eighths(&rtt), 12);
+  check("long timeout 1", rtt_timeout_ms(&rtt, 1), 6000);
+  check("long timeout 2", rtt_timeout_ms(&rtt, 2), 9000);
+}
+
+// The retransmit count keeps the exchange within the default transmit span
+static void test_max_retransmit(void) {
+  rtt_estimator_t rtt;
+  rtt_init(&rtt);
+  check("default retransmits", rtt_max_retransmit(&rtt), 4);
+  rtt.rto_ms = RTT_MIN_RTO_MS;
+  check("short retransmits", rtt_max_retransmit(&rtt), 8);
+  rtt.rto_ms = 500;
+  check("500 ms retransmits", rtt_max_retransmit(&rtt), 5);
+  rtt.rto_ms = RTT_MAX_RTO_MS;
+  check("long retransmits", rtt_max_retransmit(&rtt), 1);
+}
+
+int main(void) {
+  test_strong_samples();
+  test_weak_samples();
+  test_limits();
+  test_backoff();
+  test_max_retransmit();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,187 @@
+// Tests for the telemetry records sent with reports. Run with make test.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "reporting.h"
+#include "telemetry.h"
+
+static int failures = 0;
+
+static void check(const char *name, bool ok) {
+  if (!ok) {
+    printf("FAIL %s\n", name);
+    failures++;
+  }
+}
+
+static const telemetry_record_t *find(const telemetry_t *telemetry,
+                                      uint8_t type, size_t from) {
+  for (size_t i = from; i < telemetry->count; i++) {
+    if (telemetry->records[i].type == type) {
+      return &telemetry->records[i];
+    }
+  }
+  return NULL;
+}
+
+static uint32_t value_of(const telemetry_t *telemetry, uint8_t type) {
+  const telemetry_record_t *record = find(telemetry, type, 0);
+  if (!record || record->len != 4) {
+    return 0xffffffff;
+  }
+  return ((uint32_t)record->value[0] << 24) |
+         ((uint32_t)record->value[1] << 16) |
+         ((uint32_t)record->value[2] << 8) | record->value[3];
+}
+
+// Send the records with a report the way coap_send_report does. Only the
+// records that fit in the buffer are marked as in flight.
+static void send_report(telemetry_t *telemetry, size_t buf_size) {
+  fota_report_t report = {.telemetry = telemetry};
+  uint8_t buf[512];
+  size_t len;
+  fota_encode_report(&report, buf, buf_size, &len);
+}
+
+static void test_set_and_add(void) {
+  telemetry_t telemetry;
+  telemetry_init(&telemetry);
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 10);
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 20);
+  telemetry_add_uint32(&telemetry, TELEMETRY_RETRANSMITS, 3);
+  telemetry_add_uint32(&telemetry, TELEMETRY_RETRANSMITS, 4);
+  check("set replaces", value_of(&telemetry, TELEMETRY_UPTIME) == 20);
+  check("add accumulates", value_of(&telemetry, TELEMETRY_RETRANSMITS) == 7);
+  check("one record per type", telemetry.count == 2);
+
+  char long_error[TELEMETRY_MAX_VALUE + 20];
+  memset(long_error, 'e', sizeof(long_error) - 1);
+  long_error[sizeof(long_error) - 1] = 0;
+  telemetry_set_string(&telemetry, TELEMETRY_LAST_ERROR, long_error);
+  const telemetry_record_t *error = find(&telemetry, TELEMETRY_LAST_ERROR, 0);
+  check("string truncated", error && error->len == TELEMETRY_MAX_VALUE);
+}
+
+// The oldest record goes when the records are full, and the records in
+// flight move down with it
+static void test_full(void) {
+  telemetry_t telemetry;
+  telemetry_init(&telemetry);
+  // Records in flight aren't replaced so each of these adds a record
+  for (int i = 0; i < TELEMETRY_MAX_RECORDS; i++) {
+    telemetry_set_string(&telemetry, TELEMETRY_LAST_ERROR, "x");
+    telemetry.in_flight = telemetry.count;
+  }
+  telemetry.in_flight = 3;
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 1);
+  check("count capped", telemetry.count == TELEMETRY_MAX_RECORDS);
+  check("in flight moved", telemetry.in_flight == 2);
+  check("newest kept",
+        telemetry.records[TELEMETRY_MAX_RECORDS - 1].type == TELEMETRY_UPTIME);
+}
+
+// Records sent with an acknowledged report are removed. Records set while
+// the report was in flight stay.
+static void test_flush(void) {
+  telemetry_t telemetry;
+  telemetry_init(&telemetry);
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 10);
+  telemetry_set_uint32(&telemetry, TELEMETRY_RTO, 500);
+  telemetry_set_uint32(&telemetry, TELEMETRY_SRTT, 200);
+  // Room for the first two records only
+  send_report(&telemetry, 12);
+  check("two in flight", telemetry.in_flight == 2);
+
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 30);
+  check("new record while in flight", telemetry.count == 4);
+  telemetry_flush(&telemetry);
+  check("flushed count", telemetry.count == 2 && telemetry.in_flight == 0);
+  check("unsent kept", value_of(&telemetry, TELEMETRY_SRTT) == 200);
+  check("newer kept", value_of(&telemetry, TELEMETRY_UPTIME) == 30);
+  check("sent removed", !find(&telemetry, TELEMETRY_RTO, 0));
+}
+
+// Records from a failed report are sent again. Newer values replace them and
+// counters are added together.
+static void test_requeue(void) {
+  telemetry_t telemetry;
+  telemetry_init(&telemetry);
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 10);
+  telemetry_add_uint32(&telemetry, TELEMETRY_RETRANSMITS, 5);
+  telemetry_set_uint32(&telemetry, TELEMETRY_RTO, 500);
+  send_report(&telemetry, 512);
+  check("all in flight", telemetry.in_flight == 3);
+
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 40);
+  telemetry_add_uint32(&telemetry, TELEMETRY_RETRANSMITS, 2);
+  telemetry_set_uint32(&telemetry, TELEMETRY_SRTT, 100);
+  telemetry_requeue(&telemetry);
+  check("requeued count", telemetry.count == 4 && telemetry.in_flight == 0);
+  check("newer value wins", value_of(&telemetry, TELEMETRY_UPTIME) == 40);
+  check("counters added", value_of(&telemetry, TELEMETRY_RETRANSMITS) == 7);
+  check("sent value kept", value_of(&telemetry, TELEMETRY_RTO) == 500);
+  check("new value kept", value_of(&telemetry, TELEMETRY_SRTT) == 100);
+  for (size_t i = 0; i < telemetry.count; i++) {
+    check("no duplicates",
+          !find(&telemetry, telemetry.records[i].type, i + 1));
+  }
+}
+
+// Records saved while a report was in flight are sent again by the next run
+static void test_save_load(void) {
+  char file[] = "/tmp/fota-telemetry-XXXXXX";
+  int fd = mkstemp(file);
+  if (fd < 0) {
+    check("temporary file", false);
+    return;
+  }
+  close(fd);
+
+  telemetry_t telemetry;
+  telemetry_init(&telemetry);
+  telemetry_set_uint32(&telemetry, TELEMETRY_UPTIME, 10);
+  telemetry_add_uint32(&telemetry, TELEMETRY_RETRANSMITS, 5);
+  telemetry.in_flight = 2;
+  telemetry_add_uint32(&telemetry, TELEMETRY_RETRANSMITS, 1);
+  telemetry_set_string(&telemetry, TELEMETRY_LAST_ERROR, "timeout");
+  check("save", telemetry_save(&telemetry, file));
+
+  telemetry_t loaded;
+  check("load", telemetry_load(&loaded, file));
+  check("loaded requeued", loaded.in_flight == 0 && loaded.count == 3);
+  check("loaded value", value_of(&loaded, TELEMETRY_UPTIME) == 10);
+  check("loaded counter", value_of(&loaded, TELEMETRY_RETRANSMITS) == 6);
+  const telemetry_record_t *error = find(&loaded, TELEMETRY_LAST_ERROR, 0);
+  check("loaded string",
+        error && error->len == 7 && memcmp(error->value, "timeout", 7) == 0);
+
+  // Saving no records removes the file
+  telemetry_init(&telemetry);
+  check("save empty", telemetry_save(&telemetry, file));
+  check("empty removed", access(file, F_OK) != 0);
+  check("nothing to load", !telemetry_load(&loaded, file));
+
+  FILE *fp = fopen(file, "wb");
+  if (fp) {
+    fputs("not telemetry", fp);
+    fclose(fp);
+  }
+  check("reject invalid", !telemetry_load(&loaded, file) && loaded.count == 0);
+  unlink(file);
+}
+
+int main(void) {
+  test_set_and_add();
+  test_full();
+  test_flush();
+  test_requeue();
+  test_save_load();
+  if (failures > 0) {
+    printf("%d test(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}